@@ -7,3 +7,9 @@ int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg)
 	die(__FUNCTION__);
 	return 0;
 }
+
+int irq__update_msix_route(struct kvm *kvm, u32 gsi, struct msi_msg *msg)
+{
+	die(__FUNCTION__);
+	return 0;
+}
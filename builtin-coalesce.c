@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-coalesce.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/virtio-coalesce.h>
+
+static const char *instance_name;
+static const char *device;
+static const char *settings;
+
+static const char * const coalesce_usage[] = {
+	"lkvm coalesce [-n name] -d <device> -s <setting>[,<setting>...]",
+	NULL
+};
+
+static const struct option coalesce_options[] = {
+	OPT_GROUP("Instance options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_GROUP("Coalescing options:"),
+	OPT_STRING('d', "device", &device, "device",
+		   "Virtio device, e.g. net0 or blk1"),
+	OPT_STRING('s', "settings", &settings, "settings",
+		   "frames=<n>, usecs=<n> and adaptive, or off"),
+	OPT_END(),
+};
+
+void kvm_coalesce_help(void)
+{
+	usage_with_options(coalesce_usage, coalesce_options);
+}
+
+static void parse_coalesce_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, coalesce_options, coalesce_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_coalesce_help();
+	}
+}
+
+int kvm_cmd_coalesce(int argc, const char **argv, const char *prefix)
+{
+	struct virtio_coalesce_msg msg = { 0 };
+	int instance;
+	int r;
+
+	parse_coalesce_options(argc, argv);
+
+	if (instance_name == NULL || device == NULL || settings == NULL)
+		kvm_coalesce_help();
+
+	if (strlen(device) >= sizeof(msg.dev))
+		die("Unknown device '%s'", device);
+	strcpy(msg.dev, device);
+
+	if (virtio_coalesce__parse(&msg.params, settings) < 0)
+		die("Invalid settings '%s'", settings);
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_VIRTIO_COALESCE,
+			sizeof(msg), (u8 *)&msg);
+	if (r == 0 && read_in_full(instance, &r, sizeof(r)) != sizeof(r))
+		r = -EIO;
+
+	close(instance);
+
+	if (r < 0) {
+		pr_err("Setting the interrupt coalescing of %s failed: %d",
+		       device, r);
+		return -1;
+	}
+
+	return 0;
+}
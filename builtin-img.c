@@ -0,0 +1,702 @@
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-img.h>
+#include <kvm/parse-options.h>
+#include <kvm/disk-image.h>
+#include <kvm/read-write.h>
+#include <kvm/mutex.h>
+#include <kvm/iovec.h>
+#include <kvm/qcow.h>
+
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <linux/err.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+/*
+ * Images are written sequentially, in one pass: data clusters first, in
+ * the guest's order and without the ones that only hold zeroes, then the
+ * L2 tables, the L1 table and for qcow2 the refcounts. Worker threads each
+ * read and scan a chunk of the source at a time, and take their turn in
+ * chunk order to reserve room for its data at the end of the image.
+ */
+#define IMG_CHUNK_SIZE		(4 << 20)
+#define IMG_CLUSTER_SIZE	(64 << 10)
+#define IMG_RAW_BLOCK_SIZE	4096
+
+enum {
+	IMG_RAW,
+	IMG_QCOW1,
+	IMG_QCOW2,
+};
+
+struct img_out {
+	int			fd;
+	int			format;
+	u64			size;
+	u32			cluster_bits;
+	u64			cluster_size;
+	u64			chunk_size;
+
+	/* All L2 tables, one after the other, in the image's byte order */
+	u64			*l2;
+	u64			nr_l2;
+
+	/* Under 'lock': where the next data goes, whose turn it is */
+	struct mutex		lock;
+	pthread_cond_t		cond;
+	u64			next;
+	u64			next_chunk;
+};
+
+struct img_job {
+	struct disk_image	*src;
+	int			src_fd;		/* raw sources are read directly */
+	struct img_out		*out;
+	u64			nr_chunks;
+
+	/* Under out->lock */
+	u64			chunk;
+	int			err;
+};
+
+static const char *format_name;
+static u64 cluster_size;
+static int nr_threads;
+static bool force;
+
+static const char *args[2];
+static int nr_args;
+
+static const char * const img_usage[] = {
+	"lkvm img create [-F] [-f format] [-c cluster size] <image> <size>",
+	"lkvm img convert [-F] [-f format] [-c cluster size] [-j threads] <source> <image>",
+	"lkvm img compact [-j threads] <image>",
+	NULL
+};
+
+static int img_parse_cluster_size(const struct option *opt, const char *arg,
+				  int unset)
+{
+	cluster_size = disk_image__parse_size(arg);
+
+	return 0;
+}
+
+static const struct option img_options[] = {
+	OPT_GROUP("Image options:"),
+	OPT_STRING('f', "format", &format_name, "raw|qcow1|qcow2",
+		   "Format of the new image, qcow2 by default"),
+	OPT_CALLBACK('c', "cluster-size", NULL, "size",
+		     "Cluster size of new qcow images, 64K by default",
+		     img_parse_cluster_size, NULL),
+	OPT_INTEGER('j', "jobs", &nr_threads,
+		    "Threads copying data, one per CPU by default"),
+	OPT_BOOLEAN('F', "force", &force, "Overwrite an existing image"),
+	OPT_END(),
+};
+
+void kvm_img_help(void)
+{
+	usage_with_options(img_usage, img_options);
+}
+
+static void parse_img_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, img_options, img_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc == 0)
+			break;
+		if (nr_args == ARRAY_SIZE(args))
+			kvm_img_help();
+		args[nr_args++] = argv[0];
+		argv++;
+		argc--;
+	}
+}
+
+static int img_parse_format(const char *name)
+{
+	if (!name || !strcmp(name, "qcow2"))
+		return IMG_QCOW2;
+	if (!strcmp(name, "qcow1"))
+		return IMG_QCOW1;
+	if (!strcmp(name, "raw"))
+		return IMG_RAW;
+
+	die("Unknown image format '%s'", name);
+}
+
+/* Tell qcow images from raw ones, and their cluster size */
+static int img_probe_format(int fd, u32 *cluster_bits)
+{
+	struct qcow2_header_disk h2;
+	struct qcow1_header_disk h1;
+
+	if (pread_in_full(fd, &h2, sizeof(h2), 0) != sizeof(h2) ||
+	    be32_to_cpu(h2.magic) != QCOW_MAGIC)
+		return IMG_RAW;
+
+	switch (be32_to_cpu(h2.version)) {
+	case QCOW1_VERSION:
+		if (pread_in_full(fd, &h1, sizeof(h1), 0) != sizeof(h1))
+			return IMG_RAW;
+		*cluster_bits = h1.cluster_bits;
+		return IMG_QCOW1;
+	case QCOW2_VERSION:
+		*cluster_bits = be32_to_cpu(h2.cluster_bits);
+		return IMG_QCOW2;
+	}
+
+	return IMG_RAW;
+}
+
+static int img_out_init(struct img_out *out, int fd, int format, u64 size,
+			u64 cluster_size)
+{
+	u64 l2_entries;
+
+	*out = (struct img_out) {
+		.fd		= fd,
+		.format		= format,
+		.size		= size,
+	};
+
+	mutex_init(&out->lock);
+	pthread_cond_init(&out->cond, NULL);
+
+	if (format == IMG_RAW) {
+		out->chunk_size = IMG_CHUNK_SIZE;
+		out->cluster_size = IMG_RAW_BLOCK_SIZE;
+		return ftruncate(fd, size) < 0 ? -errno : 0;
+	}
+
+	/*
+	 * qcow1 tables are one cluster here too, and qcow1 readers take
+	 * clusters of at most 64K.
+	 */
+	if (!cluster_size)
+		cluster_size = IMG_CLUSTER_SIZE;
+	if (cluster_size & (cluster_size - 1) || cluster_size < 512 ||
+	    cluster_size > (format == IMG_QCOW1 ? 64 << 10 : 2 << 20)) {
+		pr_err("Invalid cluster size %llu", (unsigned long long)cluster_size);
+		return -EINVAL;
+	}
+
+	out->cluster_bits	= ffsll(cluster_size) - 1;
+	out->cluster_size	= cluster_size;
+	out->chunk_size		= max_t(u64, IMG_CHUNK_SIZE, cluster_size);
+
+	/* Cluster 0 holds the header */
+	out->next		= cluster_size;
+
+	l2_entries = cluster_size / sizeof(u64);
+	out->nr_l2 = DIV_ROUND_UP(DIV_ROUND_UP(size, cluster_size), l2_entries);
+	out->l2 = calloc(out->nr_l2 * l2_entries, sizeof(u64));
+	if (!out->l2)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static bool img_is_zero(void *buf, u64 len)
+{
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= len,
+	};
+
+	return iov_is_zero(&iov, 1);
+}
+
+/* Raw images are sparse: only write the blocks that aren't zero */
+static int img_write_raw(struct img_out *out, u8 *buf, u64 offset, u64 len)
+{
+	u64 start, end, block = out->cluster_size;
+
+	for (start = 0; start < len; start = end) {
+		while (start < len &&
+		       img_is_zero(buf + start, min(block, len - start)))
+			start += block;
+
+		for (end = start; end < len; end += block)
+			if (img_is_zero(buf + end, min(block, len - end)))
+				break;
+		end = min(end, len);
+
+		if (start < end &&
+		    pwrite_in_full(out->fd, buf + start, end - start,
+				   offset + start) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Pack the chunk's non-zero clusters at the start of 'buf', wait for the
+ * previous chunk to have reserved its room, and write them in one go right
+ * after it. 'err' set means the chunk is only passing its turn.
+ */
+static int img_write_qcow(struct img_out *out, u64 chunk, u8 *buf, u64 len,
+			  int err)
+{
+	u64 cs = out->cluster_size;
+	u64 first = chunk * (out->chunk_size / cs);
+	u64 nr = DIV_ROUND_UP(len, cs);
+	u64 i, n = 0, host, entry;
+
+	for (i = 0; i < nr && !err; i++) {
+		if (img_is_zero(buf + i * cs, min(cs, len - i * cs)))
+			continue;
+
+		if (n != i)
+			memcpy(buf + n * cs, buf + i * cs, min(cs, len - i * cs));
+		if (len - i * cs < cs)
+			memset(buf + n * cs + len - i * cs, 0, cs - (len - i * cs));
+
+		/* Remember the guest cluster, the host offset comes later */
+		out->l2[first + i] = n + 1;
+		n++;
+	}
+
+	mutex_lock(&out->lock);
+	while (out->next_chunk != chunk)
+		pthread_cond_wait(&out->cond, &out->lock.mutex);
+	host = out->next;
+	out->next += n * cs;
+	out->next_chunk++;
+	pthread_cond_broadcast(&out->cond);
+	mutex_unlock(&out->lock);
+
+	if (err || !n)
+		return err;
+
+	for (i = 0; i < nr; i++) {
+		if (!out->l2[first + i])
+			continue;
+
+		entry = host + (out->l2[first + i] - 1) * cs;
+		if (out->format == IMG_QCOW2)
+			entry |= QCOW2_OFLAG_COPIED;
+		out->l2[first + i] = cpu_to_be64(entry);
+	}
+
+	if (pwrite_in_full(out->fd, buf, n * cs, host) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int img_read(struct img_job *job, u8 *buf, u64 offset, u64 len)
+{
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= len,
+	};
+
+	if (job->src_fd >= 0)
+		return pread_in_full(job->src_fd, buf, len, offset) == (ssize_t)len ?
+			0 : -EIO;
+
+	/* The size of qcow images is whole sectors */
+	iov.iov_len = ALIGN(len, SECTOR_SIZE);
+
+	return disk_image__read_sync(job->src, offset >> SECTOR_SHIFT, &iov, 1);
+}
+
+static void *img_thread(void *p)
+{
+	struct img_job *job = p;
+	struct img_out *out = job->out;
+	u64 chunk, offset, len;
+	u8 *buf;
+	int r;
+
+	buf = malloc(ALIGN(out->chunk_size, SECTOR_SIZE));
+	if (!buf) {
+		mutex_lock(&out->lock);
+		job->err = -ENOMEM;
+		mutex_unlock(&out->lock);
+	}
+
+	while (1) {
+		mutex_lock(&out->lock);
+		chunk = job->chunk++;
+		r = job->err;
+		mutex_unlock(&out->lock);
+
+		if (chunk >= job->nr_chunks)
+			break;
+
+		offset = chunk * out->chunk_size;
+		len = min(out->chunk_size, out->size - offset);
+
+		/* Chunks after an error still have to take their turn */
+		if (!r)
+			r = img_read(job, buf, offset, len);
+
+		if (out->format != IMG_RAW)
+			r = img_write_qcow(out, chunk, buf, len, r);
+		else if (!r)
+			r = img_write_raw(out, buf, offset, len);
+
+		if (r) {
+			mutex_lock(&out->lock);
+			if (!job->err)
+				job->err = r;
+			mutex_unlock(&out->lock);
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static int img_copy(struct img_job *job)
+{
+	pthread_t *threads;
+	int i, n = nr_threads;
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	n = max_t(u64, 1, min_t(u64, n, job->nr_chunks));
+
+	threads = calloc(n, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++)
+		if (pthread_create(&threads[i], NULL, img_thread, job))
+			die("Failed creating threads");
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	return job->err;
+}
+
+/* Write the L2 tables that aren't empty, then the L1 table, at out->next */
+static int img_write_tables(struct img_out *out, u64 *l1_offset, u32 *l1_size)
+{
+	u64 l2_entries = out->cluster_size / sizeof(u64);
+	u64 table_size = out->cluster_size;
+	u64 *l1, *l2, i;
+	int r = 0;
+
+	l1 = calloc(out->nr_l2, sizeof(u64));
+	if (!l1)
+		return -ENOMEM;
+
+	for (i = 0; i < out->nr_l2; i++) {
+		l2 = out->l2 + i * l2_entries;
+		if (img_is_zero(l2, table_size))
+			continue;
+
+		if (pwrite_in_full(out->fd, l2, table_size, out->next) < 0) {
+			r = -errno;
+			goto out;
+		}
+
+		l1[i] = out->next;
+		if (out->format == IMG_QCOW2)
+			l1[i] |= QCOW2_OFLAG_COPIED;
+		l1[i] = cpu_to_be64(l1[i]);
+		out->next += table_size;
+	}
+
+	*l1_offset = out->next;
+	*l1_size = out->nr_l2;
+	if (pwrite_in_full(out->fd, l1, out->nr_l2 * sizeof(u64), out->next) < 0)
+		r = -errno;
+	out->next += ALIGN(out->nr_l2 * sizeof(u64), out->cluster_size);
+
+out:
+	free(l1);
+
+	return r;
+}
+
+/*
+ * Every cluster is used exactly once, including the refcount blocks and
+ * table themselves, which come last.
+ */
+static int img_write_refcounts(struct img_out *out, u64 *rft_offset,
+			       u32 *rft_clusters)
+{
+	u64 cs = out->cluster_size, per_block = cs / sizeof(u16);
+	u64 nr_used = out->next / cs, nr_blocks = 0, nr_table = 0, total, i;
+	u64 *table;
+	u16 *block;
+	int r = 0;
+
+	do {
+		total = nr_used + nr_blocks + nr_table;
+		nr_blocks = DIV_ROUND_UP(total, per_block);
+		nr_table = DIV_ROUND_UP(nr_blocks * sizeof(u64), cs);
+	} while (total != nr_used + nr_blocks + nr_table);
+
+	block = malloc(cs);
+	table = calloc(nr_table, cs);
+	if (!block || !table) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_blocks; i++) {
+		u64 j, n = min(per_block, total - i * per_block);
+
+		memset(block, 0, cs);
+		for (j = 0; j < n; j++)
+			block[j] = cpu_to_be16(1);
+
+		table[i] = cpu_to_be64(out->next);
+		if (pwrite_in_full(out->fd, block, cs, out->next) < 0) {
+			r = -errno;
+			goto out;
+		}
+		out->next += cs;
+	}
+
+	*rft_offset = out->next;
+	*rft_clusters = nr_table;
+	if (pwrite_in_full(out->fd, table, nr_table * cs, out->next) < 0)
+		r = -errno;
+	out->next += nr_table * cs;
+
+out:
+	free(table);
+	free(block);
+
+	return r;
+}
+
+static int img_write_header(struct img_out *out)
+{
+	struct qcow2_header_disk h2;
+	struct qcow1_header_disk h1;
+	u64 l1_offset = 0, rft_offset = 0;
+	u32 l1_size = 0, rft_clusters = 0;
+	int r;
+
+	r = img_write_tables(out, &l1_offset, &l1_size);
+	if (r < 0)
+		return r;
+
+	if (out->format == IMG_QCOW1) {
+		h1 = (struct qcow1_header_disk) {
+			.magic			= cpu_to_be32(QCOW_MAGIC),
+			.version		= cpu_to_be32(QCOW1_VERSION),
+			.size			= cpu_to_be64(out->size),
+			.cluster_bits		= out->cluster_bits,
+			.l2_bits		= out->cluster_bits - 3,
+			.l1_table_offset	= cpu_to_be64(l1_offset),
+		};
+
+		if (pwrite_in_full(out->fd, &h1, sizeof(h1), 0) < 0)
+			return -errno;
+
+		return 0;
+	}
+
+	r = img_write_refcounts(out, &rft_offset, &rft_clusters);
+	if (r < 0)
+		return r;
+
+	h2 = (struct qcow2_header_disk) {
+		.magic			= cpu_to_be32(QCOW_MAGIC),
+		.version		= cpu_to_be32(QCOW2_VERSION),
+		.cluster_bits		= cpu_to_be32(out->cluster_bits),
+		.size			= cpu_to_be64(out->size),
+		.l1_size		= cpu_to_be32(l1_size),
+		.l1_table_offset	= cpu_to_be64(l1_offset),
+		.refcount_table_offset	= cpu_to_be64(rft_offset),
+		.refcount_table_clusters = cpu_to_be32(rft_clusters),
+	};
+
+	if (pwrite_in_full(out->fd, &h2, sizeof(h2), 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Write an image of 'size' bytes to 'fd', with the data of 'src' if any */
+static int img_write(int fd, int format, u64 size, u64 cluster_size,
+		     const char *src)
+{
+	struct disk_image_params params = {
+		.filename	= src,
+		.readonly	= true,
+		.zcache_mb	= -1,
+	};
+	struct img_job job = {
+		.src_fd		= -1,
+	};
+	struct img_out out;
+	u32 src_bits = 0;
+	int r;
+
+	if (src) {
+		job.src_fd = open(src, O_RDONLY);
+		if (job.src_fd < 0)
+			return -errno;
+
+		if (img_probe_format(job.src_fd, &src_bits) != IMG_RAW) {
+			close(job.src_fd);
+			job.src_fd = -1;
+
+			job.src = disk_image__open(&params);
+			if (IS_ERR_OR_NULL(job.src))
+				return job.src ? PTR_ERR(job.src) : -EINVAL;
+			size = job.src->size;
+		} else {
+			size = lseek(job.src_fd, 0, SEEK_END);
+			posix_fadvise(job.src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+	}
+
+	r = img_out_init(&out, fd, format, size, cluster_size);
+	if (r < 0)
+		goto out;
+
+	job.out = &out;
+	if (src) {
+		job.nr_chunks = DIV_ROUND_UP(size, out.chunk_size);
+		r = img_copy(&job);
+		if (r < 0)
+			goto out;
+	}
+
+	if (format != IMG_RAW) {
+		r = img_write_header(&out);
+		if (r < 0)
+			goto out;
+	}
+
+	if (fsync(fd) < 0)
+		r = -errno;
+
+out:
+	free(out.l2);
+	if (job.src)
+		disk_image__close(job.src);
+	if (job.src_fd >= 0)
+		close(job.src_fd);
+
+	return r;
+}
+
+/*
+ * Existing images are only overwritten with --force, and never by their
+ * own conversion. A failure only removes the image if it is a new one.
+ */
+static int img_create(const char *image, const char *size, const char *src)
+{
+	struct stat st, src_st;
+	bool created;
+	int fd, r;
+
+	if (src && stat(src, &src_st) < 0)
+		return -errno;
+
+	created = stat(image, &st) < 0;
+	if (!created) {
+		if (!force)
+			return -EEXIST;
+		if (src && st.st_dev == src_st.st_dev && st.st_ino == src_st.st_ino)
+			return -EINVAL;
+	}
+
+	fd = open(image, O_RDWR | O_CREAT | (created ? O_EXCL : O_TRUNC), 0644);
+	if (fd < 0)
+		return -errno;
+
+	r = img_write(fd, img_parse_format(format_name), size ?
+		      disk_image__parse_size(size) : 0, cluster_size, src);
+	close(fd);
+
+	if (r < 0 && created)
+		unlink(image);
+
+	return r;
+}
+
+/*
+ * Rewrite the image next to itself and move the copy over it: only the
+ * clusters that are referenced and hold data are left, in guest order.
+ */
+static int img_compact(const char *image)
+{
+	char tmp[PATH_MAX];
+	struct stat st;
+	u32 cluster_bits = 0;
+	int fd, format, r;
+
+	fd = open(image, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	format = img_probe_format(fd, &cluster_bits);
+	r = fstat(fd, &st);
+	close(fd);
+	if (r < 0)
+		return -errno;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", image) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -errno;
+
+	r = img_write(fd, format, 0, format == IMG_RAW ? 0 : 1ULL << cluster_bits,
+		      image);
+	if (r == 0 && fchmod(fd, st.st_mode & 07777) < 0)
+		r = -errno;
+	close(fd);
+
+	if (r == 0 && rename(tmp, image) < 0)
+		r = -errno;
+	if (r < 0)
+		unlink(tmp);
+
+	return r;
+}
+
+int kvm_cmd_img(int argc, const char **argv, const char *prefix)
+{
+	const char *cmd;
+	int r;
+
+	if (argc == 0)
+		kvm_img_help();
+
+	cmd = argv[0];
+	parse_img_options(argc - 1, argv + 1);
+
+	if (!strcmp(cmd, "create") && nr_args == 2)
+		r = img_create(args[0], args[1], NULL);
+	else if (!strcmp(cmd, "convert") && nr_args == 2)
+		r = img_create(args[1], NULL, args[0]);
+	else if (!strcmp(cmd, "compact") && nr_args == 1)
+		r = img_compact(args[0]);
+	else
+		kvm_img_help();
+
+	if (r < 0)
+		pr_err("%s failed: %s", cmd, strerror(-r));
+
+	return r;
+}
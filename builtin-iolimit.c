@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-iolimit.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm.h>
+#include <kvm/kvm-ipc.h>
+#include <kvm/disk-image.h>
+
+static const char *instance_name;
+static int disk;
+static const char *limits;
+
+static const char * const iolimit_usage[] = {
+	"lkvm iolimit [-n name] [-d disk] -l <limit>[,<limit>...]",
+	NULL
+};
+
+static const struct option iolimit_options[] = {
+	OPT_GROUP("Instance options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_GROUP("Limit options:"),
+	OPT_INTEGER('d', "disk", &disk, "Index of the disk, from 0"),
+	OPT_STRING('l', "limits", &limits, "limits",
+		   "iops_rd, iops_wr, bps_rd, bps_wr and their _burst, or none"),
+	OPT_END(),
+};
+
+void kvm_iolimit_help(void)
+{
+	usage_with_options(iolimit_usage, iolimit_options);
+}
+
+static void parse_iolimit_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, iolimit_options, iolimit_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_iolimit_help();
+	}
+}
+
+int kvm_cmd_iolimit(int argc, const char **argv, const char *prefix)
+{
+	struct disk_image_qos_msg msg = { 0 };
+	char *list, *cur;
+	int instance;
+	int r;
+
+	parse_iolimit_options(argc, argv);
+
+	if (instance_name == NULL || limits == NULL || disk < 0)
+		kvm_iolimit_help();
+
+	msg.disk = disk;
+
+	/* The limits given replace all of the disk's current ones */
+	if (strcmp(limits, "none")) {
+		list = strdup(limits);
+		if (!list)
+			die("Out of memory");
+
+		for (cur = strtok(list, ","); cur; cur = strtok(NULL, ","))
+			if (!disk_image__qos_parse(&msg.qos, cur))
+				die("Unknown I/O limit '%s'", cur);
+
+		free(list);
+	}
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_DISK_QOS,
+			sizeof(msg), (u8 *)&msg);
+	if (r == 0 && read_in_full(instance, &r, sizeof(r)) != sizeof(r))
+		r = -EIO;
+
+	close(instance);
+
+	if (r < 0) {
+		pr_err("Setting the limits of disk %d failed: %d", disk, r);
+		return -1;
+	}
+
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include "kvm/vnc.h"
 #include "kvm/guest_compat.h"
 #include "kvm/pci-shmem.h"
+#include "kvm/virtio-coalesce.h"
 #include "kvm/kvm-ipc.h"
 #include "kvm/builtin-debug.h"
 
@@ -119,6 +120,10 @@ void kvm_run_set_wrapper_sandbox(void)
 	OPT_CALLBACK('\0', "9p", NULL, "dir_to_share,tag_name",		\
 		     "Enable virtio 9p to share files between host and"	\
 		     " guest", virtio_9p_rootdir_parser, kvm),		\
+	OPT_CALLBACK('\0', "irq-coalesce", NULL, "dev:settings",	\
+		     "Moderate the interrupts of a virtio device, e.g."	\
+		     " net0:usecs=50,frames=32,adaptive",		\
+		     irq_coalesce_parser, kvm),				\
 	OPT_STRING('\0', "console", &(cfg)->console, "serial, virtio or"\
 			" hv", "Console to use"),			\
 	OPT_STRING('\0', "dev", &(cfg)->dev, "device_file",		\
@@ -4,6 +4,7 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/disk-image.h>
 
 #include <sys/select.h>
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include <linux/virtio_balloon.h>
 
 static bool mem;
+static bool disk;
 static bool all;
 static const char *instance_name;
 
@@ -24,6 +26,7 @@ static const char * const stat_usage[] = {
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('d', "disk", &disk, "Display disk cache statistics"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -97,6 +100,68 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static int do_diskstat(const char *name, int sock)
+{
+	static const char * const cache_names[DISK_IMAGE_CACHE_NR] = {
+		[DISK_IMAGE_CACHE_L2]		= "L2 tables",
+		[DISK_IMAGE_CACHE_REFCOUNT]	= "Refcount blocks",
+		[DISK_IMAGE_CACHE_DECOMPRESSED]	= "Decompressed clusters",
+	};
+	struct disk_image_cache_stats stats[MAX_DISK_IMAGES][DISK_IMAGE_CACHE_NR];
+	struct disk_image_poll_stats poll;
+	u32 nr, nr_poll, i, j;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_DISK_STAT);
+	if (r < 0)
+		return r;
+
+	r = read_in_full(sock, &nr, sizeof(nr));
+	if (r < 0 || nr > MAX_DISK_IMAGES) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		return -1;
+	}
+
+	r = read_in_full(sock, stats, nr * sizeof(stats[0]));
+	if (r < 0)
+		return r;
+
+	printf("\n\n\t*** Disk cache statistics ***\n\n");
+	for (i = 0; i < nr; i++) {
+		printf("Disk %u:\n", i);
+		for (j = 0; j < DISK_IMAGE_CACHE_NR; j++) {
+			if (!stats[i][j].max_cached)
+				continue;
+
+			printf("  %-24s%llu hits, %llu misses, %u/%u cached\n",
+			       cache_names[j],
+			       (unsigned long long)stats[i][j].hits,
+			       (unsigned long long)stats[i][j].misses,
+			       stats[i][j].nr_cached, stats[i][j].max_cached);
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		r = read_in_full(sock, &nr_poll, sizeof(nr_poll));
+		if (r < 0)
+			return r;
+
+		for (j = 0; j < nr_poll; j++) {
+			r = read_in_full(sock, &poll, sizeof(poll));
+			if (r < 0)
+				return r;
+
+			printf("Disk %u queue %u polling: %llu hits, %llu misses, "
+			       "%u ns window\n", i, j,
+			       (unsigned long long)poll.hits,
+			       (unsigned long long)poll.misses, poll.window_ns);
+		}
+	}
+	printf("\n");
+
+	return 0;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -104,11 +169,16 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (!mem && !disk)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all) {
+		if (mem)
+			r = kvm__enumerate_instances(do_memstat);
+		if (disk && r >= 0)
+			r = kvm__enumerate_instances(do_diskstat);
+		return r;
+	}
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -120,6 +190,8 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	if (mem)
 		r = do_memstat(instance_name, instance);
+	if (disk && r >= 0)
+		r = do_diskstat(instance_name, instance);
 
 	close(instance);
 
@@ -167,6 +167,19 @@ int main(void)
 }
 endef
 
+define SOURCE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+int main(void)
+{
+	struct io_uring_params p = { .flags = IORING_SETUP_SQPOLL };
+	struct io_uring_sqe sqe = { .opcode = IORING_OP_WRITE_FIXED };
+
+	return syscall(__NR_io_uring_setup, 1, &p) + sqe.opcode;
+}
+endef
+
 define SOURCE_STATIC
 #include <stdlib.h>
 
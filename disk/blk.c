@@ -3,12 +3,31 @@
 #include <linux/err.h>
 #include <mntent.h>
 
+static int blkdev__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			   int flags)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	/* BLKDISCARD doesn't promise zeroes, BLKZEROOUT unmaps when it can */
+	if (flags & DISK_IMAGE_DISCARD_ZERO) {
+		if (ioctl(disk->fd, BLKZEROOUT, range) < 0)
+			return -errno;
+		return 0;
+	}
+
+	if (ioctl(disk->fd, BLKDISCARD, range) < 0 && errno != EOPNOTSUPP)
+		return -errno;
+
+	return 0;
+}
+
 /*
  * raw image and blk dev are similar, so reuse raw image ops.
  */
 static struct disk_image_operations blk_dev_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.discard	= blkdev__discard,
 };
 
 static bool is_mounted(struct stat *st)
@@ -2,6 +2,8 @@
 #include "kvm/qcow.h"
 #include "kvm/virtio-blk.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/iovec.h"
 
 #include <linux/err.h>
 #include <sys/eventfd.h>
@@ -11,7 +13,38 @@
 
 int debug_iodelay;
 
-static int disk_image__close(struct disk_image *disk);
+/* Parse a number with an optional K, M or G suffix */
+u64 disk_image__parse_size(const char *arg)
+{
+	char *end;
+	u64 size;
+
+	size = strtoull(arg, &end, 10);
+	switch (*end) {
+	case 'G':
+	case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		size <<= 10;
+	}
+
+	return size;
+}
+
+/* Parse a metadata cache size: bytes, with an optional suffix, or "all" */
+static u64 disk_image__parse_cache_size(const char *arg)
+{
+	if (strncmp(arg, "all", 3) == 0)
+		return DISK_IMAGE_CACHE_ALL;
+
+	return disk_image__parse_size(arg);
+}
 
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 {
@@ -20,9 +53,10 @@ int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 	struct kvm *kvm = opt->ptr;
 
 	if (kvm->cfg.image_count >= MAX_DISK_IMAGES)
-		die("Currently only 4 images are supported");
+		die("Currently only %d images are supported", MAX_DISK_IMAGES);
 
 	kvm->cfg.disk_image[kvm->cfg.image_count].filename = arg;
+	kvm->cfg.disk_image[kvm->cfg.image_count].zcache_mb = -1;
 	cur = arg;
 
 	if (strncmp(arg, "scsi:", 5) == 0) {
@@ -42,8 +76,39 @@ int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 		if (sep) {
 			if (strncmp(sep + 1, "ro", 2) == 0)
 				kvm->cfg.disk_image[kvm->cfg.image_count].readonly = true;
+			else if (strncmp(sep + 1, "rw", 2) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].rw = true;
 			else if (strncmp(sep + 1, "direct", 6) == 0)
 				kvm->cfg.disk_image[kvm->cfg.image_count].direct = true;
+			else if (strncmp(sep + 1, "mmap", 4) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].mmap = true;
+			else if (strncmp(sep + 1, "scsi", 4) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].scsi = true;
+			else if (strncmp(sep + 1, "detect_zeroes", 13) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].detect_zeroes = true;
+			else if (strncmp(sep + 1, "mq=", 3) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].queues = atoi(sep + 4);
+			else if (strncmp(sep + 1, "aio=io_uring", 12) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].aio = DISK_IMAGE_AIO_IO_URING;
+			else if (strncmp(sep + 1, "poll=", 5) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].poll_us = atoi(sep + 6);
+			else if (strncmp(sep + 1, "poll", 4) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].poll_us =
+					DISK_IMAGE_POLL_DEFAULT_US;
+			else if (strncmp(sep + 1, "sqpoll", 6) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].sqpoll = true;
+			else if (strncmp(sep + 1, "zcache=", 7) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].zcache_mb = atoi(sep + 8);
+			else if (strncmp(sep + 1, "l2cache=", 8) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].l2_cache_size =
+					disk_image__parse_cache_size(sep + 9);
+			else if (strncmp(sep + 1, "refcache=", 9) == 0)
+				kvm->cfg.disk_image[kvm->cfg.image_count].refcount_cache_size =
+					disk_image__parse_cache_size(sep + 10);
+			else if (!disk_image__qos_parse(&kvm->cfg.disk_image[kvm->cfg.image_count].qos,
+							sep + 1))
+				die("Unknown disk option '%.*s'",
+				    (int)strcspn(sep + 1, ","), sep + 1);
 			*sep = 0;
 			cur = sep + 1;
 		}
@@ -55,21 +120,35 @@ int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 }
 
 #ifdef CONFIG_HAS_AIO
-static void *disk_image__thread(void *param)
+static int disk_image__reap_aio(struct disk_image *disk)
 {
-	struct disk_image *disk = param;
+	struct disk_image_completion c[AIO_MAX];
 	struct io_event event[AIO_MAX];
 	struct timespec notime = {0};
 	int nr, i;
+
+	nr = io_getevents(disk->ctx, 0, ARRAY_SIZE(event), event, &notime);
+	if (nr <= 0)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		c[i].param	= event[i].data;
+		c[i].len	= event[i].res;
+	}
+	disk_image__complete(disk, c, nr);
+
+	return nr;
+}
+
+static void *disk_image__thread(void *param)
+{
+	struct disk_image *disk = param;
 	u64 dummy;
 
 	kvm__set_thread_name("disk-image-io");
 
-	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
-		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
-		for (i = 0; i < nr; i++)
-			disk->disk_req_cb(event[i].data, event[i].res);
-	}
+	while (read(disk->evt, &dummy, sizeof(dummy)) > 0)
+		disk_image__reap_aio(disk);
 
 	return NULL;
 }
@@ -92,6 +171,8 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		.ops	= ops,
 	};
 
+	mutex_init(&disk->qos_lock);
+
 	if (use_mmap == DISK_IMAGE_MMAP) {
 		/*
 		 * The write to disk image will be discarded
@@ -102,6 +183,19 @@ struct disk_image *disk_image__new(int fd, u64 size,
 			free(disk);
 			return ERR_PTR(r);
 		}
+	} else if (use_mmap == DISK_IMAGE_MMAP_SHARED) {
+		/*
+		 * Writes go to the image, and reach it on disk with msync()
+		 */
+		disk->priv = mmap(NULL, size, PROT_RW, MAP_SHARED, fd, 0);
+		if (disk->priv == MAP_FAILED) {
+			r = -errno;
+			free(disk);
+			return ERR_PTR(r);
+		}
+
+		mutex_init(&disk->mmap_lock);
+		disk->dirty_start = size;
 	}
 
 #ifdef CONFIG_HAS_AIO
@@ -121,17 +215,18 @@ struct disk_image *disk_image__new(int fd, u64 size,
 	return disk;
 }
 
-static struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct)
+struct disk_image *disk_image__open(struct disk_image_params *params)
 {
+	const char *filename = params->filename;
 	struct disk_image *disk;
 	struct stat st;
 	int fd, flags;
 
-	if (readonly)
+	if (params->readonly)
 		flags = O_RDONLY;
 	else
 		flags = O_RDWR;
-	if (direct)
+	if (params->direct)
 		flags |= O_DIRECT;
 
 	if (stat(filename, &st) < 0)
@@ -146,15 +241,17 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 	if (fd < 0)
 		return ERR_PTR(fd);
 
-	/* qcow image ?*/
-	disk = qcow_probe(fd, true);
+	/* qcow image ? Writing to it is new, and only done when asked for */
+	disk = qcow_probe(fd, params->readonly || !params->rw, params);
 	if (!IS_ERR_OR_NULL(disk)) {
-		pr_warning("Forcing read-only support for QCOW");
+		if (!params->readonly && !params->rw)
+			pr_warning("Forcing read-only support for QCOW, add ',rw' "
+				   "to write to '%s'", filename);
 		return disk;
 	}
 
 	/* raw image ?*/
-	disk = raw_image__probe(fd, &st, readonly);
+	disk = raw_image__probe(fd, &st, params);
 	if (!IS_ERR_OR_NULL(disk))
 		return disk;
 
@@ -164,14 +261,38 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 	return ERR_PTR(-ENOSYS);
 }
 
+static void disk_image__setup_aio(struct kvm *kvm, struct disk_image *disk,
+				  struct disk_image_params *params)
+{
+	if (params->aio != DISK_IMAGE_AIO_IO_URING)
+		return;
+
+	if (disk->ops->read == raw_image__read_mmap) {
+		pr_warning("'%s': mapped images don't use an I/O engine",
+			   params->filename);
+		return;
+	}
+
+#ifdef CONFIG_HAS_IO_URING
+	{
+		int r = disk_uring__init(kvm, disk, params->sqpoll);
+
+		if (r < 0)
+			pr_warning("'%s': io_uring unavailable (%d), using the "
+				   "default I/O engine", params->filename, r);
+	}
+#else
+	pr_warning("'%s': io_uring support was not compiled in",
+		   params->filename);
+#endif
+}
+
 static struct disk_image **disk_image__open_all(struct kvm *kvm)
 {
 	struct disk_image **disks;
 	const char *filename;
 	const char *wwpn;
 	const char *tpgt;
-	bool readonly;
-	bool direct;
 	void *err;
 	int i;
 	struct disk_image_params *params = (struct disk_image_params *)&kvm->cfg.disk_image;
@@ -188,13 +309,11 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 
 	for (i = 0; i < count; i++) {
 		filename = params[i].filename;
-		readonly = params[i].readonly;
-		direct = params[i].direct;
 		wwpn = params[i].wwpn;
 		tpgt = params[i].tpgt;
 
 		if (wwpn) {
-			disks[i] = malloc(sizeof(struct disk_image));
+			disks[i] = calloc(1, sizeof(struct disk_image));
 			if (!disks[i])
 				return ERR_PTR(-ENOMEM);
 			disks[i]->wwpn = wwpn;
@@ -205,13 +324,20 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		if (!filename)
 			continue;
 
-		disks[i] = disk_image__open(filename, readonly, direct);
+		disks[i] = disk_image__open(&params[i]);
 		if (IS_ERR_OR_NULL(disks[i])) {
 			pr_err("Loading disk image '%s' failed", filename);
 			err = disks[i];
 			goto error;
 		}
 		disks[i]->debug_iodelay = kvm->cfg.debug_iodelay;
+		disks[i]->queues = params[i].queues;
+		disks[i]->scsi = params[i].scsi;
+		disks[i]->detect_zeroes = params[i].detect_zeroes &&
+					  disks[i]->ops->discard;
+		disks[i]->poll_ns = params[i].poll_us * 1000;
+		disk_image__qos_set(disks[i], &params[i].qos);
+		disk_image__setup_aio(kvm, disks[i], &params[i]);
 	}
 
 	return disks;
@@ -232,12 +358,43 @@ int disk_image__flush(struct disk_image *disk)
 	return fsync(disk->fd);
 }
 
-static int disk_image__close(struct disk_image *disk)
+/*
+ * Discard or zero 'nr_sectors' sectors starting at 'sector', according to
+ * the DISK_IMAGE_DISCARD_* flags. This is done synchronously.
+ */
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			int flags)
+{
+	u64 disk_sectors = disk->size >> SECTOR_SHIFT;
+
+	if (!disk->ops->discard)
+		return -EOPNOTSUPP;
+
+	if (sector > disk_sectors || nr_sectors > disk_sectors - sector)
+		return -EINVAL;
+
+	if (!nr_sectors)
+		return 0;
+
+	return disk->ops->discard(disk, sector, nr_sectors, flags);
+}
+
+int disk_image__close(struct disk_image *disk)
 {
 	/* If there was no disk image then there's nothing to do: */
 	if (!disk)
 		return 0;
 
+	/* vhost-scsi targets aren't opened here, there's only the struct */
+	if (disk->wwpn) {
+		free(disk);
+		return 0;
+	}
+
+#ifdef CONFIG_HAS_IO_URING
+	disk_uring__exit(disk);
+#endif
+
 	if (disk->ops->close)
 		return disk->ops->close(disk);
 
@@ -285,6 +442,47 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector,
 	return total;
 }
 
+/*
+ * Fill iov with disk data whatever the I/O engine of 'disk', for images
+ * layered over it. Only raw images and block devices are asynchronous,
+ * and they map sectors straight onto their file. Returns 0 once iov is
+ * filled entirely.
+ */
+int disk_image__read_sync(struct disk_image *disk, u64 sector,
+			  const struct iovec *iov, int iovcount)
+{
+	ssize_t len = iov_size(iov, iovcount);
+	ssize_t total;
+
+	if (disk->async)
+		total = preadv_in_full(disk->fd, iov, iovcount,
+				       sector << SECTOR_SHIFT);
+	else
+		total = disk_image__read(disk, sector, iov, iovcount, NULL);
+
+	return total == len ? 0 : -EIO;
+}
+
+/*
+ * With detect_zeroes, a write of nothing but zeroes deallocates its range
+ * instead: raw images get a hole, qcow2 ones unallocated clusters. Returns
+ * a negative value if the data has to be written after all.
+ */
+static ssize_t disk_image__write_zeroes(struct disk_image *disk, u64 sector,
+					const struct iovec *iov, int iovcount)
+{
+	size_t len = iov_size(iov, iovcount);
+
+	if (!len || len & (SECTOR_SIZE - 1) || !iov_is_zero(iov, iovcount))
+		return -1;
+
+	if (disk_image__discard(disk, sector, len >> SECTOR_SHIFT,
+				DISK_IMAGE_DISCARD_UNMAP | DISK_IMAGE_DISCARD_ZERO) < 0)
+		return -1;
+
+	return len;
+}
+
 /*
  * Write iov to disk, starting from sector 'sector'.
  * Return amount of bytes written.
@@ -297,6 +495,16 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
+	if (disk->detect_zeroes) {
+		total = disk_image__write_zeroes(disk, sector, iov, iovcount);
+		if (total >= 0) {
+			/* Done already, even on an asynchronous disk */
+			if (disk->disk_req_cb)
+				disk->disk_req_cb(param, total);
+			return total;
+		}
+	}
+
 	if (disk->ops->write) {
 		/*
 		 * Try writev based operation first
@@ -333,14 +541,110 @@ ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *l
 	return *len;
 }
 
+/*
+ * Hand any requests the I/O engine has batched up over to the host kernel.
+ * Callers issuing a burst of reads and writes call this once at the end.
+ */
+void disk_image__submit(struct disk_image *disk)
+{
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		disk_uring__submit(disk);
+#endif
+}
+
+/*
+ * Complete the asynchronous requests that are done, without waiting for
+ * the I/O engine's completion thread to wake up. Returns how many were.
+ */
+int disk_image__poll(struct disk_image *disk)
+{
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk_uring__poll(disk);
+#endif
+#ifdef CONFIG_HAS_AIO
+	if (disk->async)
+		return disk_image__reap_aio(disk);
+#endif
+	return 0;
+}
+
 void disk_image__set_callback(struct disk_image *disk,
 			      void (*disk_req_cb)(void *param, long len))
 {
 	disk->disk_req_cb = disk_req_cb;
 }
 
+/*
+ * The batch callback, when set, gets everything the I/O engine reaped at
+ * once, so that the device can complete it all in one go.
+ */
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*cb)(struct disk_image_completion *c, int nr))
+{
+	disk->disk_req_batch_cb = cb;
+}
+
+void disk_image__complete(struct disk_image *disk,
+			  struct disk_image_completion *c, int nr)
+{
+	int i;
+
+	if (disk->disk_req_batch_cb) {
+		disk->disk_req_batch_cb(c, nr);
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+		disk->disk_req_cb(c[i].param, c[i].len);
+}
+
+static void disk_image__send_stats(struct kvm *kvm, int fd, u32 type, u32 len,
+				   u8 *msg)
+{
+	struct disk_image_cache_stats stats[MAX_DISK_IMAGES][DISK_IMAGE_CACHE_NR];
+	struct disk_image *disk;
+	u32 nr = kvm->nr_disks;
+	u32 nr_poll;
+	u32 i;
+
+	if (WARN_ON(type != KVM_IPC_DISK_STAT || len))
+		return;
+
+	memset(stats, 0, sizeof(stats));
+
+	for (i = 0; i < nr; i++) {
+		disk = kvm->disks[i];
+		if (disk && !disk->wwpn && disk->ops->cache_stats)
+			disk->ops->cache_stats(disk, stats[i]);
+	}
+
+	if (write(fd, &nr, sizeof(nr)) < 0 ||
+	    write(fd, stats, nr * sizeof(stats[0])) < 0)
+		goto err;
+
+	for (i = 0; i < nr; i++) {
+		disk = kvm->disks[i];
+		nr_poll = disk && !disk->wwpn ? disk->nr_poll_stats : 0;
+
+		if (write(fd, &nr_poll, sizeof(nr_poll)) < 0)
+			goto err;
+		if (nr_poll && write(fd, disk->poll_stats,
+				     nr_poll * sizeof(*disk->poll_stats)) < 0)
+			goto err;
+	}
+
+	return;
+err:
+	pr_warning("Failed sending disk stats");
+}
+
 int disk_image__init(struct kvm *kvm)
 {
+	kvm_ipc__register_handler(KVM_IPC_DISK_STAT, disk_image__send_stats);
+	kvm_ipc__register_handler(KVM_IPC_DISK_QOS, disk_image__qos_ipc);
+
 	if (kvm->cfg.image_count) {
 		kvm->disks = disk_image__open_all(kvm);
 		if (IS_ERR(kvm->disks))
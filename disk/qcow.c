@@ -4,6 +4,8 @@
 #include "kvm/read-write.h"
 #include "kvm/mutex.h"
 #include "kvm/util.h"
+#include "kvm/barrier.h"
+#include "kvm/iovec.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -13,6 +15,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <libgen.h>
 #ifdef CONFIG_HAS_ZLIB
 #include <zlib.h>
 #endif
@@ -20,12 +24,16 @@
 #include <linux/err.h>
 #include <linux/byteorder.h>
 #include <linux/kernel.h>
+#include <linux/bitops.h>
 #include <linux/types.h>
+#include <linux/compiler.h>
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
 static int qcow_write_refcount_table(struct qcow *q);
+static int qcow_write_refcount_blocks(struct qcow *q);
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
+static int qcow_writeback(struct qcow *q);
 
 static inline int qcow_pwrite_sync(int fd,
 	void *buf, size_t count, off_t offset)
@@ -36,148 +44,124 @@ static inline int qcow_pwrite_sync(int fd,
 	return fdatasync(fd);
 }
 
-static int l2_table_insert(struct rb_root *root, struct qcow_l2_table *new)
+static inline u64 get_l1_index(struct qcow *q, u64 offset)
 {
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
-
-	/* search the tree */
-	while (*link) {
-		struct qcow_l2_table *t;
-
-		t = rb_entry(*link, struct qcow_l2_table, node);
-		if (!t)
-			goto error;
+	struct qcow_header *header = q->header;
 
-		parent = *link;
+	return offset >> (header->l2_bits + header->cluster_bits);
+}
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
-	}
+static inline u64 get_l2_index(struct qcow *q, u64 offset)
+{
+	struct qcow_header *header = q->header;
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
-	return 0;
-error:
-	return -1;
+	return (offset >> (header->cluster_bits)) & ((1 << header->l2_bits)-1);
 }
 
-static struct qcow_l2_table *l2_table_lookup(struct rb_root *root, u64 offset)
+static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
 {
-	struct rb_node *link = root->rb_node;
-
-	while (link) {
-		struct qcow_l2_table *t;
+	struct qcow_header *header = q->header;
 
-		t = rb_entry(link, struct qcow_l2_table, node);
-		if (!t)
-			goto out;
+	return offset & ((1 << header->cluster_bits)-1);
+}
 
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
-			return t;
-	}
-out:
-	return NULL;
+static inline u64 get_l2_table_offset(struct qcow_l1_table *l1t, u64 l1_idx)
+{
+	return be64_to_cpu(ACCESS_ONCE(l1t->l1_table[l1_idx])) & ~QCOW2_OFLAG_COPIED;
 }
 
-static void l1_table_free_cache(struct qcow_l1_table *l1t)
+/*
+ * Number of tables a metadata cache of 'size' bytes holds, out of the
+ * 'nr_tables' the image can have.
+ */
+static int qcow_cache_nodes(struct qcow *q, u64 size, u64 nr_tables)
 {
-	struct rb_root *r = &l1t->root;
-	struct list_head *pos, *n;
-	struct qcow_l2_table *t;
+	u64 nr;
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		/* Remove cache table from the list and RB tree */
-		list_del(pos);
-		t = list_entry(pos, struct qcow_l2_table, list);
-		rb_erase(&t->node, r);
+	if (!size)
+		nr = MAX_CACHE_NODES;
+	else if (size == DISK_IMAGE_CACHE_ALL)
+		nr = nr_tables;
+	else
+		nr = size / q->cluster_size;
 
-		/* Free the cached node */
-		free(t);
-	}
+	nr = min(nr, nr_tables);
+
+	return max_t(u64, nr, MIN_CACHE_NODES);
 }
 
-static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
+static int qcow_l2_cache_init(struct qcow *q, u64 size)
 {
-	struct qcow_header *header = q->header;
-	u64 size;
-
-	if (!c->dirty)
-		return 0;
+	struct qcow_l1_table *l1t = &q->table;
 
-	size = 1 << header->l2_bits;
+	mutex_init(&l1t->lock);
 
-	if (qcow_pwrite_sync(q->fd, c->table,
-		size * sizeof(u64), c->offset) < 0)
+	l1t->max_cached = qcow_cache_nodes(q, size, l1t->table_size);
+	l1t->nodes = calloc(l1t->max_cached, sizeof(*l1t->nodes));
+	if (!l1t->nodes)
 		return -1;
 
-	c->dirty = 0;
+	l1t->cache = calloc(l1t->table_size, sizeof(*l1t->cache));
+	if (!l1t->cache) {
+		free(l1t->nodes);
+		return -1;
+	}
 
 	return 0;
 }
 
-static int cache_table(struct qcow *q, struct qcow_l2_table *c)
+static void l1_table_free_cache(struct qcow_l1_table *l1t)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct rb_root *r = &l1t->root;
-	struct qcow_l2_table *lru;
+	int i;
 
-	if (l1t->nr_cached == MAX_CACHE_NODES) {
-		/*
-		 * The node at the head of the list is least recently used
-		 * node. Remove it from the list and replaced with a new node.
-		 */
-		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
+	for (i = 0; i < l1t->nr_cached; i++)
+		free(l1t->nodes[i]);
 
-		/* Remove the node from the cache */
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		l1t->nr_cached--;
+	free(l1t->nodes);
+	free(l1t->cache);
+}
 
-		/* Free the LRUed node */
-		free(lru);
+static void l2_table_mark_dirty(struct qcow_l1_table *l1t, struct qcow_l2_table *c)
+{
+	if (!c->dirty) {
+		c->dirty = 1;
+		l1t->nr_dirty++;
 	}
+}
 
-	/* Add new node in RB Tree: Helps in searching faster */
-	if (l2_table_insert(r, c) < 0)
-		goto error;
-
-	/* Add in LRU replacement list */
-	list_add_tail(&c->list, &l1t->lru_list);
-	l1t->nr_cached++;
-
-	return 0;
-error:
-	return -1;
+static void l2_table_clear_dirty(struct qcow_l1_table *l1t, struct qcow_l2_table *c)
+{
+	if (c->dirty) {
+		c->dirty = 0;
+		l1t->nr_dirty--;
+	}
 }
 
-static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
+/*
+ * Write a dirty L2 table to the image. This doesn't sync, callers have
+ * to take care of ordering, see qcow_writeback().
+ */
+static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct qcow_header *header = q->header;
+	u64 size;
 
-	l2t = l2_table_lookup(&l1t->root, offset);
-	if (!l2t)
-		return NULL;
+	if (!c->dirty)
+		return 0;
 
-	/* Update the LRU state, by moving the searched node to list tail */
-	list_move_tail(&l2t->list, &l1t->lru_list);
+	size = 1 << header->l2_bits;
 
-	return l2t;
+	if (pwrite_in_full(q->fd, c->table,
+		size * sizeof(u64), c->offset) < 0)
+		return -1;
+
+	l2_table_clear_dirty(&q->table, c);
+
+	return 0;
 }
 
 /* Allocates a new node for caching L2 table */
-static struct qcow_l2_table *new_cache_table(struct qcow *q, u64 offset)
+static struct qcow_l2_table *new_cache_table(struct qcow *q)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l2_table *c;
@@ -187,67 +171,214 @@ static struct qcow_l2_table *new_cache_table(struct qcow *q, u64 offset)
 	l2t_sz = 1 << header->l2_bits;
 	size   = sizeof(*c) + l2t_sz * sizeof(u64);
 	c      = calloc(1, size);
-	if (!c)
-		goto out;
 
-	c->offset = offset;
-	RB_CLEAR_NODE(&c->node);
-	INIT_LIST_HEAD(&c->list);
-out:
 	return c;
 }
 
-static inline u64 get_l1_index(struct qcow *q, u64 offset)
+/*
+ * Lockless readers check the sequence count around their lookup, and
+ * retry under the cache lock if a table was replaced underneath them.
+ */
+static void l2_table_begin_update(struct qcow_l2_table *c)
 {
-	struct qcow_header *header = q->header;
-
-	return offset >> (header->l2_bits + header->cluster_bits);
+	c->seq++;
+	wmb();
 }
 
-static inline u64 get_l2_index(struct qcow *q, u64 offset)
+static void l2_table_end_update(struct qcow_l2_table *c)
 {
-	struct qcow_header *header = q->header;
-
-	return (offset >> (header->cluster_bits)) & ((1 << header->l2_bits)-1);
+	wmb();
+	c->seq++;
 }
 
-static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
+/*
+ * Get a node to load a new table in. Until the cache is full, nodes are
+ * allocated; after that the least recently used one is taken back using
+ * the clock algorithm. Nodes are never freed while the image is open, so
+ * a lockless reader can always safely look at one. Dirty tables are
+ * skipped, they are only written back by qcow_writeback(). The node is
+ * returned unpublished, in the middle of an update. Called with l1t->lock
+ * held.
+ */
+static struct qcow_l2_table *l2_table_get_node(struct qcow *q)
 {
-	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *c;
+	int scanned = 0;
 
-	return offset & ((1 << header->cluster_bits)-1);
+	if (l1t->nr_cached < l1t->max_cached) {
+		c = new_cache_table(q);
+		if (!c)
+			return NULL;
+
+		l1t->nodes[l1t->nr_cached++] = c;
+		l2_table_begin_update(c);
+
+		return c;
+	}
+
+	for (;;) {
+		if (scanned++ == 2 * l1t->nr_cached)
+			return NULL;
+
+		c = l1t->nodes[l1t->clock_hand];
+		l1t->clock_hand = (l1t->clock_hand + 1) % l1t->nr_cached;
+
+		if (c->dirty)
+			continue;
+
+		if (!c->referenced)
+			break;
+
+		c->referenced = 0;
+	}
+
+	l2_table_begin_update(c);
+	if (l1t->cache[c->l1_idx] == c)
+		l1t->cache[c->l1_idx] = NULL;
+
+	return c;
 }
 
-static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 offset)
+/*
+ * Return the cached L2 table currently referenced by L1 entry 'l1_idx',
+ * reading it from the image if needed. NULL means the L1 entry is unused.
+ * Called with l1t->lock held.
+ */
+static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 l1_idx)
 {
 	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_l2_table *l2t;
+	u64 l2t_offset;
 	u64 size;
 
-	size = 1 << header->l2_bits;
+	l2t_offset = get_l2_table_offset(l1t, l1_idx);
+	if (!l2t_offset)
+		return NULL;
 
-	/* search an entry for offset in cache */
-	l2t = l2_table_search(q, offset);
-	if (l2t)
+	l2t = l1t->cache[l1_idx];
+	if (l2t && l2t->offset == l2t_offset) {
+		l2t->referenced = 1;
+		l1t->hits++;
 		return l2t;
+	}
+
+	size = 1 << header->l2_bits;
 
-	/* allocate new node for caching l2 table */
-	l2t = new_cache_table(q, offset);
+	/* Sequential access: have the kernel read the next table ahead */
+	if (l1_idx == l1t->last_miss + 1 && l1_idx + 1 < l1t->table_size &&
+	    !l1t->cache[l1_idx + 1]) {
+		u64 next = get_l2_table_offset(l1t, l1_idx + 1);
+
+		if (next)
+			posix_fadvise(q->fd, next, size * sizeof(u64),
+				      POSIX_FADV_WILLNEED);
+	}
+
+	l1t->last_miss = l1_idx;
+	l1t->misses++;
+
+	l2t = l2_table_get_node(q);
 	if (!l2t)
-		goto error;
+		return ERR_PTR(-ENOMEM);
 
 	/* table not cached: read from the disk */
-	if (pread_in_full(q->fd, l2t->table, size * sizeof(u64), offset) < 0)
-		goto error;
+	if (pread_in_full(q->fd, l2t->table, size * sizeof(u64), l2t_offset) < 0) {
+		l2t->offset = 0;
+		l2_table_end_update(l2t);
+		return ERR_PTR(-EIO);
+	}
+
+	l2t->offset	= l2t_offset;
+	l2t->l1_idx	= l1_idx;
+	l2t->referenced	= 1;
+	l2_table_end_update(l2t);
 
 	/* cache the table */
-	if (cache_table(q, l2t) < 0)
-		goto error;
+	l1t->cache[l1_idx] = l2t;
 
 	return l2t;
-error:
-	free(l2t);
-	return NULL;
+}
+
+/*
+ * Get the L2 entry for the cluster at 'l2_idx' in the table referenced
+ * by L1 entry 'l1_idx'. Cache hits don't take any lock.
+ */
+static int qcow_l2_lookup(struct qcow *q, u64 l1_idx, u64 l2_idx, u64 *entry)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	u64 l2t_offset;
+	u32 seq;
+
+	l2t_offset = get_l2_table_offset(l1t, l1_idx);
+	if (!l2t_offset) {
+		*entry = 0;
+		return 0;
+	}
+
+	l2t = ACCESS_ONCE(l1t->cache[l1_idx]);
+	if (l2t) {
+		seq = ACCESS_ONCE(l2t->seq);
+		rmb();
+		if (!(seq & 1) && l2t->offset == l2t_offset) {
+			*entry = be64_to_cpu(ACCESS_ONCE(l2t->table[l2_idx]));
+			rmb();
+			if (ACCESS_ONCE(l2t->seq) == seq) {
+				l2t->referenced = 1;
+				l1t->hits++;
+				return 0;
+			}
+		}
+	}
+
+	mutex_lock(&l1t->lock);
+
+	l2t = qcow_read_l2_table(q, l1_idx);
+	if (IS_ERR(l2t)) {
+		mutex_unlock(&l1t->lock);
+		return -1;
+	}
+
+	*entry = l2t ? be64_to_cpu(l2t->table[l2_idx]) : 0;
+
+	mutex_unlock(&l1t->lock);
+
+	return 0;
+}
+
+/*
+ * Update an L2 entry. The table must already be allocated, see
+ * get_cluster_table(). It is written back later by qcow_writeback().
+ * Called with q->mutex held.
+ */
+static int qcow_l2_update(struct qcow *q, u64 l1_idx, u64 l2_idx, u64 entry)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	bool writeback;
+
+	mutex_lock(&l1t->lock);
+
+	l2t = qcow_read_l2_table(q, l1_idx);
+	if (IS_ERR_OR_NULL(l2t)) {
+		mutex_unlock(&l1t->lock);
+		return -1;
+	}
+
+	l2t->table[l2_idx] = cpu_to_be64(entry);
+	l2_table_mark_dirty(l1t, l2t);
+
+	/* Keep enough clean tables around for eviction */
+	writeback = l1t->nr_dirty > l1t->max_cached / 2;
+
+	mutex_unlock(&l1t->lock);
+
+	if (writeback)
+		return qcow_writeback(q);
+
+	return 0;
 }
 
 static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
@@ -283,20 +414,233 @@ static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 #endif
 }
 
+static void qcow_zcache_init(struct qcow *q, int budget_mb)
+{
+	struct qcow_zcache *zc = &q->zcache;
+
+	if (budget_mb < 0)
+		budget_mb = QCOW_ZCACHE_DEFAULT_MB;
+
+	zc->root	= RB_ROOT;
+	zc->max_cached	= ((u64)budget_mb << 20) / q->cluster_size;
+	INIT_LIST_HEAD(&zc->lru_list);
+	mutex_init(&zc->lock);
+}
+
+static void qcow_zcache_free(struct qcow *q)
+{
+	struct qcow_zcache *zc = &q->zcache;
+	struct qcow_zcache_entry *e, *n;
+
+	if (zc->hits || zc->misses)
+		pr_debug("qcow: decompressed cluster cache: %llu hits, %llu misses",
+			 (unsigned long long)zc->hits,
+			 (unsigned long long)zc->misses);
+
+	list_for_each_entry_safe(e, n, &zc->lru_list, list)
+		free(e);
+}
+
+static struct qcow_zcache_entry *qcow_zcache_lookup(struct qcow_zcache *zc,
+						    u64 offset)
+{
+	struct rb_node *link = zc->root.rb_node;
+
+	while (link) {
+		struct qcow_zcache_entry *e;
+
+		e = rb_entry(link, struct qcow_zcache_entry, node);
+
+		if (offset < e->offset)
+			link = link->rb_left;
+		else if (offset > e->offset)
+			link = link->rb_right;
+		else
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy 'len' bytes at 'clust_off' of the cached compressed cluster stored
+ * at 'offset' in the image to 'dst'. Returns false on a cache miss.
+ */
+static bool qcow_zcache_read(struct qcow *q, u64 offset, void *dst,
+			     u64 clust_off, size_t len)
+{
+	struct qcow_zcache *zc = &q->zcache;
+	struct qcow_zcache_entry *e;
+
+	if (!zc->max_cached)
+		return false;
+
+	mutex_lock(&zc->lock);
+
+	e = qcow_zcache_lookup(zc, offset);
+	if (e) {
+		list_move(&e->list, &zc->lru_list);
+		memcpy(dst, e->data + clust_off, len);
+		zc->hits++;
+	} else {
+		zc->misses++;
+	}
+
+	mutex_unlock(&zc->lock);
+
+	return e != NULL;
+}
+
+/*
+ * Hand a freshly decompressed cluster over to the cache, evicting the
+ * least recently used one if the cache is full.
+ */
+static void qcow_zcache_insert(struct qcow *q, struct qcow_zcache_entry *new)
+{
+	struct qcow_zcache *zc = &q->zcache;
+	struct rb_node **link = &zc->root.rb_node, *parent = NULL;
+	struct qcow_zcache_entry *e;
+
+	if (!zc->max_cached) {
+		free(new);
+		return;
+	}
+
+	mutex_lock(&zc->lock);
+
+	while (*link) {
+		e = rb_entry(*link, struct qcow_zcache_entry, node);
+		parent = *link;
+
+		if (new->offset < e->offset) {
+			link = &(*link)->rb_left;
+		} else if (new->offset > e->offset) {
+			link = &(*link)->rb_right;
+		} else {
+			/* Somebody else got there first */
+			mutex_unlock(&zc->lock);
+			free(new);
+			return;
+		}
+	}
+
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &zc->root);
+	list_add(&new->list, &zc->lru_list);
+
+	if (zc->nr_cached == zc->max_cached) {
+		e = list_last_entry(&zc->lru_list, struct qcow_zcache_entry, list);
+
+		rb_erase(&e->node, &zc->root);
+		list_del(&e->list);
+		free(e);
+	} else {
+		zc->nr_cached++;
+	}
+
+	mutex_unlock(&zc->lock);
+}
+
+/* The compressed cluster at 'offset' is being freed */
+static void qcow_zcache_drop(struct qcow *q, u64 offset)
+{
+	struct qcow_zcache *zc = &q->zcache;
+	struct qcow_zcache_entry *e;
+
+	if (!zc->max_cached)
+		return;
+
+	mutex_lock(&zc->lock);
+
+	e = qcow_zcache_lookup(zc, offset);
+	if (e) {
+		rb_erase(&e->node, &zc->root);
+		list_del(&e->list);
+		zc->nr_cached--;
+		free(e);
+	}
+
+	mutex_unlock(&zc->lock);
+}
+
+/*
+ * Read 'len' bytes at 'clust_off' of the compressed cluster whose data
+ * starts 'skip' bytes into the 'csize' bytes at 'pos' in the image file.
+ * Decompressed clusters are cached by 'offset', the position of their
+ * compressed data.
+ */
+static int qcow_read_compressed(struct qcow *q, u64 offset, u64 pos,
+				int csize, int skip, void *dst,
+				u64 clust_off, size_t len)
+{
+	struct qcow_zcache_entry *e;
+	u8 *cluster_data;
+
+	if (qcow_zcache_read(q, offset, dst, clust_off, len))
+		return 0;
+
+	/* Only the decompressed cluster is kept, as the cache budget counts */
+	e = malloc(sizeof(*e) + q->cluster_size);
+	cluster_data = malloc(csize);
+	if (!e || !cluster_data)
+		goto out_error;
+
+	if (pread_in_full(q->fd, cluster_data, csize, pos) < 0)
+		goto out_error;
+
+	if (qcow_decompress_buffer(e->data, q->cluster_size,
+				cluster_data + skip, csize - skip) < 0)
+		goto out_error;
+
+	free(cluster_data);
+	memcpy(dst, e->data + clust_off, len);
+
+	e->offset = offset;
+	qcow_zcache_insert(q, e);
+
+	return 0;
+
+out_error:
+	free(cluster_data);
+	free(e);
+	return -1;
+}
+
+/*
+ * Read the data of an unallocated cluster from the backing file. Anything
+ * past its end reads as zeroes.
+ */
+static ssize_t qcow_read_backing(struct qcow *q, u64 offset, void *dst,
+				 u32 dst_len)
+{
+	struct disk_image *backing = q->backing;
+	struct iovec iov;
+	u64 len = 0;
+
+	if (offset < backing->size) {
+		len = min_t(u64, dst_len, backing->size - offset);
+		iov = (struct iovec) { dst, len };
+
+		if (disk_image__read_sync(backing, offset >> SECTOR_SHIFT,
+					  &iov, 1) < 0)
+			return -1;
+	}
+
+	memset(dst + len, 0, dst_len - len);
+
+	return dst_len;
+}
+
 static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	void *dst, u32 dst_len)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
 	u64 clust_offset;
 	u64 clust_start;
-	u64 l2t_offset;
 	size_t length;
-	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
+	u64 coffset;
 	int csize;
 
 	l1_idx = get_l1_index(q, offset);
@@ -311,45 +655,23 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	if (length > dst_len)
 		length = dst_len;
 
-	mutex_lock(&q->mutex);
-
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
-	if (!l2t_offset)
-		goto zero_cluster;
-
-	l2t_size = 1 << header->l2_bits;
-
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
 	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
+	if (qcow_l2_lookup(q, l1_idx, l2_idx, &clust_start) < 0)
+		return -1;
+
 	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
 		coffset	= clust_start & q->cluster_offset_mask;
 		csize	= clust_start >> (63 - q->header->cluster_bits);
 		csize	&= (q->cluster_size - 1);
 
-		if (pread_in_full(q->fd, q->cluster_data, csize,
-				  coffset) < 0)
-			goto out_error;
-
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data, csize) < 0)
-			goto out_error;
-
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
+		if (qcow_read_compressed(q, coffset, coffset, csize, 0,
+					 dst, clust_offset, length) < 0)
+			return -1;
 	} else {
 		if (!clust_start)
 			goto zero_cluster;
 
-		mutex_unlock(&q->mutex);
-
 		if (pread_in_full(q->fd, dst, length,
 				  clust_start + clust_offset) < 0)
 			return -1;
@@ -358,33 +680,25 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	return length;
 
 zero_cluster:
-	mutex_unlock(&q->mutex);
+	if (q->backing)
+		return qcow_read_backing(q, offset, dst, length);
+
 	memset(dst, 0, length);
 	return length;
-
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
 }
 
 static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	void *dst, u32 dst_len)
 {
-	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
 	u64 clust_offset;
 	u64 clust_start;
-	u64 l2t_offset;
 	size_t length;
-	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
+	u64 coffset;
 	int sector_offset;
 	int nb_csectors;
-	int csize;
 
 	l1_idx = get_l1_index(q, offset);
 	if (l1_idx >= l1t->table_size)
@@ -398,54 +712,26 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	if (length > dst_len)
 		length = dst_len;
 
-	mutex_lock(&q->mutex);
-
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
-
-	l2t_offset &= ~QCOW2_OFLAG_COPIED;
-	if (!l2t_offset)
-		goto zero_cluster;
-
-	l2t_size = 1 << header->l2_bits;
-
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
 	l2_idx = get_l2_index(q, offset);
-	if (l2_idx >= l2t_size)
-		goto out_error;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
+	if (qcow_l2_lookup(q, l1_idx, l2_idx, &clust_start) < 0)
+		return -1;
+
 	if (clust_start & QCOW2_OFLAG_COMPRESSED) {
 		coffset = clust_start & q->cluster_offset_mask;
 		nb_csectors = ((clust_start >> q->csize_shift)
 			& q->csize_mask) + 1;
 		sector_offset = coffset & (SECTOR_SIZE - 1);
-		csize = nb_csectors * SECTOR_SIZE - sector_offset;
 
-		if (pread_in_full(q->fd, q->cluster_data,
-				  nb_csectors * SECTOR_SIZE,
-				  coffset & ~(SECTOR_SIZE - 1)) < 0) {
-			goto out_error;
-		}
-
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data + sector_offset,
-					csize) < 0) {
-			goto out_error;
-		}
-
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
+		if (qcow_read_compressed(q, coffset, coffset & ~(SECTOR_SIZE - 1),
+					 nb_csectors * SECTOR_SIZE, sector_offset,
+					 dst, clust_offset, length) < 0)
+			return -1;
 	} else {
 		clust_start &= QCOW2_OFFSET_MASK;
 		if (!clust_start)
 			goto zero_cluster;
 
-		mutex_unlock(&q->mutex);
-
 		if (pread_in_full(q->fd, dst, length,
 				  clust_start + clust_offset) < 0)
 			return -1;
@@ -454,14 +740,11 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	return length;
 
 zero_cluster:
-	mutex_unlock(&q->mutex);
+	if (q->backing)
+		return qcow_read_backing(q, offset, dst, length);
+
 	memset(dst, 0, length);
 	return length;
-
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
 }
 
 static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
@@ -522,49 +805,37 @@ static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
 
 static void refcount_table_free_cache(struct qcow_refcount_table *rft)
 {
-	struct rb_root *r = &rft->root;
 	struct list_head *pos, *n;
 	struct qcow_refcount_block *t;
 
+	u32 i;
+
+	if (!rft->cache)
+		return;
+
 	list_for_each_safe(pos, n, &rft->lru_list) {
 		list_del(pos);
 		t = list_entry(pos, struct qcow_refcount_block, list);
-		rb_erase(&t->node, r);
 
 		free(t);
 	}
-}
-
-static int refcount_block_insert(struct rb_root *root, struct qcow_refcount_block *new)
-{
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
-
-	/* search the tree */
-	while (*link) {
-		struct qcow_refcount_block *t;
 
-		t = rb_entry(*link, struct qcow_refcount_block, node);
-		if (!t)
-			goto error;
+	for (i = 0; i < rft->rf_size; i++)
+		free(rft->used_map[i]);
 
-		parent = *link;
+	free(rft->used_map);
+	free(rft->nr_used);
+	free(rft->cache);
+}
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
-	}
+static void refcount_block_uncache(struct qcow_refcount_table *rft,
+				   struct qcow_refcount_block *rfb)
+{
+	if (rft->cache[rfb->rft_idx] == rfb)
+		rft->cache[rfb->rft_idx] = NULL;
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
-	return 0;
-error:
-	return -1;
+	list_del_init(&rfb->list);
+	rft->nr_cached--;
 }
 
 static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
@@ -572,7 +843,7 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 	if (!rfb->dirty)
 		return 0;
 
-	if (qcow_pwrite_sync(q->fd, rfb->entries,
+	if (pwrite_in_full(q->fd, rfb->entries,
 		rfb->size * sizeof(u16), rfb->offset) < 0)
 		return -1;
 
@@ -584,31 +855,32 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 {
 	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct rb_root *r = &rft->root;
 	struct qcow_refcount_block *lru;
 
-	if (rft->nr_cached == MAX_CACHE_NODES) {
+	if (rft->nr_cached == rft->max_cached) {
 		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
 
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		rft->nr_cached--;
+		/*
+		 * Refcount blocks can go out early: increments are safe in
+		 * any order, and decrements are only applied once nothing
+		 * on disk points at the clusters any more.
+		 */
+		if (write_refcount_block(q, lru) < 0)
+			return -1;
 
+		refcount_block_uncache(rft, lru);
 		free(lru);
 	}
 
-	if (refcount_block_insert(r, c) < 0)
-		goto error;
-
+	rft->cache[c->rft_idx] = c;
 	list_add_tail(&c->list, &rft->lru_list);
 	rft->nr_cached++;
 
 	return 0;
-error:
-	return -1;
 }
 
-static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_offset)
+static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_offset,
+						      u64 rft_idx)
 {
 	struct qcow_refcount_block *rfb;
 
@@ -617,46 +889,26 @@ static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_of
 		return NULL;
 
 	rfb->offset = rfb_offset;
+	rfb->rft_idx = rft_idx;
 	rfb->size = q->cluster_size / sizeof(u16);
-	RB_CLEAR_NODE(&rfb->node);
 	INIT_LIST_HEAD(&rfb->list);
 
 	return rfb;
 }
 
-static struct qcow_refcount_block *refcount_block_lookup(struct rb_root *root, u64 offset)
-{
-	struct rb_node *link = root->rb_node;
-
-	while (link) {
-		struct qcow_refcount_block *t;
-
-		t = rb_entry(link, struct qcow_refcount_block, node);
-		if (!t)
-			goto out;
-
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
-			return t;
-	}
-out:
-	return NULL;
-}
-
-static struct qcow_refcount_block *refcount_block_search(struct qcow *q, u64 offset)
+static struct qcow_refcount_block *refcount_block_search(struct qcow *q, u64 rft_idx,
+							 u64 offset)
 {
 	struct qcow_refcount_table *rft = &q->refcount_table;
 	struct qcow_refcount_block *rfb;
 
-	rfb = refcount_block_lookup(&rft->root, offset);
-	if (!rfb)
+	rfb = rft->cache[rft_idx];
+	if (!rfb || rfb->offset != offset)
 		return NULL;
 
 	/* Update the LRU state, by moving the searched node to list tail */
 	list_move_tail(&rfb->list, &rft->lru_list);
+	rft->hits++;
 
 	return rfb;
 }
@@ -679,18 +931,18 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 	}
 
 	new_block_offset = qcow_alloc_clusters(q, q->cluster_size, 0);
-	if (new_block_offset < 0)
+	if ((s64)new_block_offset < 0)
 		return NULL;
 
-	rfb = new_refcount_block(q, new_block_offset);
+	rfb = new_refcount_block(q, new_block_offset, rft_idx);
 	if (!rfb)
 		return NULL;
 
 	memset(rfb->entries, 0x00, q->cluster_size);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0)
+	/* write refcount block, it has to be there before the table entry */
+	if (write_refcount_block(q, rfb) < 0 || fdatasync(q->fd) < 0)
 		goto free_rfb;
 
 	if (cache_refcount_block(q, rfb) < 0)
@@ -708,6 +960,7 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 
 recover_rft:
 	rft->rf_table[rft_idx] = 0;
+	refcount_block_uncache(rft, rfb);
 free_rfb:
 	free(rfb);
 	return NULL;
@@ -729,11 +982,13 @@ static struct qcow_refcount_block *qcow_read_refcount_block(struct qcow *q, u64
 	if (!rfb_offset)
 		return ERR_PTR(-ENOSPC);
 
-	rfb = refcount_block_search(q, rfb_offset);
+	rfb = refcount_block_search(q, rft_idx, rfb_offset);
 	if (rfb)
 		return rfb;
 
-	rfb = new_refcount_block(q, rfb_offset);
+	rft->misses++;
+
+	rfb = new_refcount_block(q, rfb_offset, rft_idx);
 	if (!rfb)
 		return NULL;
 
@@ -751,29 +1006,73 @@ error_free_rfb:
 	return NULL;
 }
 
-static u16 qcow_get_refcount(struct qcow *q, u64 clust_idx)
+static inline u64 qcow_refcount_block_entries(struct qcow *q)
 {
-	struct qcow_refcount_block *rfb = NULL;
-	struct qcow_header *header = q->header;
-	u64 rfb_idx;
+	return 1ULL << (q->header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT);
+}
 
-	rfb = qcow_read_refcount_block(q, clust_idx);
-	if (PTR_ERR(rfb) == -ENOSPC)
-		return 0;
-	else if (IS_ERR_OR_NULL(rfb)) {
-		pr_warning("Error while reading refcount table");
-		return -1;
-	}
+/*
+ * Get the free space bitmap of the clusters covered by refcount block
+ * 'rft_idx', building it from the refcounts the first time.
+ */
+static unsigned long *qcow_used_map(struct qcow *q, u64 rft_idx)
+{
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	u64 nr = qcow_refcount_block_entries(q);
+	struct qcow_refcount_block *rfb;
+	unsigned long *map;
+	u64 i;
 
-	rfb_idx = clust_idx & (((1ULL <<
-		(header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT)) - 1));
+	if (rft->used_map[rft_idx])
+		return rft->used_map[rft_idx];
 
-	if (rfb_idx >= rfb->size) {
-		pr_warning("L1: refcount block index out of bounds");
-		return -1;
+	map = calloc(BITS_TO_LONGS(nr), sizeof(long));
+	if (!map)
+		return NULL;
+
+	if (rft->rf_table[rft_idx]) {
+		rfb = qcow_read_refcount_block(q, rft_idx * nr);
+		if (IS_ERR_OR_NULL(rfb)) {
+			free(map);
+			return NULL;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (rfb->entries[i]) {
+				set_bit(i, map);
+				rft->nr_used[rft_idx]++;
+			}
+		}
 	}
 
-	return be16_to_cpu(rfb->entries[rfb_idx]);
+	rft->used_map[rft_idx] = map;
+
+	return map;
+}
+
+static void qcow_mark_cluster(struct qcow *q, u64 clust_idx, bool used)
+{
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	u64 nr = qcow_refcount_block_entries(q);
+	u64 rft_idx = clust_idx / nr;
+	unsigned long *map;
+	u64 i = clust_idx % nr;
+
+	/* Not built yet, the refcounts will tell */
+	map = rft->used_map[rft_idx];
+	if (!map)
+		return;
+
+	if (used == !!test_bit(i, map))
+		return;
+
+	if (used) {
+		set_bit(i, map);
+		rft->nr_used[rft_idx]++;
+	} else {
+		clear_bit(i, map);
+		rft->nr_used[rft_idx]--;
+	}
 }
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
@@ -806,355 +1105,686 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
 	rfb->dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
-		pr_warning("refcount block index out of bounds");
-		return -1;
-	}
+	qcow_mark_cluster(q, clust_idx, refcount != 0);
 
 	/* update free_clust_idx since refcount becomes zero */
 	if (!refcount && clust_idx < q->free_clust_idx)
 		q->free_clust_idx = clust_idx;
 
-	return 0;
-}
+	return 0;
+}
+
+static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
+{
+	struct qcow_header *header = q->header;
+	u64 start, end, offset;
+
+	start = clust_start & ~(q->cluster_size - 1);
+	end = (clust_start + size - 1) & ~(q->cluster_size - 1);
+	for (offset = start; offset <= end; offset += q->cluster_size)
+		update_cluster_refcount(q, offset >> header->cluster_bits, -1);
+}
+
+/*
+ * Allocate 'size' bytes worth of contiguous clusters, the first fit at or
+ * after free_clust_idx, the lowest cluster that may be free. The search
+ * goes through the free space bitmaps and skips refcount blocks and
+ * bitmap words that are entirely in use. With 'update_ref' unset, the
+ * caller is responsible for setting the refcounts.
+ */
+static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	u64 nr = qcow_refcount_block_entries(q);
+	u64 clust_idx, clust_start = 0, first_free = -1;
+	u64 clust_num, run = 0;
+	unsigned long *map;
+	u64 rft_idx, i;
+
+	clust_num = (size + (q->cluster_size - 1)) >> header->cluster_bits;
+
+	for (clust_idx = q->free_clust_idx; run < clust_num; clust_idx++) {
+		rft_idx = clust_idx / nr;
+		if (rft_idx >= rft->rf_size) {
+			pr_warning("Don't support grow refcount block table");
+			return -1;
+		}
+
+		map = qcow_used_map(q, rft_idx);
+		if (!map)
+			return -1;
+
+		i = clust_idx % nr;
+
+		if (!run && !i && rft->nr_used[rft_idx] == nr) {
+			clust_idx += nr - 1;
+			continue;
+		}
+
+		if (!run && !(i % BITS_PER_LONG) &&
+		    map[i / BITS_PER_LONG] == ~0UL) {
+			clust_idx += BITS_PER_LONG - 1;
+			continue;
+		}
+
+		if (test_bit(i, map)) {
+			run = 0;
+			continue;
+		}
+
+		if (!run)
+			clust_start = clust_idx;
+		if (first_free == (u64)-1)
+			first_free = clust_idx;
+		run++;
+	}
+
+	/* Holes too small for this request stay available */
+	if (first_free == clust_start)
+		q->free_clust_idx = clust_start + clust_num;
+	else
+		q->free_clust_idx = first_free;
+
+	for (i = 0; i < clust_num; i++)
+		qcow_mark_cluster(q, clust_start + i, true);
+
+	if (update_ref)
+		for (i = 0; i < clust_num; i++)
+			if (update_cluster_refcount(q, clust_start + i, 1))
+				return -1;
+
+	return clust_start << header->cluster_bits;
+}
+
+static int qcow_write_l1_table(struct qcow *q)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_header *header = q->header;
+
+	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
+		l1t->table_size * sizeof(u64),
+		header->l1_table_offset) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Get l2 table. If the table has been copied, use it directly.
+ * If the table exists, allocate a new cluster and copy the table
+ * to the new cluster. Called with q->mutex held.
+ */
+static int get_cluster_table(struct qcow *q, u64 offset,
+	u64 *result_l1_idx, u64 *result_l2_idx)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	u64 l1t_idx;
+	u64 l2t_offset;
+	u64 l2t_size;
+	u64 l2t_new_offset;
+
+	l2t_size = 1 << header->l2_bits;
+
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
+		return -1;
+
+	*result_l1_idx = l1t_idx;
+	*result_l2_idx = get_l2_index(q, offset);
+
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
+	if (l2t_offset & QCOW2_OFLAG_COPIED)
+		return 0;
+
+	l2t_new_offset = qcow_alloc_clusters(q, l2t_size*sizeof(u64), 1);
+	if ((s64)l2t_new_offset < 0)
+		return -1;
+
+	mutex_lock(&l1t->lock);
+
+	/* Move the cached table to its new home, or start an empty one */
+	l2t = qcow_read_l2_table(q, l1t_idx);
+	if (IS_ERR(l2t))
+		goto error_unlock;
+
+	if (l2t) {
+		l2_table_begin_update(l2t);
+	} else {
+		l2t = l2_table_get_node(q);
+		if (!l2t)
+			goto error_unlock;
+
+		memset(l2t->table, 0x00, l2t_size * sizeof(u64));
+	}
+
+	l2t->offset	= l2t_new_offset;
+	l2t->l1_idx	= l1t_idx;
+	l2t->referenced	= 1;
+	l2_table_mark_dirty(l1t, l2t);
+	l2_table_end_update(l2t);
+	l1t->cache[l1t_idx] = l2t;
+
+	/*
+	 * Write the l2 table. It and the refcount of its new cluster have
+	 * to be on disk before the l1 table points at it.
+	 */
+	if (qcow_l2_cache_write(q, l2t) < 0)
+		goto error_drop;
+
+	if (qcow_write_refcount_blocks(q) < 0 || fdatasync(q->fd) < 0)
+		goto error_drop;
+
+	/* update the l1 table */
+	l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
+		| QCOW2_OFLAG_COPIED);
+	if (qcow_write_l1_table(q)) {
+		pr_warning("Update l1 table error");
+		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_offset);
+		goto error_drop;
+	}
+
+	mutex_unlock(&l1t->lock);
+
+	/* free old cluster */
+	if (l2t_offset)
+		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+
+	return 0;
+
+error_drop:
+	/* Forget about the moved table, it gets read again if needed */
+	l2_table_begin_update(l2t);
+	l2t->offset = 0;
+	l2_table_clear_dirty(l1t, l2t);
+	l1t->cache[l1t_idx] = NULL;
+	l2_table_end_update(l2t);
+
+error_unlock:
+	mutex_unlock(&l1t->lock);
+	qcow_free_clusters(q, l2t_new_offset, q->cluster_size);
+
+	return -1;
+}
+
+/*
+ * Drop the reference an L2 entry holds on its data cluster(s).
+ */
+static void qcow_free_l2_entry(struct qcow *q, u64 entry)
+{
+	u64 clust_start;
+	int size;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		size = ((entry >> q->csize_shift) & q->csize_mask) + 1;
+		size *= 512;
+		clust_start = entry & q->cluster_offset_mask;
+		qcow_zcache_drop(q, clust_start);
+		clust_start &= ~511;
+
+		qcow_free_clusters(q, clust_start, size);
+	} else {
+		clust_start = entry & QCOW2_OFFSET_MASK;
+		if (clust_start)
+			qcow_free_clusters(q, clust_start, q->cluster_size);
+	}
+}
+
+/*
+ * Release the clusters of an L2 entry that was just dropped. This has to
+ * wait until the updated L2 table is on disk, otherwise a crash could
+ * leave the old table pointing at clusters that were reused meanwhile.
+ * Called with q->mutex held.
+ */
+static int qcow_free_l2_entry_deferred(struct qcow *q, u64 entry)
+{
+	if (!entry)
+		return 0;
+
+	if (q->nr_freed == QCOW_MAX_FREED_ENTRIES && qcow_writeback(q) < 0)
+		return -1;
+
+	q->freed_entries[q->nr_freed++] = entry;
+
+	return 0;
+}
+
+/*
+ * Build a whole cluster out of the old contents of the cluster at
+ * 'offset' and 'len' bytes of new data going at 'clust_off' in it.
+ */
+static void *qcow_merge_cluster(struct qcow *q, u64 offset, u64 old_entry,
+				const struct iovec *iov, size_t skip,
+				u64 clust_off, u64 len)
+{
+	void *buf;
+
+	buf = malloc(q->cluster_size);
+	if (!buf)
+		return NULL;
+
+	/* read the original data, which may come from the backing file */
+	if (old_entry || q->backing) {
+		if (qcow2_read_cluster(q, offset, buf, q->cluster_size) < 0) {
+			pr_warning("Read copy cluster error");
+			free(buf);
+			return NULL;
+		}
+	} else {
+		memset(buf, 0x00, q->cluster_size);
+	}
+
+	memcpy_fromiovecend(buf + clust_off, iov, skip, len);
+
+	return buf;
+}
+
+/*
+ * The clusters starting at 'offset' are unallocated, compressed or
+ * shared: allocate a contiguous run of new ones and write the data there
+ * with a single vectored write. Whole clusters are written straight from
+ * the guest buffers; partial ones at either end are merged with their
+ * old contents first. Returns the number of bytes written, which may be
+ * less than 'len'. Called with q->mutex held.
+ */
+static ssize_t qcow_write_new_clusters(struct qcow *q, u64 offset,
+				       const struct iovec *iov, int iovcount,
+				       size_t skip, size_t len)
+{
+	struct iovec wiov[IOV_MAX];
+	void *head = NULL, *tail = NULL;
+	u64 head_len, mid_len, tail_len;
+	u64 clust_new_start;
+	u64 clust_off;
+	u64 l1t_idx;
+	u64 l2t_idx;
+	u64 nr, nr_max, i;
+	u64 *old;
+	ssize_t ret = -1;
+	size_t covered;
+	int cnt = 0, mid_cnt;
+
+	clust_off = get_cluster_offset(q, offset);
+
+	if (get_cluster_table(q, offset, &l1t_idx, &l2t_idx)) {
+		pr_warning("Get l2 table error");
+		return -1;
+	}
+
+	nr_max = DIV_ROUND_UP(clust_off + len, q->cluster_size);
+	old = malloc(nr_max * sizeof(*old));
+	if (!old)
+		return -1;
+
+	/* Stop at the first cluster somebody else allocated meanwhile */
+	for (nr = 0; nr < nr_max; nr++) {
+		if (qcow_l2_lookup(q, l1t_idx, l2t_idx + nr, &old[nr]) < 0)
+			goto out;
+		if (old[nr] & QCOW2_OFLAG_COPIED)
+			break;
+	}
+
+	/* Let the caller write it in place */
+	if (!nr) {
+		ret = 0;
+		goto out;
+	}
+
+	len = min_t(u64, len, nr * q->cluster_size - clust_off);
+
+	if (clust_off || len < q->cluster_size) {
+		head_len = min_t(u64, len, q->cluster_size - clust_off);
+		tail_len = 0;
+	} else {
+		head_len = 0;
+		tail_len = len & (q->cluster_size - 1);
+	}
+	if (head_len && head_len < len)
+		tail_len = (clust_off + len) & (q->cluster_size - 1);
+	mid_len = len - head_len - tail_len;
+
+	/* Leave room for the head and tail buffers */
+	covered = iov_slice(wiov + !!head_len, &mid_cnt, IOV_MAX - 2,
+			    iov, iovcount, skip + head_len, mid_len);
+	if (covered < mid_len) {
+		mid_len = covered & ~(q->cluster_size - 1);
+		tail_len = 0;
+
+		/* Too fragmented for even one cluster, copy it instead */
+		if (!head_len && !mid_len)
+			head_len = q->cluster_size;
+
+		iov_slice(wiov + !!head_len, &mid_cnt, IOV_MAX - 2,
+			  iov, iovcount, skip + head_len, mid_len);
+	}
+
+	len = head_len + mid_len + tail_len;
+	nr = DIV_ROUND_UP(clust_off + len, q->cluster_size);
 
-static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
-{
-	struct qcow_header *header = q->header;
-	u64 start, end, offset;
+	if (head_len) {
+		head = qcow_merge_cluster(q, offset & ~(q->cluster_size - 1),
+					  old[0], iov, skip, clust_off, head_len);
+		if (!head)
+			goto out;
 
-	start = clust_start & ~(q->cluster_size - 1);
-	end = (clust_start + size - 1) & ~(q->cluster_size - 1);
-	for (offset = start; offset <= end; offset += q->cluster_size)
-		update_cluster_refcount(q, offset >> header->cluster_bits, -1);
-}
+		wiov[cnt++] = (struct iovec) { head, q->cluster_size };
+	}
 
-/*
- * Allocate clusters according to the size. Find a postion that
- * can satisfy the size. free_clust_idx is initialized to zero and
- * Record last position.
- */
-static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref)
-{
-	struct qcow_header *header = q->header;
-	u16 clust_refcount;
-	u32 clust_idx = 0, i;
-	u64 clust_num;
+	cnt += mid_cnt;
 
-	clust_num = (size + (q->cluster_size - 1)) >> header->cluster_bits;
+	if (tail_len) {
+		tail = qcow_merge_cluster(q, (offset + len) & ~(q->cluster_size - 1),
+					  old[nr - 1], iov, skip + len - tail_len,
+					  0, tail_len);
+		if (!tail)
+			goto out;
 
-again:
-	for (i = 0; i < clust_num; i++) {
-		clust_idx = q->free_clust_idx++;
-		clust_refcount = qcow_get_refcount(q, clust_idx);
-		if (clust_refcount < 0)
-			return -1;
-		else if (clust_refcount > 0)
-			goto again;
+		wiov[cnt++] = (struct iovec) { tail, q->cluster_size };
 	}
 
-	clust_idx++;
+	clust_new_start	= qcow_alloc_clusters(q, nr * q->cluster_size, 1);
+	if ((s64)clust_new_start < 0) {
+		pr_warning("Cluster alloc error");
+		goto out;
+	}
 
-	if (update_ref)
-		for (i = 0; i < clust_num; i++)
-			if (update_cluster_refcount(q,
-				clust_idx - clust_num + i, 1))
-				return -1;
+	/* Write actual data */
+	if (pwritev_in_full(q->fd, wiov, cnt, clust_new_start) < 0) {
+		qcow_free_clusters(q, clust_new_start, nr * q->cluster_size);
+		goto out;
+	}
 
-	return (clust_idx - clust_num) << header->cluster_bits;
-}
+	/* update l2 table, and free the old clusters */
+	for (i = 0; i < nr; i++) {
+		if (qcow_l2_update(q, l1t_idx, l2t_idx + i, (clust_new_start +
+			i * q->cluster_size) | QCOW2_OFLAG_COPIED)) {
+			qcow_free_clusters(q, clust_new_start + i * q->cluster_size,
+					   (nr - i) * q->cluster_size);
+			goto out;
+		}
 
-static int qcow_write_l1_table(struct qcow *q)
-{
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_header *header = q->header;
+		if (qcow_free_l2_entry_deferred(q, old[i]) < 0)
+			pr_warning("Error releasing old cluster");
+	}
 
-	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
-		l1t->table_size * sizeof(u64),
-		header->l1_table_offset) < 0)
-		return -1;
+	ret = len;
+out:
+	free(tail);
+	free(head);
+	free(old);
 
-	return 0;
+	return ret;
 }
 
 /*
- * Get l2 table. If the table has been copied, read table directly.
- * If the table exists, allocate a new cluster and copy the table
- * to the new cluster.
+ * Write up to 'len' bytes of 'iov', starting 'skip' bytes in, to the
+ * image at 'offset'. Clusters that have been copied are written in place
+ * without taking any lock, in a single write for as long as they are
+ * contiguous in the image file. Others go through
+ * qcow_write_new_clusters(). Returns the number of bytes written.
  */
-static int get_cluster_table(struct qcow *q, u64 offset,
-	struct qcow_l2_table **result_l2t, u64 *result_l2_index)
+static ssize_t qcow_write_run(struct qcow *q, u64 offset,
+			      const struct iovec *iov, int iovcount,
+			      size_t skip, size_t len)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct iovec wiov[IOV_MAX];
+	u64 clust_start;
+	u64 clust_off;
 	u64 l1t_idx;
-	u64 l2t_offset;
 	u64 l2t_idx;
 	u64 l2t_size;
-	u64 l2t_new_offset;
-
-	l2t_size = 1 << header->l2_bits;
+	u64 entry, i;
+	ssize_t nr;
+	size_t run;
+	int cnt;
 
 	l1t_idx = get_l1_index(q, offset);
 	if (l1t_idx >= l1t->table_size)
 		return -1;
 
 	l2t_idx = get_l2_index(q, offset);
-	if (l2t_idx >= l2t_size)
+	l2t_size = 1 << header->l2_bits;
+	clust_off = get_cluster_offset(q, offset);
+
+	/* Runs don't cross into the next l2 table */
+	len = min_t(u64, len, ((l2t_size - l2t_idx) << header->cluster_bits) -
+		    clust_off);
+
+	if (qcow_l2_lookup(q, l1t_idx, l2t_idx, &clust_start) < 0)
 		return -1;
 
-	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
-	if (l2t_offset & QCOW2_OFLAG_COPIED) {
-		l2t_offset &= ~QCOW2_OFLAG_COPIED;
-		l2t = qcow_read_l2_table(q, l2t_offset);
-		if (!l2t)
-			goto error;
-	} else {
-		l2t_new_offset = qcow_alloc_clusters(q,
-			l2t_size*sizeof(u64), 1);
+	if (!(clust_start & QCOW2_OFLAG_COPIED)) {
+		mutex_lock(&q->mutex);
+		nr = qcow_write_new_clusters(q, offset, iov, iovcount, skip, len);
+		mutex_unlock(&q->mutex);
 
-		if (l2t_new_offset < 0)
-			goto error;
+		return nr;
+	}
 
-		l2t = new_cache_table(q, l2t_new_offset);
-		if (!l2t)
-			goto free_cluster;
-
-		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
-				goto free_cache;
-		} else
-			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
-
-		/* write l2 table */
-		l2t->dirty = 1;
-		if (qcow_l2_cache_write(q, l2t) < 0)
-			goto free_cache;
-
-		/* cache l2 table */
-		if (cache_table(q, l2t))
-			goto free_cache;
-
-		/* update the l1 talble */
-		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
-			| QCOW2_OFLAG_COPIED);
-		if (qcow_write_l1_table(q)) {
-			pr_warning("Update l1 table error");
-			goto free_cache;
-		}
+	clust_start &= QCOW2_OFFSET_MASK;
 
-		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+	run = min_t(u64, len, q->cluster_size - clust_off);
+	for (i = 1; run < len; i++) {
+		if (qcow_l2_lookup(q, l1t_idx, l2t_idx + i, &entry) < 0)
+			return -1;
+
+		if (!(entry & QCOW2_OFLAG_COPIED) ||
+		    (entry & QCOW2_OFFSET_MASK) != clust_start + i * q->cluster_size)
+			break;
+
+		run += min_t(u64, len - run, q->cluster_size);
 	}
 
-	*result_l2t = l2t;
-	*result_l2_index = l2t_idx;
+	run = iov_slice(wiov, &cnt, IOV_MAX, iov, iovcount, skip, run);
 
-	return 0;
+	/* Write actual data */
+	if (pwritev_in_full(q->fd, wiov, cnt, clust_start + clust_off) < 0)
+		return -1;
+
+	return run;
+}
 
-free_cache:
-	free(l2t);
+static ssize_t qcow_write_iov(struct qcow *q, u64 offset,
+			      const struct iovec *iov, int iovcount)
+{
+	struct qcow_header *header = q->header;
+	size_t total, done = 0;
+	ssize_t nr;
 
-free_cluster:
-	qcow_free_clusters(q, l2t_new_offset, q->cluster_size);
+	total = iov_size(iov, iovcount);
+	if (offset + total > header->size)
+		return -1;
 
-error:
-	return -1;
+	while (done < total) {
+		nr = qcow_write_run(q, offset + done, iov, iovcount, done,
+				    total - done);
+		if (nr < 0)
+			return -1;
+
+		done += nr;
+	}
+
+	return total;
+}
+
+static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
+{
+	struct qcow *q = disk->priv;
+	ssize_t total;
+
+	total = qcow_write_iov(q, sector << SECTOR_SHIFT, iov, iovcount);
+	if (total < 0)
+		pr_info("qcow_write_sector error: sector=%llu\n",
+			(unsigned long long)sector);
+
+	return total;
 }
 
 /*
- * If the cluster has been copied, write data directly. If not,
- * read the original data and write it to the new cluster with
- * modification.
+ * Unmap the cluster containing 'offset'. Unallocated clusters read back
+ * as zeroes, so this works for both discard and write zeroes.
  */
-static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
-		void *buf, u32 src_len)
+static int qcow_discard_cluster(struct qcow *q, u64 offset)
 {
-	struct qcow_l2_table *l2t;
-	u64 clust_new_start;
-	u64 clust_start;
-	u64 clust_flags;
-	u64 clust_off;
+	struct qcow_l1_table *l1t = &q->table;
+	u64 l1t_idx;
 	u64 l2t_idx;
-	u64 len;
+	u64 entry;
 
-	l2t = NULL;
-
-	clust_off = get_cluster_offset(q, offset);
-	if (clust_off >= q->cluster_size)
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
 		return -1;
 
-	len = q->cluster_size - clust_off;
-	if (len > src_len)
-		len = src_len;
-
 	mutex_lock(&q->mutex);
 
-	if (get_cluster_table(q, offset, &l2t, &l2t_idx)) {
+	/* Nothing was ever allocated below this L1 entry */
+	if (!get_l2_table_offset(l1t, l1t_idx))
+		goto out;
+
+	if (get_cluster_table(q, offset, &l1t_idx, &l2t_idx)) {
 		pr_warning("Get l2 table error");
 		goto error;
 	}
 
-	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
-	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
+	if (qcow_l2_lookup(q, l1t_idx, l2t_idx, &entry) < 0)
+		goto error;
 
-	clust_start &= QCOW2_OFFSET_MASK;
-	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
-		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start < 0) {
-			pr_warning("Cluster alloc error");
-			goto error;
-		}
+	if (!entry)
+		goto out;
 
-		offset &= ~(q->cluster_size - 1);
+	if (qcow_l2_update(q, l1t_idx, l2t_idx, 0))
+		goto error;
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
-			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
-				pr_warning("Read copy cluster error");
-				qcow_free_clusters(q, clust_new_start,
-					q->cluster_size);
-				return -1;
-			}
-			mutex_lock(&q->mutex);
-		} else
-			memset(q->copy_buff, 0x00, q->cluster_size);
-
-		memcpy(q->copy_buff + clust_off, buf, len);
-
-		 /* Write actual data */
-		if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
-			clust_new_start) < 0)
-			goto free_cluster;
-
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
-
-		if (qcow_l2_cache_write(q, l2t))
-			goto free_cluster;
-
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
-
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+	if (qcow_free_l2_entry_deferred(q, entry) < 0)
+		goto error;
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
-			goto error;
-	}
+out:
 	mutex_unlock(&q->mutex);
-	return len;
-
-free_cluster:
-	qcow_free_clusters(q, clust_new_start, q->cluster_size);
+	return 0;
 
 error:
 	mutex_unlock(&q->mutex);
 	return -1;
 }
 
-static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, void *src, u32 src_len)
+static int qcow_disk_discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			     int flags)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_header *header = q->header;
-	u32 nr_written;
-	char *buf;
-	u64 offset;
-	ssize_t nr;
-
-	buf		= src;
-	nr_written	= 0;
-	offset		= sector << SECTOR_SHIFT;
-
-	while (nr_written < src_len) {
-		if (offset >= header->size)
-			return -1;
-
-		nr = qcow_write_cluster(q, offset, buf, src_len - nr_written);
-		if (nr < 0)
-			return -1;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 end = offset + (nr_sectors << SECTOR_SHIFT);
+	void *zero_buf = NULL;
+	u64 len;
+	int r = 0;
+
+	if (q->version != QCOW2_VERSION)
+		return -EOPNOTSUPP;
+
+	while (offset < end && !r) {
+		len = q->cluster_size - get_cluster_offset(q, offset);
+		if (len > end - offset)
+			len = end - offset;
+
+		if (len == q->cluster_size &&
+		    !(q->backing && (flags & DISK_IMAGE_DISCARD_ZERO))) {
+			r = qcow_discard_cluster(q, offset);
+		} else if (flags & DISK_IMAGE_DISCARD_ZERO) {
+			/*
+			 * Partial clusters have to be zeroed by hand, and so
+			 * do those that would show the backing file through.
+			 */
+			if (!zero_buf)
+				zero_buf = calloc(1, q->cluster_size);
+			if (!zero_buf) {
+				r = -ENOMEM;
+			} else {
+				struct iovec iov = { zero_buf, len };
+
+				if (qcow_write_iov(q, offset, &iov, 1) < 0)
+					r = -1;
+			}
+		}
 
-		nr_written	+= nr;
-		buf		+= nr;
-		offset		+= nr;
+		offset += len;
 	}
 
-	return nr_written;
+	free(zero_buf);
+
+	return r;
 }
 
-static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
+static int qcow_write_refcount_blocks(struct qcow *q)
 {
-	ssize_t nr, total = 0;
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	struct qcow_refcount_block *rfb;
 
-	while (iovcount--) {
-		nr = qcow_write_sector_single(disk, sector, iov->iov_base, iov->iov_len);
-		if (nr != (ssize_t)iov->iov_len) {
-			pr_info("qcow_write_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
+	list_for_each_entry(rfb, &rft->lru_list, list) {
+		if (write_refcount_block(q, rfb) < 0)
 			return -1;
-		}
-
-		sector	+= iov->iov_len >> SECTOR_SHIFT;
-		iov++;
-		total	+= nr;
 	}
 
-	return total;
+	return 0;
 }
 
-static int qcow_disk_flush(struct disk_image *disk)
+/*
+ * Write back dirty metadata, in an order that keeps the image consistent
+ * if we crash half way: refcounts and guest data have to be on disk
+ * before the L2 tables pointing at them, and clusters the L2 tables
+ * stopped using are only released after that. Called with q->mutex held.
+ */
+static int qcow_writeback(struct qcow *q)
 {
-	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
-	struct qcow_l1_table *l1t;
+	struct qcow_l1_table *l1t = &q->table;
+	bool l2_written = false;
+	int i, r = 0;
 
-	l1t = &q->table;
-	rft = &q->refcount_table;
+	if (qcow_write_refcount_blocks(q) < 0)
+		return -1;
 
-	mutex_lock(&q->mutex);
+	if (fdatasync(q->fd) < 0)
+		return -1;
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
+	mutex_lock(&l1t->lock);
+	for (i = 0; i < l1t->nr_cached && l1t->nr_dirty; i++) {
+		if (!l1t->nodes[i]->dirty)
+			continue;
 
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
+		r = qcow_l2_cache_write(q, l1t->nodes[i]);
+		if (r < 0)
+			break;
+
+		l2_written = true;
 	}
+	mutex_unlock(&l1t->lock);
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+	if (r < 0)
+		return r;
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
-	}
+	if (l2_written && fdatasync(q->fd) < 0)
+		return -1;
 
-	if (qcow_write_l1_table < 0)
-		goto error_unlock;
+	for (i = 0; i < q->nr_freed; i++)
+		qcow_free_l2_entry(q, q->freed_entries[i]);
+	q->nr_freed = 0;
 
-	mutex_unlock(&q->mutex);
+	return 0;
+}
 
-	return fsync(disk->fd);
+static int qcow_disk_flush(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+	int r;
 
-error_unlock:
+	mutex_lock(&q->mutex);
+	r = qcow_writeback(q);
 	mutex_unlock(&q->mutex);
-	return -1;
+
+	return r;
 }
 
 static int qcow_disk_close(struct disk_image *disk)
@@ -1166,32 +1796,79 @@ static int qcow_disk_close(struct disk_image *disk)
 
 	q = disk->priv;
 
+	/* Also write out the refcounts of the clusters released just now */
+	if (disk->ops->write) {
+		mutex_lock(&q->mutex);
+		if (qcow_writeback(q) < 0 || qcow_write_refcount_blocks(q) < 0 ||
+		    fdatasync(q->fd) < 0)
+			pr_warning("Error writing back qcow metadata");
+		mutex_unlock(&q->mutex);
+	}
+
+	qcow_zcache_free(q);
 	refcount_table_free_cache(&q->refcount_table);
 	l1_table_free_cache(&q->table);
-	free(q->copy_buff);
-	free(q->cluster_data);
-	free(q->cluster_cache);
 	free(q->refcount_table.rf_table);
 	free(q->table.l1_table);
 	free(q->header);
+	disk_image__close(q->backing);
 	free(q);
 
 	return 0;
 }
 
+static void qcow_cache_stats(struct disk_image *disk,
+			     struct disk_image_cache_stats *stats)
+{
+	struct qcow *q = disk->priv;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	struct qcow_zcache *zc = &q->zcache;
+
+	mutex_lock(&l1t->lock);
+	stats[DISK_IMAGE_CACHE_L2] = (struct disk_image_cache_stats) {
+		.hits		= l1t->hits,
+		.misses		= l1t->misses,
+		.nr_cached	= l1t->nr_cached,
+		.max_cached	= l1t->max_cached,
+	};
+	mutex_unlock(&l1t->lock);
+
+	mutex_lock(&q->mutex);
+	stats[DISK_IMAGE_CACHE_REFCOUNT] = (struct disk_image_cache_stats) {
+		.hits		= rft->hits,
+		.misses		= rft->misses,
+		.nr_cached	= rft->nr_cached,
+		.max_cached	= rft->max_cached,
+	};
+	mutex_unlock(&q->mutex);
+
+	mutex_lock(&zc->lock);
+	stats[DISK_IMAGE_CACHE_DECOMPRESSED] = (struct disk_image_cache_stats) {
+		.hits		= zc->hits,
+		.misses		= zc->misses,
+		.nr_cached	= zc->nr_cached,
+		.max_cached	= zc->max_cached,
+	};
+	mutex_unlock(&zc->lock);
+}
+
 static struct disk_image_operations qcow_disk_readonly_ops = {
-	.read	= qcow_read_sector,
-	.close	= qcow_disk_close,
+	.read		= qcow_read_sector,
+	.close		= qcow_disk_close,
+	.cache_stats	= qcow_cache_stats,
 };
 
 static struct disk_image_operations qcow_disk_ops = {
-	.read	= qcow_read_sector,
-	.write	= qcow_write_sector,
-	.flush	= qcow_disk_flush,
-	.close	= qcow_disk_close,
+	.read		= qcow_read_sector,
+	.write		= qcow_write_sector,
+	.flush		= qcow_disk_flush,
+	.discard	= qcow_disk_discard,
+	.close		= qcow_disk_close,
+	.cache_stats	= qcow_cache_stats,
 };
 
-static int qcow_read_refcount_table(struct qcow *q)
+static int qcow_read_refcount_table(struct qcow *q, u64 cache_size)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_refcount_table *rft = &q->refcount_table;
@@ -1203,7 +1880,13 @@ static int qcow_read_refcount_table(struct qcow *q)
 	if (!rft->rf_table)
 		return -1;
 
-	rft->root = RB_ROOT;
+	rft->cache = calloc(rft->rf_size, sizeof(*rft->cache));
+	rft->used_map = calloc(rft->rf_size, sizeof(*rft->used_map));
+	rft->nr_used = calloc(rft->rf_size, sizeof(*rft->nr_used));
+	if (!rft->cache || !rft->used_map || !rft->nr_used)
+		return -1;
+
+	rft->max_cached = qcow_cache_nodes(q, cache_size, rft->rf_size);
 	INIT_LIST_HEAD(&rft->lru_list);
 
 	return pread_in_full(q->fd, rft->rf_table, sizeof(u64) * rft->rf_size, header->refcount_table_offset);
@@ -1232,6 +1915,70 @@ static int qcow_read_l1_table(struct qcow *q)
 	return pread_in_full(q->fd, table->l1_table, sizeof(u64) * table->table_size, header->l1_table_offset);
 }
 
+static int qcow_backing_depth;
+
+/*
+ * Open the backing file named in the header, if there is one. Relative
+ * names are relative to the directory of the image itself. Backing files
+ * are always opened read-only, so several images can share one.
+ */
+static int qcow_open_backing(struct qcow *q)
+{
+	struct qcow_header *header = q->header;
+	struct disk_image_params params = {
+		.readonly	= true,
+		.zcache_mb	= -1,
+	};
+	char name[PATH_MAX], path[PATH_MAX], dir[PATH_MAX], link[32];
+	struct disk_image *backing;
+	ssize_t len;
+
+	if (!header->backing_file_offset || !header->backing_file_size)
+		return 0;
+
+	if (header->backing_file_size >= PATH_MAX)
+		return -1;
+
+	if (pread_in_full(q->fd, name, header->backing_file_size,
+			  header->backing_file_offset) < 0)
+		return -1;
+	name[header->backing_file_size] = '\0';
+
+	if (name[0] == '/') {
+		strcpy(path, name);
+	} else {
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", q->fd);
+		len = readlink(link, dir, sizeof(dir) - 1);
+		if (len < 0)
+			return -1;
+		dir[len] = '\0';
+
+		len = snprintf(path, sizeof(path), "%s/%s", dirname(dir), name);
+		if (len >= PATH_MAX)
+			return -1;
+	}
+
+	if (qcow_backing_depth == QCOW_MAX_BACKING_DEPTH) {
+		pr_warning("Backing file chain too long at '%s'", path);
+		return -1;
+	}
+
+	params.filename = path;
+
+	qcow_backing_depth++;
+	backing = disk_image__open(&params);
+	qcow_backing_depth--;
+
+	if (IS_ERR_OR_NULL(backing)) {
+		pr_warning("Could not open backing file '%s'", path);
+		return -1;
+	}
+
+	q->backing = backing;
+
+	return 0;
+}
+
 static void *qcow2_read_header(int fd)
 {
 	struct qcow2_header_disk f_header;
@@ -1268,15 +2015,17 @@ static void *qcow2_read_header(int fd)
 		.l2_bits		= f_header.cluster_bits - 3,
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+static struct disk_image *qcow2_probe(int fd, bool readonly,
+				      struct disk_image_params *params)
 {
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
 
@@ -1287,11 +2036,6 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	mutex_init(&q->mutex);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-
 	h = q->header = qcow2_read_header(fd);
 	if (!h)
 		goto free_qcow;
@@ -1302,29 +2046,19 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	q->cluster_offset_mask = (1LL << q->csize_shift) - 1;
 	q->cluster_size = 1 << q->header->cluster_bits;
 
-	q->copy_buff = malloc(q->cluster_size);
-	if (!q->copy_buff) {
-		pr_warning("copy buff malloc error");
+	if (qcow_read_l1_table(q) < 0)
 		goto free_header;
-	}
 
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
-		goto free_copy_buff;
-	}
+	if (qcow_l2_cache_init(q, params ? params->l2_cache_size : 0) < 0)
+		goto free_l1_table;
 
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
-	}
+	qcow_zcache_init(q, params ? params->zcache_mb : -1);
 
-	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+	if (qcow_read_refcount_table(q, params ? params->refcount_cache_size : 0) < 0)
+		goto free_refcount_table;
 
-	if (qcow_read_refcount_table(q) < 0)
-		goto free_l1_table;
+	if (qcow_open_backing(q) < 0)
+		goto free_refcount_table;
 
 	/*
 	 * Do not use mmap use read/write instead
@@ -1335,28 +2069,24 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (IS_ERR_OR_NULL(disk_image))
-		goto free_refcount_table;
+		goto close_backing;
 
 	disk_image->async = 0;
 	disk_image->priv = q;
 
 	return disk_image;
 
+close_backing:
+	disk_image__close(q->backing);
 free_refcount_table:
-	if (q->refcount_table.rf_table)
-		free(q->refcount_table.rf_table);
+	free(q->refcount_table.nr_used);
+	free(q->refcount_table.used_map);
+	free(q->refcount_table.cache);
+	free(q->refcount_table.rf_table);
+	l1_table_free_cache(&q->table);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
-free_copy_buff:
-	if (q->copy_buff)
-		free(q->copy_buff);
 free_header:
 	if (q->header)
 		free(q->header);
@@ -1411,18 +2141,20 @@ static void *qcow1_read_header(int fd)
 	*header		= (struct qcow_header) {
 		.size			= f_header.size,
 		.l1_table_offset	= f_header.l1_table_offset,
-		.l1_size		= f_header.size / ((1 << f_header.l2_bits) * (1 << f_header.cluster_bits)),
+		.l1_size		= DIV_ROUND_UP(f_header.size, (1ULL << f_header.l2_bits) << f_header.cluster_bits),
 		.cluster_bits		= f_header.cluster_bits,
 		.l2_bits		= f_header.l2_bits,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow1_probe(int fd, bool readonly)
+static struct disk_image *qcow1_probe(int fd, bool readonly,
+				      struct disk_image_params *params)
 {
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
 
@@ -1433,11 +2165,6 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	mutex_init(&q->mutex);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-
 	h = q->header = qcow1_read_header(fd);
 	if (!h)
 		goto free_qcow;
@@ -1447,46 +2174,40 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	q->cluster_offset_mask = (1LL << (63 - q->header->cluster_bits)) - 1;
 	q->free_clust_idx = 0;
 
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
+	if (qcow_read_l1_table(q) < 0)
 		goto free_header;
-	}
 
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
-	}
+	if (qcow_l2_cache_init(q, params ? params->l2_cache_size : 0) < 0)
+		goto free_l1_table;
 
-	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+	qcow_zcache_init(q, params ? params->zcache_mb : -1);
+
+	if (qcow_open_backing(q) < 0)
+		goto free_l2_cache;
+
+	/* There are no refcounts to allocate clusters with */
+	if (!readonly)
+		pr_warning("Forcing read-only support for QCOW version 1");
 
 	/*
 	 * Do not use mmap use read/write instead
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
-
-	if (!disk_image)
-		goto free_l1_table;
+	disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk_image))
+		goto close_backing;
 
 	disk_image->async = 1;
 	disk_image->priv = q;
 
 	return disk_image;
 
+close_backing:
+	disk_image__close(q->backing);
+free_l2_cache:
+	l1_table_free_cache(&q->table);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
 free_header:
 	if (q->header)
 		free(q->header);
@@ -1515,13 +2236,14 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+struct disk_image *qcow_probe(int fd, bool readonly,
+			      struct disk_image_params *params)
 {
 	if (qcow1_check_image(fd))
-		return qcow1_probe(fd, readonly);
+		return qcow1_probe(fd, readonly, params);
 
 	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+		return qcow2_probe(fd, readonly, params);
 
 	return NULL;
 }
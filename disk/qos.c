@@ -0,0 +1,169 @@
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+
+#include <linux/kernel.h>
+#include <time.h>
+
+/*
+ * Per-disk I/O limits. Each limited quantity is a token bucket filled at
+ * 'limit' per second up to 'burst'. A request takes what it needs from the
+ * buckets, possibly driving them negative, and the submitter then waits
+ * until they are back to zero: requests over the limit are delayed, never
+ * failed, and the long term rate converges to the limit.
+ */
+
+static const char * const disk_image_qos_names[DISK_IMAGE_QOS_NR] = {
+	[DISK_IMAGE_QOS_IOPS_RD]	= "iops_rd",
+	[DISK_IMAGE_QOS_IOPS_WR]	= "iops_wr",
+	[DISK_IMAGE_QOS_BPS_RD]		= "bps_rd",
+	[DISK_IMAGE_QOS_BPS_WR]		= "bps_wr",
+};
+
+/*
+ * Parse one "<name>=<n>" or "<name>_burst=<n>" option, n taking an optional
+ * K, M or G suffix. Returns false if 'arg' isn't an I/O limit.
+ */
+bool disk_image__qos_parse(struct disk_image_qos *qos, const char *arg)
+{
+	size_t len;
+	int i;
+
+	for (i = 0; i < DISK_IMAGE_QOS_NR; i++) {
+		len = strlen(disk_image_qos_names[i]);
+		if (strncmp(arg, disk_image_qos_names[i], len))
+			continue;
+
+		if (arg[len] == '=') {
+			qos->limit[i] = disk_image__parse_size(arg + len + 1);
+			return true;
+		}
+		if (strncmp(arg + len, "_burst=", 7) == 0) {
+			qos->burst[i] = disk_image__parse_size(arg + len + 7);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static u64 disk_image__qos_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double disk_image__qos_capacity(struct disk_image_qos *qos, int i)
+{
+	if (qos->burst[i])
+		return qos->burst[i];
+
+	/* Always let at least one request through without waiting */
+	return max(qos->limit[i] / 10.0, 1.0);
+}
+
+/* Called with qos_lock held */
+static void disk_image__qos_refill(struct disk_image *disk, u64 now)
+{
+	double elapsed = (now - disk->qos_time) / 1e9;
+	double cap;
+	int i;
+
+	for (i = 0; i < DISK_IMAGE_QOS_NR; i++) {
+		if (!disk->qos.limit[i])
+			continue;
+
+		cap = disk_image__qos_capacity(&disk->qos, i);
+		disk->qos_level[i] = min(disk->qos_level[i] +
+					 elapsed * disk->qos.limit[i], cap);
+	}
+
+	disk->qos_time = now;
+}
+
+void disk_image__qos_set(struct disk_image *disk, struct disk_image_qos *qos)
+{
+	u64 now = disk_image__qos_now();
+	double cap;
+	int i;
+
+	mutex_lock(&disk->qos_lock);
+	disk_image__qos_refill(disk, now);
+
+	disk->qos_enabled = false;
+	for (i = 0; i < DISK_IMAGE_QOS_NR; i++) {
+		if (!qos->limit[i])
+			continue;
+
+		/* Newly limited buckets start full, others keep their debt */
+		cap = disk_image__qos_capacity(qos, i);
+		if (!disk->qos.limit[i])
+			disk->qos_level[i] = cap;
+		else
+			disk->qos_level[i] = min(disk->qos_level[i], cap);
+
+		disk->qos_enabled = true;
+	}
+
+	disk->qos = *qos;
+	mutex_unlock(&disk->qos_lock);
+}
+
+/*
+ * Account for 'nr_ops' requests totalling 'bytes', and return how long in
+ * ns the caller has to wait before issuing them. 'qos_enabled' is read
+ * without locking: a request racing with a change of limits may go by the
+ * old ones.
+ */
+u64 disk_image__qos_charge(struct disk_image *disk, bool write, u64 nr_ops,
+			   u64 bytes)
+{
+	int ops = write ? DISK_IMAGE_QOS_IOPS_WR : DISK_IMAGE_QOS_IOPS_RD;
+	int bps = write ? DISK_IMAGE_QOS_BPS_WR : DISK_IMAGE_QOS_BPS_RD;
+	double wait = 0;
+
+	if (!disk->qos_enabled)
+		return 0;
+
+	mutex_lock(&disk->qos_lock);
+	disk_image__qos_refill(disk, disk_image__qos_now());
+
+	if (disk->qos.limit[ops]) {
+		disk->qos_level[ops] -= nr_ops;
+		if (disk->qos_level[ops] < 0)
+			wait = -disk->qos_level[ops] / disk->qos.limit[ops];
+	}
+
+	if (disk->qos.limit[bps]) {
+		disk->qos_level[bps] -= bytes;
+		if (disk->qos_level[bps] < 0)
+			wait = max(wait, -disk->qos_level[bps] / disk->qos.limit[bps]);
+	}
+	mutex_unlock(&disk->qos_lock);
+
+	return wait * 1e9;
+}
+
+void disk_image__qos_ipc(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
+{
+	struct disk_image_qos_msg *req = (void *)msg;
+	struct disk_image *disk;
+	int r = -EINVAL;
+
+	if (WARN_ON(type != KVM_IPC_DISK_QOS))
+		return;
+
+	if (len == sizeof(*req) && req->disk < (u32)kvm->nr_disks) {
+		disk = kvm->disks[req->disk];
+		if (disk && !disk->wwpn) {
+			disk_image__qos_set(disk, &req->qos);
+			r = 0;
+		}
+	}
+
+	if (write(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed answering I/O limits request");
+}
@@ -1,16 +1,25 @@
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 
 #ifdef CONFIG_HAS_AIO
 #include <libaio.h>
 #endif
 
+/* How far ahead sequential reads of mapped images are prefetched */
+#define RAW_MMAP_READAHEAD	(1ULL << 20)
+
 ssize_t raw_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
 	u64 offset = sector << SECTOR_SHIFT;
 
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk_uring__preadv(disk, iov, iovcount, offset, param);
+#endif
 #ifdef CONFIG_HAS_AIO
 	struct iocb iocb;
 
@@ -26,6 +35,10 @@ ssize_t raw_image__write(struct disk_image *disk, u64 sector, const struct iovec
 {
 	u64 offset = sector << SECTOR_SHIFT;
 
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk_uring__pwritev(disk, iov, iovcount, offset, param);
+#endif
 #ifdef CONFIG_HAS_AIO
 	struct iocb iocb;
 
@@ -36,12 +49,47 @@ ssize_t raw_image__write(struct disk_image *disk, u64 sector, const struct iovec
 #endif
 }
 
+/*
+ * When reads are sequential, have the kernel read the next window of the
+ * image in each time one is entered. 'next_read' is only a hint, racing
+ * updates to it are harmless.
+ */
+static void raw_image__readahead_mmap(struct disk_image *disk, u64 start,
+				      u64 end)
+{
+	u64 next;
+
+	if (start == disk->next_read &&
+	    start / RAW_MMAP_READAHEAD != end / RAW_MMAP_READAHEAD) {
+		next = ALIGN(end, RAW_MMAP_READAHEAD);
+		if (next < disk->size)
+			madvise(disk->priv + next,
+				min_t(u64, RAW_MMAP_READAHEAD, disk->size - next),
+				MADV_WILLNEED);
+	}
+
+	disk->next_read = end;
+}
+
+/* Requests come from the guest: keep them inside the mapping */
+static bool raw_image__mmap_in_range(struct disk_image *disk, u64 sector,
+				     const struct iovec *iov, int iovcount)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = iov_size(iov, iovcount);
+
+	return sector <= disk->size >> SECTOR_SHIFT && len <= disk->size - offset;
+}
+
 ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
 	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t total = 0;
 
+	if (!raw_image__mmap_in_range(disk, sector, iov, iovcount))
+		return -EINVAL;
+
 	while (iovcount--) {
 		memcpy(iov->iov_base, disk->priv + offset, iov->iov_len);
 
@@ -51,6 +99,8 @@ ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector, const struct i
 		iov++;
 	}
 
+	raw_image__readahead_mmap(disk, offset - total, offset);
+
 	return total;
 }
 
@@ -60,6 +110,9 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct
 	u64 offset = sector << SECTOR_SHIFT;
 	ssize_t total = 0;
 
+	if (!raw_image__mmap_in_range(disk, sector, iov, iovcount))
+		return -EINVAL;
+
 	while (iovcount--) {
 		memcpy(disk->priv + offset, iov->iov_base, iov->iov_len);
 
@@ -72,6 +125,99 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector, const struct
 	return total;
 }
 
+static ssize_t raw_image__write_shared(struct disk_image *disk, u64 sector,
+				       const struct iovec *iov, int iovcount,
+				       void *param)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	ssize_t total;
+
+	total = raw_image__write_mmap(disk, sector, iov, iovcount, param);
+	if (total < 0)
+		return total;
+
+	/* Remember what the next flush has to write back */
+	mutex_lock(&disk->mmap_lock);
+	disk->dirty_start = min(disk->dirty_start, offset);
+	disk->dirty_end = max(disk->dirty_end, offset + total);
+	mutex_unlock(&disk->mmap_lock);
+
+	return total;
+}
+
+static int raw_image__flush_shared(struct disk_image *disk)
+{
+	u64 page_size = getpagesize();
+	u64 start, end;
+
+	mutex_lock(&disk->mmap_lock);
+	start	= disk->dirty_start & ~(page_size - 1);
+	end	= disk->dirty_end;
+	disk->dirty_start	= disk->size;
+	disk->dirty_end		= 0;
+	mutex_unlock(&disk->mmap_lock);
+
+	if (start >= end)
+		return 0;
+
+	if (msync(disk->priv + start, end - start, MS_SYNC) == 0)
+		return 0;
+
+	/* Try again next time */
+	mutex_lock(&disk->mmap_lock);
+	disk->dirty_start = min(disk->dirty_start, start);
+	disk->dirty_end = max(disk->dirty_end, end);
+	mutex_unlock(&disk->mmap_lock);
+
+	return -errno;
+}
+
+static int raw_image__zero_fill(struct disk_image *disk, u64 offset, u64 len)
+{
+	static const char zeroes[64 * 1024];
+	ssize_t r;
+
+	while (len) {
+		r = pwrite_in_full(disk->fd, zeroes, min_t(u64, len, sizeof(zeroes)),
+				   offset);
+		if (r < 0)
+			return -errno;
+
+		offset	+= r;
+		len	-= r;
+	}
+
+	return 0;
+}
+
+static int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			      int flags)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+
+	/* A punched hole reads back as zeroes, so it serves both requests */
+	if (flags & DISK_IMAGE_DISCARD_UNMAP) {
+		if (!fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       offset, len))
+			return 0;
+		if (errno != EOPNOTSUPP)
+			return -errno;
+	}
+
+	/* Discard is only a hint, don't bother if the host can't do it */
+	if (!(flags & DISK_IMAGE_DISCARD_ZERO))
+		return 0;
+
+	if (!fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		       offset, len))
+		return 0;
+	if (errno != EOPNOTSUPP)
+		return -errno;
+
+	return raw_image__zero_fill(disk, offset, len);
+}
+
 int raw_image__close(struct disk_image *disk)
 {
 	int ret = 0;
@@ -92,8 +238,9 @@ int raw_image__close(struct disk_image *disk)
  * multiple buffer based disk image operations
  */
 static struct disk_image_operations raw_image_regular_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.discard	= raw_image__discard,
 };
 
 struct disk_image_operations ro_ops = {
@@ -106,11 +253,24 @@ struct disk_image_operations ro_ops_nowrite = {
 	.read	= raw_image__read,
 };
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
+/*
+ * Shared mapping: requests are served with memcpy() and no system call,
+ * flushes only write back what changed.
+ */
+static struct disk_image_operations raw_image_shared_ops = {
+	.read		= raw_image__read_mmap,
+	.write		= raw_image__write_shared,
+	.flush		= raw_image__flush_shared,
+	.discard	= raw_image__discard,
+	.close		= raw_image__close,
+};
+
+struct disk_image *raw_image__probe(int fd, struct stat *st,
+				    struct disk_image_params *params)
 {
 	struct disk_image *disk;
 
-	if (readonly) {
+	if (params->readonly) {
 		/*
 		 * Use mmap's MAP_PRIVATE to implement non-persistent write
 		 * FIXME: This does not work on 32-bit host.
@@ -127,15 +287,25 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 		}
 
 		return disk;
-	} else {
-		/*
-		 * Use read/write instead of mmap
-		 */
-		disk = disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
-#ifdef CONFIG_HAS_AIO
+	}
+
+	if (params->mmap) {
+		disk = disk_image__new(fd, st->st_size, &raw_image_shared_ops,
+				       DISK_IMAGE_MMAP_SHARED);
 		if (!IS_ERR_OR_NULL(disk))
-			disk->async = 1;
-#endif
-		return disk;
+			return disk;
+
+		pr_warning("'%s': mapping failed, using read/write instead",
+			   params->filename);
 	}
+
+	/*
+	 * Use read/write instead of mmap
+	 */
+	disk = disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+#ifdef CONFIG_HAS_AIO
+	if (!IS_ERR_OR_NULL(disk))
+		disk->async = 1;
+#endif
+	return disk;
 }
@@ -0,0 +1,542 @@
+#include "kvm/disk-image.h"
+#include "kvm/barrier.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <linux/io_uring.h>
+#include <linux/list.h>
+#include <linux/err.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define DISK_URING_ENTRIES	256
+
+/*
+ * Completions a disk can have outstanding: 16 virtio-blk queues of 256
+ * descriptors, more than virtio-scsi ever has on a LUN. A smaller CQ would
+ * overflow, so requests are held back once that many are in flight.
+ */
+#define DISK_URING_CQ_ENTRIES	(16 * 256)
+
+/* The kernel refuses to register a single buffer larger than 1GB */
+#define DISK_URING_BUF_MAX	(1ULL << 30)
+
+#define DISK_URING_SQ_IDLE_MS	1000
+
+struct disk_uring {
+	int			fd;
+	int			evt;
+	bool			sqpoll;
+	bool			fixed_file;
+	pthread_t		thread;
+
+	/* Submission ring, protected by sq_lock */
+	struct mutex		sq_lock;
+	u32			*sq_head;
+	u32			*sq_tail;
+	u32			*sq_flags;
+	u32			*sq_array;
+	u32			sq_mask;
+	u32			sq_entries;
+	u32			sq_pending;
+	u32			inflight;
+	struct io_uring_sqe	*sqes;
+
+	/* Completion ring, reaped under cq_lock */
+	struct mutex		cq_lock;
+	u32			*cq_head;
+	u32			*cq_tail;
+	u32			cq_mask;
+	u32			cq_entries;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+
+	/* Guest RAM registered with IORING_REGISTER_BUFFERS */
+	struct iovec		*bufs;
+	int			nr_bufs;
+};
+
+static int io_uring_setup(u32 entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, u32 opcode, void *arg, u32 nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int disk_uring__map(struct disk_uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(u32);
+	ring->cq_ring_size = p->cq_off.cqes +
+			     p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_RW,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return -errno;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_RW,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto unmap_sq;
+	}
+
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_RW,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	ring->sq_head	= ring->sq_ring + p->sq_off.head;
+	ring->sq_tail	= ring->sq_ring + p->sq_off.tail;
+	ring->sq_flags	= ring->sq_ring + p->sq_off.flags;
+	ring->sq_array	= ring->sq_ring + p->sq_off.array;
+	ring->sq_mask	= *(u32 *)(ring->sq_ring + p->sq_off.ring_mask);
+	ring->sq_entries = p->sq_entries;
+
+	ring->cq_head	= ring->cq_ring + p->cq_off.head;
+	ring->cq_tail	= ring->cq_ring + p->cq_off.tail;
+	ring->cq_mask	= *(u32 *)(ring->cq_ring + p->cq_off.ring_mask);
+	ring->cq_entries = p->cq_entries;
+	ring->cqes	= ring->cq_ring + p->cq_off.cqes;
+
+	return 0;
+
+unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	return -ENOMEM;
+}
+
+static void disk_uring__unmap(struct disk_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+/*
+ * Register guest RAM so that single-segment requests can use the
+ * READ_FIXED/WRITE_FIXED opcodes and skip the per-request page pinning.
+ */
+static void disk_uring__register_ram(struct kvm *kvm, struct disk_uring *ring)
+{
+	struct kvm_mem_bank *bank;
+	int nr = 0;
+	u64 off;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		nr += DIV_ROUND_UP(bank->size, DISK_URING_BUF_MAX);
+
+	ring->bufs = calloc(nr, sizeof(*ring->bufs));
+	if (!ring->bufs)
+		return;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		for (off = 0; off < bank->size; off += DISK_URING_BUF_MAX) {
+			ring->bufs[ring->nr_bufs++] = (struct iovec) {
+				.iov_base	= bank->host_addr + off,
+				.iov_len	= min(bank->size - off,
+						      DISK_URING_BUF_MAX),
+			};
+		}
+	}
+
+	if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+			      ring->bufs, ring->nr_bufs) < 0) {
+		pr_warning("io_uring: unable to register guest memory (%d)",
+			   errno);
+		free(ring->bufs);
+		ring->bufs = NULL;
+		ring->nr_bufs = 0;
+	}
+}
+
+static int disk_uring__find_buf(struct disk_uring *ring, const struct iovec *iov)
+{
+	int i;
+
+	for (i = 0; i < ring->nr_bufs; i++) {
+		void *start = ring->bufs[i].iov_base;
+		void *end = start + ring->bufs[i].iov_len;
+
+		if (iov->iov_base >= start && iov->iov_base + iov->iov_len <= end)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Push queued SQEs to the kernel. Must be called with sq_lock held. */
+static void __disk_uring__submit(struct disk_uring *ring)
+{
+	int r;
+
+	if (!ring->sq_pending)
+		return;
+
+	if (ring->sqpoll) {
+		/*
+		 * The kernel thread picks up new entries by itself, it only
+		 * needs a kick once it went to sleep after being idle.
+		 */
+		mb();
+		if (*ring->sq_flags & IORING_SQ_NEED_WAKEUP)
+			io_uring_enter(ring->fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+		ring->sq_pending = 0;
+		return;
+	}
+
+	while (ring->sq_pending) {
+		r = io_uring_enter(ring->fd, ring->sq_pending, 0, 0);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EINTR || errno == EBUSY) {
+				sched_yield();
+				continue;
+			}
+			pr_warning("io_uring_enter failed (%d)", errno);
+			break;
+		}
+		ring->sq_pending -= r;
+	}
+}
+
+/* Grab a free SQE, making room if needed. Must be called with sq_lock held. */
+static struct io_uring_sqe *disk_uring__get_sqe(struct disk_uring *ring)
+{
+	u32 tail, head;
+
+	/* Never have more requests in flight than the CQ has room for */
+	while (ring->inflight >= ring->cq_entries) {
+		__disk_uring__submit(ring);
+		mutex_unlock(&ring->sq_lock);
+		sched_yield();
+		mutex_lock(&ring->sq_lock);
+	}
+
+	tail = *ring->sq_tail;
+	for (;;) {
+		head = *(volatile u32 *)ring->sq_head;
+		rmb();
+		if (tail - head < ring->sq_entries)
+			break;
+
+		/* Ring is full: without SQPOLL submitting drains it right away */
+		__disk_uring__submit(ring);
+		if (ring->sqpoll)
+			sched_yield();
+	}
+
+	ring->inflight++;
+	return &ring->sqes[tail & ring->sq_mask];
+}
+
+static void disk_uring__queue_sqe(struct disk_uring *ring, struct io_uring_sqe *sqe)
+{
+	u32 tail = *ring->sq_tail;
+	u32 idx = tail & ring->sq_mask;
+
+	ring->sq_array[idx] = sqe - ring->sqes;
+
+	/* The SQE has to be visible before the kernel can see the new tail */
+	wmb();
+	*(volatile u32 *)ring->sq_tail = tail + 1;
+
+	ring->sq_pending++;
+}
+
+static ssize_t disk_uring__rw(struct disk_image *disk, u8 opcode, u8 fixed_opcode,
+			      const struct iovec *iov, int iovcount, u64 offset,
+			      void *param)
+{
+	struct disk_uring *ring = disk->uring;
+	struct io_uring_sqe *sqe;
+	int buf = -1;
+
+	if (iovcount == 1)
+		buf = disk_uring__find_buf(ring, iov);
+
+	mutex_lock(&ring->sq_lock);
+
+	sqe = disk_uring__get_sqe(ring);
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (buf >= 0) {
+		sqe->opcode	= fixed_opcode;
+		sqe->addr	= (unsigned long)iov->iov_base;
+		sqe->len	= iov->iov_len;
+		sqe->buf_index	= buf;
+	} else {
+		sqe->opcode	= opcode;
+		sqe->addr	= (unsigned long)iov;
+		sqe->len	= iovcount;
+	}
+
+	if (ring->fixed_file) {
+		sqe->fd		= 0;
+		sqe->flags	= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd		= disk->fd;
+	}
+	sqe->off	= offset;
+	sqe->user_data	= (unsigned long)param;
+
+	disk_uring__queue_sqe(ring, sqe);
+
+	mutex_unlock(&ring->sq_lock);
+
+	return 0;
+}
+
+ssize_t disk_uring__preadv(struct disk_image *disk, const struct iovec *iov,
+			   int iovcount, u64 offset, void *param)
+{
+	return disk_uring__rw(disk, IORING_OP_READV, IORING_OP_READ_FIXED,
+			      iov, iovcount, offset, param);
+}
+
+ssize_t disk_uring__pwritev(struct disk_image *disk, const struct iovec *iov,
+			    int iovcount, u64 offset, void *param)
+{
+	return disk_uring__rw(disk, IORING_OP_WRITEV, IORING_OP_WRITE_FIXED,
+			      iov, iovcount, offset, param);
+}
+
+void disk_uring__submit(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+
+	mutex_lock(&ring->sq_lock);
+	__disk_uring__submit(ring);
+	mutex_unlock(&ring->sq_lock);
+}
+
+/*
+ * Complete every request the kernel is done with, as few batches as the
+ * ring holds. Called with cq_lock held.
+ */
+static int __disk_uring__reap(struct disk_image *disk)
+{
+	struct disk_image_completion c[DISK_URING_ENTRIES];
+	struct disk_uring *ring = disk->uring;
+	struct io_uring_cqe *cqe;
+	u32 head, tail;
+	int nr, total = 0;
+
+	head = *ring->cq_head;
+
+	for (;;) {
+		tail = *(volatile u32 *)ring->cq_tail;
+		rmb();
+		if (head == tail) {
+			/* Completions the CQ had no room for wait for a flush */
+			if (!(*(volatile u32 *)ring->sq_flags & IORING_SQ_CQ_OVERFLOW))
+				break;
+			if (io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS) < 0 &&
+			    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				break;
+			continue;
+		}
+
+		for (nr = 0; head != tail && nr < DISK_URING_ENTRIES; nr++, head++) {
+			cqe		= &ring->cqes[head & ring->cq_mask];
+			c[nr].param	= (void *)(unsigned long)cqe->user_data;
+			c[nr].len	= cqe->res;
+		}
+
+		/* Release the CQEs to the kernel before completing */
+		mb();
+		*(volatile u32 *)ring->cq_head = head;
+
+		mutex_lock(&ring->sq_lock);
+		ring->inflight -= nr;
+		mutex_unlock(&ring->sq_lock);
+
+		disk_image__complete(disk, c, nr);
+		total += nr;
+	}
+
+	return total;
+}
+
+/*
+ * Reap completions without waiting for the eventfd, for polling I/O
+ * threads. If the completion thread is already at it, leave it be.
+ */
+int disk_uring__poll(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+	int nr;
+
+	if (!mutex_trylock(&ring->cq_lock))
+		return 0;
+
+	nr = __disk_uring__reap(disk);
+	mutex_unlock(&ring->cq_lock);
+
+	return nr;
+}
+
+static void *disk_uring__thread(void *param)
+{
+	struct disk_image *disk = param;
+	struct disk_uring *ring = disk->uring;
+	u64 dummy;
+
+	kvm__set_thread_name("disk-uring-io");
+
+	while (read(ring->evt, &dummy, sizeof(dummy)) > 0) {
+		mutex_lock(&ring->cq_lock);
+		__disk_uring__reap(disk);
+		mutex_unlock(&ring->cq_lock);
+	}
+
+	return NULL;
+}
+
+static int disk_uring__setup(struct io_uring_params *p, bool sqpoll)
+{
+	int fd;
+
+	memset(p, 0, sizeof(*p));
+	if (sqpoll) {
+		p->flags = IORING_SETUP_SQPOLL;
+		p->sq_thread_idle = DISK_URING_SQ_IDLE_MS;
+	}
+
+	p->flags |= IORING_SETUP_CQSIZE;
+	p->cq_entries = DISK_URING_CQ_ENTRIES;
+
+	fd = io_uring_setup(DISK_URING_ENTRIES, p);
+	if (fd >= 0 || errno != EINVAL)
+		return fd;
+
+	/* Older kernels size the CQ themselves, in-flight requests are capped */
+	p->flags &= ~IORING_SETUP_CQSIZE;
+	p->cq_entries = 0;
+
+	return io_uring_setup(DISK_URING_ENTRIES, p);
+}
+
+int disk_uring__init(struct kvm *kvm, struct disk_image *disk, bool sqpoll)
+{
+	struct io_uring_params p;
+	struct disk_uring *ring;
+	int fds[1] = { disk->fd };
+	int r;
+
+	/* Only formats that map sectors 1:1 onto the backing fd can use it */
+	if (disk->ops->read != raw_image__read)
+		return -EOPNOTSUPP;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+
+	mutex_init(&ring->sq_lock);
+	mutex_init(&ring->cq_lock);
+
+	ring->fd = disk_uring__setup(&p, sqpoll);
+	if (ring->fd < 0 && sqpoll) {
+		pr_warning("io_uring: SQPOLL unavailable (%d), falling back to "
+			   "io_uring_enter submission", errno);
+		ring->fd = disk_uring__setup(&p, false);
+	}
+	if (ring->fd < 0) {
+		r = -errno;
+		goto free_ring;
+	}
+	ring->sqpoll = p.flags & IORING_SETUP_SQPOLL;
+
+	r = disk_uring__map(ring, &p);
+	if (r < 0)
+		goto close_ring;
+
+	ring->evt = eventfd(0, 0);
+	if (ring->evt < 0) {
+		r = -errno;
+		goto unmap_ring;
+	}
+
+	if (io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &ring->evt, 1) < 0) {
+		r = -errno;
+		goto close_evt;
+	}
+
+	if (io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, 1) == 0)
+		ring->fixed_file = true;
+
+	disk_uring__register_ram(kvm, ring);
+
+	disk->uring = ring;
+	disk->async = 1;
+
+	r = pthread_create(&ring->thread, NULL, disk_uring__thread, disk);
+	if (r) {
+		disk->uring = NULL;
+		disk->async = 0;
+		r = -r;
+		goto free_bufs;
+	}
+
+	return 0;
+
+free_bufs:
+	free(ring->bufs);
+close_evt:
+	close(ring->evt);
+unmap_ring:
+	disk_uring__unmap(ring);
+close_ring:
+	close(ring->fd);
+free_ring:
+	free(ring);
+	return r;
+}
+
+void disk_uring__exit(struct disk_image *disk)
+{
+	struct disk_uring *ring = disk->uring;
+
+	if (!ring)
+		return;
+
+	pthread_cancel(ring->thread);
+	pthread_join(ring->thread, NULL);
+
+	disk_uring__unmap(ring);
+	close(ring->fd);
+	close(ring->evt);
+	free(ring->bufs);
+	free(ring);
+
+	disk->uring = NULL;
+}
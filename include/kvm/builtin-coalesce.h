@@ -0,0 +1,9 @@
+#ifndef KVM__COALESCE_H
+#define KVM__COALESCE_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_coalesce(int argc, const char **argv, const char *prefix);
+void kvm_coalesce_help(void) NORETURN;
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef KVM__IOLIMIT_H
+#define KVM__IOLIMIT_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_iolimit(int argc, const char **argv, const char *prefix);
+void kvm_iolimit_help(void) NORETURN;
+
+#endif
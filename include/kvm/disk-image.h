@@ -4,6 +4,7 @@
 #include "kvm/read-write.h"
 #include "kvm/util.h"
 #include "kvm/parse-options.h"
+#include "kvm/mutex.h"
 
 #include <linux/types.h>
 #include <linux/fs.h>	/* for BLKGETSIZE64 */
@@ -25,11 +26,82 @@
 enum {
 	DISK_IMAGE_REGULAR,
 	DISK_IMAGE_MMAP,
+	DISK_IMAGE_MMAP_SHARED,
 };
 
-#define MAX_DISK_IMAGES         4
+enum {
+	DISK_IMAGE_AIO_DEFAULT,
+	DISK_IMAGE_AIO_IO_URING,
+};
+
+/* Flags for disk_image_operations::discard */
+#define DISK_IMAGE_DISCARD_UNMAP	(1 << 0)	/* may deallocate the range */
+#define DISK_IMAGE_DISCARD_ZERO		(1 << 1)	/* range must read back as zeroes */
+
+#define MAX_DISK_IMAGES         64
+
+/* Metadata cache size asking for the whole image to be covered */
+#define DISK_IMAGE_CACHE_ALL		((u64)-1)
+
+enum {
+	DISK_IMAGE_CACHE_L2,
+	DISK_IMAGE_CACHE_REFCOUNT,
+	DISK_IMAGE_CACHE_DECOMPRESSED,
+	DISK_IMAGE_CACHE_NR,
+};
+
+/* Sent in reply to KVM_IPC_DISK_STAT, for each cache of each disk */
+struct disk_image_cache_stats {
+	u64	hits;
+	u64	misses;
+	u32	nr_cached;
+	u32	max_cached;
+};
+
+/* Longest an I/O thread polls for requests by default with ",poll" */
+#define DISK_IMAGE_POLL_DEFAULT_US	32
+
+/*
+ * Sent after the cache stats in reply to KVM_IPC_DISK_STAT, for each I/O
+ * thread of each disk that polls
+ */
+struct disk_image_poll_stats {
+	u64	hits;		/* polls that found work */
+	u64	misses;		/* polls that timed out */
+	u32	window_ns;	/* current polling time */
+	u32	pad;
+};
+
+/* Token buckets limiting the rate of requests to a disk */
+enum {
+	DISK_IMAGE_QOS_IOPS_RD,
+	DISK_IMAGE_QOS_IOPS_WR,
+	DISK_IMAGE_QOS_BPS_RD,
+	DISK_IMAGE_QOS_BPS_WR,
+	DISK_IMAGE_QOS_NR,
+};
+
+struct disk_image_qos {
+	u64	limit[DISK_IMAGE_QOS_NR];	/* per second, 0 for none */
+	u64	burst[DISK_IMAGE_QOS_NR];	/* 0 for a tenth of the limit */
+};
+
+/* Sent with KVM_IPC_DISK_QOS, answered with an int status */
+struct disk_image_qos_msg {
+	u32			disk;
+	u32			pad;
+	struct disk_image_qos	qos;
+};
+
+/* An asynchronous request that finished, see disk_image__complete() */
+struct disk_image_completion {
+	void	*param;
+	long	len;
+};
 
 struct disk_image;
+struct disk_uring;
+struct kvm;
 
 struct disk_image_operations {
 	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
@@ -37,7 +109,11 @@ struct disk_image_operations {
 	ssize_t (*write)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 			int iovcount, void *param);
 	int (*flush)(struct disk_image *disk);
+	int (*discard)(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			int flags);
 	int (*close)(struct disk_image *disk);
+	void (*cache_stats)(struct disk_image *disk,
+			    struct disk_image_cache_stats *stats);
 };
 
 struct disk_image_params {
@@ -49,7 +125,19 @@ struct disk_image_params {
 	const char *wwpn;
 	const char *tpgt;
 	bool readonly;
+	bool rw;		/* let qcow images be written to */
 	bool direct;
+	bool mmap;
+	bool scsi;		/* a LUN of the emulated virtio-scsi controller */
+	bool detect_zeroes;	/* deallocate instead of writing zeroes */
+	int queues;
+	int aio;
+	bool sqpoll;
+	int zcache_mb;		/* -1 for the default */
+	u64 l2_cache_size;	/* in bytes, 0 for the default */
+	u64 refcount_cache_size;
+	u32 poll_us;		/* 0 to not poll */
+	struct disk_image_qos qos;
 };
 
 struct disk_image {
@@ -59,28 +147,70 @@ struct disk_image {
 	void				*priv;
 	void				*disk_req_cb_param;
 	void				(*disk_req_cb)(void *param, long len);
+	void				(*disk_req_batch_cb)(struct disk_image_completion *c,
+							     int nr);
 	bool				async;
 	int				evt;
 #ifdef CONFIG_HAS_AIO
 	io_context_t			ctx;
+#endif
+#ifdef CONFIG_HAS_IO_URING
+	struct disk_uring		*uring;
 #endif
 	const char			*wwpn;
 	const char			*tpgt;
 	int				debug_iodelay;
+	int				queues;
+	bool				scsi;
+	bool				detect_zeroes;
+
+	/* Polling I/O threads: how long at most, and their statistics */
+	u32				poll_ns;
+	u32				nr_poll_stats;
+	struct disk_image_poll_stats	*poll_stats;
+
+	/* Mapped images: range written since the last flush, readahead hint */
+	struct mutex			mmap_lock;
+	u64				dirty_start;
+	u64				dirty_end;
+	u64				next_read;
+
+	/* I/O limits: bucket levels as of 'qos_time', in ns */
+	struct mutex			qos_lock;
+	struct disk_image_qos		qos;
+	bool				qos_enabled;
+	double				qos_level[DISK_IMAGE_QOS_NR];
+	u64				qos_time;
 };
 
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset);
 int disk_image__init(struct kvm *kvm);
 int disk_image__exit(struct kvm *kvm);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
+struct disk_image *disk_image__open(struct disk_image_params *params);
+int disk_image__close(struct disk_image *disk);
 int disk_image__flush(struct disk_image *disk);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			int flags);
+int disk_image__read_sync(struct disk_image *disk, u64 sector,
+			  const struct iovec *iov, int iovcount);
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *len);
+void disk_image__submit(struct disk_image *disk);
+int disk_image__poll(struct disk_image *disk);
+u64 disk_image__parse_size(const char *arg);
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
+bool disk_image__qos_parse(struct disk_image_qos *qos, const char *arg);
+void disk_image__qos_set(struct disk_image *disk, struct disk_image_qos *qos);
+u64 disk_image__qos_charge(struct disk_image *disk, bool write, u64 nr_ops,
+			   u64 bytes);
+void disk_image__qos_ipc(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg);
+
+struct disk_image *raw_image__probe(int fd, struct stat *st,
+				    struct disk_image_params *params);
 struct disk_image *blkdev__probe(const char *filename, int flags, struct stat *st);
 
 ssize_t raw_image__read(struct disk_image *disk, u64 sector,
@@ -93,4 +223,19 @@ ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
 int raw_image__close(struct disk_image *disk);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
+void disk_image__set_batch_callback(struct disk_image *disk,
+				    void (*cb)(struct disk_image_completion *c, int nr));
+void disk_image__complete(struct disk_image *disk,
+			  struct disk_image_completion *c, int nr);
+
+#ifdef CONFIG_HAS_IO_URING
+int disk_uring__init(struct kvm *kvm, struct disk_image *disk, bool sqpoll);
+void disk_uring__exit(struct disk_image *disk);
+void disk_uring__submit(struct disk_image *disk);
+int disk_uring__poll(struct disk_image *disk);
+ssize_t disk_uring__preadv(struct disk_image *disk, const struct iovec *iov,
+			   int iovcount, u64 offset, void *param);
+ssize_t disk_uring__pwritev(struct disk_image *disk, const struct iovec *iov,
+			    int iovcount, u64 offset, void *param);
+#endif
 #endif /* KVM__DISK_IMAGE_H */
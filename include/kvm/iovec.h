@@ -1,12 +1,17 @@
 #ifndef KVM_UTIL_IOVEC_H_
 #define KVM_UTIL_IOVEC_H_
 
+#include <stdbool.h>
+
 extern int memcpy_fromiovec(unsigned char *kdata, struct iovec *iov, int len);
 extern int memcpy_fromiovecend(unsigned char *kdata, const struct iovec *iov,
 				size_t offset, int len);
 extern int memcpy_toiovec(struct iovec *v, unsigned char *kdata, int len);
 extern int memcpy_toiovecend(const struct iovec *v, unsigned char *kdata,
 				size_t offset, int len);
+bool iov_is_zero(const struct iovec *iov, int iovcount);
+size_t iov_slice(struct iovec *dst, int *dst_cnt, int max,
+		 const struct iovec *src, int src_cnt, size_t skip, size_t len);
 
 static inline size_t iov_size(const struct iovec *iovec, size_t len)
 {
@@ -2,6 +2,7 @@
 #define KVM_CONFIG_H_
 
 #include "kvm/disk-image.h"
+#include "kvm/virtio-coalesce.h"
 #include "kvm/kvm-config-arch.h"
 
 #define DEFAULT_KVM_DEV		"/dev/kvm"
@@ -46,6 +47,8 @@ struct kvm_config {
 	const char *custom_rootfs_name;
 	const char *real_cmdline;
 	struct virtio_net_params *net_params;
+	struct virtio_coalesce_msg irq_coalesce[VIRTIO_COALESCE_MAX_DEVS];
+	int nr_irq_coalesce;
 	bool single_step;
 	bool vnc;
 	bool gtk;
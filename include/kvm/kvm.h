@@ -57,6 +57,12 @@ struct kvm {
 	void			*ram_start;
 	u64			ram_pagesize;
 	struct list_head	mem_banks;
+	/*
+	 * The same banks, sorted by guest address. Only changed before the
+	 * guest runs, lookups don't lock.
+	 */
+	struct kvm_mem_bank	**mem_bank_index;
+	u32			nr_mem_banks;
 
 	bool			nmi_disabled;
 
@@ -106,6 +112,7 @@ bool kvm__arch_cpu_supports_vm(void);
 void kvm__arch_read_term(struct kvm *kvm);
 
 void *guest_flat_to_host(struct kvm *kvm, u64 offset);
+void *guest_flat_to_host_range(struct kvm *kvm, u64 offset, u64 len);
 u64 host_to_guest_flat(struct kvm *kvm, void *ptr);
 
 int load_flat_binary(struct kvm *kvm, int fd_kernel, int fd_initrd, const char *kernel_cmdline);
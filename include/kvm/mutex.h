@@ -36,4 +36,9 @@ static inline void mutex_unlock(struct mutex *lock)
 		die("unexpected pthread_mutex_unlock() failure!");
 }
 
+static inline bool mutex_trylock(struct mutex *lock)
+{
+	return pthread_mutex_trylock(&lock->mutex) == 0;
+}
+
 #endif /* KVM__MUTEX_H */
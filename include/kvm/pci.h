@@ -57,6 +57,14 @@ struct msix_cap {
 	u32 pba_offset;
 };
 
+struct pci_device_header;
+
+/* Called after the guest wrote 'size' bytes at 'offset' of config space */
+struct pci_config_operations {
+	void (*write)(struct kvm *kvm, struct pci_device_header *pci_hdr,
+		      u8 offset, void *data, int size);
+};
+
 struct pci_device_header {
 	u16		vendor_id;
 	u16		device_id;
@@ -82,9 +90,14 @@ struct pci_device_header {
 	u8		max_lat;
 	struct msix_cap msix;
 	u8		empty[136]; /* Rest of PCI config space */
+
+	/* Private to lkvm, not visible to the guest */
 	u32		bar_size[6];
+	struct pci_config_operations cfg_ops;
 } __attribute__((packed));
 
+#define PCI_DEV_CFG_SIZE	offsetof(struct pci_device_header, bar_size)
+
 int pci__init(struct kvm *kvm);
 int pci__exit(struct kvm *kvm);
 struct pci_device_header *pci__find_dev(u8 dev_num);
@@ -22,13 +22,22 @@
 
 #define QCOW2_OFFSET_MASK	(~QCOW2_OFLAGS_MASK)
 
-#define MAX_CACHE_NODES         32
+#define MAX_CACHE_NODES         32	/* default size of the metadata caches */
+#define MIN_CACHE_NODES		4
+
+#define QCOW_MAX_FREED_ENTRIES	1024
+
+#define QCOW_MAX_BACKING_DEPTH	16
+
+/* Default memory budget of the decompressed cluster cache, in MB */
+#define QCOW_ZCACHE_DEFAULT_MB	8
 
 struct qcow_l2_table {
 	u64				offset;
-	struct rb_node			node;
-	struct list_head		list;
+	u64				l1_idx;
+	u32				seq;	/* odd while the table is refilled */
 	u8				dirty;
+	u8				referenced;
 	u64				table[];
 };
 
@@ -36,17 +45,30 @@ struct qcow_l1_table {
 	u32				table_size;
 	u64				*l1_table;
 
-	/* Level2 caching data structures */
-	struct rb_root			root;
-	struct list_head		lru_list;
+	/*
+	 * Level2 caching data structures. Cached tables are found through
+	 * 'cache', which is indexed like the L1 table and read without
+	 * locking. 'lock' serializes filling, evicting and updating them.
+	 */
+	struct qcow_l2_table		**cache;
+	struct qcow_l2_table		**nodes;
 	int				nr_cached;
+	int				nr_dirty;
+	int				max_cached;
+	int				clock_hand;
+	u64				last_miss;
+	struct mutex			lock;
+
+	/* Statistics. Hits are counted without locking, so are approximate. */
+	u64				hits;
+	u64				misses;
 };
 
 #define QCOW_REFCOUNT_BLOCK_SHIFT	1
 
 struct qcow_refcount_block {
 	u64				offset;
-	struct rb_node			node;
+	u64				rft_idx;
 	struct list_head		list;
 	u64				size;
 	u8				dirty;
@@ -57,10 +79,42 @@ struct qcow_refcount_table {
 	u32				rf_size;
 	u64				*rf_table;
 
-	/* Refcount block caching data structures */
+	/*
+	 * Refcount block caching data structures. 'cache' is indexed like
+	 * the refcount table.
+	 */
+	struct qcow_refcount_block	**cache;
+	struct list_head		lru_list;
+	int				nr_cached;
+	int				max_cached;
+
+	u64				hits;
+	u64				misses;
+
+	/*
+	 * Free space index: for each refcount block, a bitmap of the
+	 * clusters in use and how many there are. Built when first needed.
+	 */
+	unsigned long			**used_map;
+	u32				*nr_used;
+};
+
+/* A compressed cluster, decompressed */
+struct qcow_zcache_entry {
+	u64				offset;	/* of the compressed data */
+	struct rb_node			node;
+	struct list_head		list;
+	u8				data[];
+};
+
+struct qcow_zcache {
 	struct rb_root			root;
 	struct list_head		lru_list;
 	int				nr_cached;
+	int				max_cached;
+	u64				hits;
+	u64				misses;
+	struct mutex			lock;
 };
 
 struct qcow_header {
@@ -71,13 +125,18 @@ struct qcow_header {
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u64				backing_file_offset;
+	u32				backing_file_size;
 };
 
 struct qcow {
+	/* Serializes cluster allocation and metadata updates */
 	struct mutex			mutex;
 	struct qcow_header		*header;
 	struct qcow_l1_table		table;
 	struct qcow_refcount_table	refcount_table;
+	struct qcow_zcache		zcache;
+	struct disk_image		*backing;	/* read-only, or NULL */
 	int				fd;
 	int				csize_shift;
 	int				csize_mask;
@@ -85,9 +144,13 @@ struct qcow {
 	u64				cluster_size;
 	u64				cluster_offset_mask;
 	u64				free_clust_idx;
-	void				*cluster_cache;
-	void				*cluster_data;
-	void				*copy_buff;
+
+	/*
+	 * L2 entries dropped since the last metadata writeback. Their
+	 * clusters are released once the updated tables are on disk.
+	 */
+	int				nr_freed;
+	u64				freed_entries[QCOW_MAX_FREED_ENTRIES];
 };
 
 struct qcow1_header_disk {
@@ -128,6 +191,10 @@ struct qcow2_header_disk {
 	u64				snapshots_offset;
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+struct disk_image;
+struct disk_image_params;
+
+struct disk_image *qcow_probe(int fd, bool readonly,
+			      struct disk_image_params *params);
 
 #endif /* KVM__QCOW_H */
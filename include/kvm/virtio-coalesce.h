@@ -0,0 +1,35 @@
+#ifndef KVM__VIRTIO_COALESCE_H
+#define KVM__VIRTIO_COALESCE_H
+
+#include <linux/types.h>
+#include <stdbool.h>
+
+#define VIRTIO_COALESCE_NAME_LEN	16
+#define VIRTIO_COALESCE_MAX_DEVS	32
+
+/* Interrupt moderation of a device's queues, see virtio/coalesce.c */
+struct virtio_coalesce {
+	u32	max_frames;	/* completions per interrupt, 0 for no limit */
+	u32	max_usecs;	/* longest delay of an interrupt, 0 for none */
+	bool	adaptive;
+};
+
+/* Settings of device 'dev', e.g. "net0" */
+struct virtio_coalesce_msg {
+	char			dev[VIRTIO_COALESCE_NAME_LEN];
+	struct virtio_coalesce	params;
+};
+
+struct kvm;
+struct option;
+struct virtio_device;
+
+int virtio_coalesce__parse(struct virtio_coalesce *coalesce, const char *arg);
+int irq_coalesce_parser(const struct option *opt, const char *arg, int unset);
+
+void virtio_coalesce__register(struct kvm *kvm, struct virtio_device *vdev,
+			       int subsys_id);
+bool virtio_coalesce__defer(struct kvm *kvm, struct virtio_device *vdev,
+			    u32 queueid);
+
+#endif /* KVM__VIRTIO_COALESCE_H */
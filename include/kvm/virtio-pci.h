@@ -5,10 +5,25 @@
 #include "kvm/pci.h"
 
 #include <linux/types.h>
+#include <linux/virtio_pci.h>
 
 #define VIRTIO_PCI_MAX_VQ	32
 #define VIRTIO_PCI_MAX_CONFIG	1
 
+/*
+ * Layout of the modern (virtio 1.0) interface, in a memory BAR of its own.
+ * Each queue has a notification address, so that ioeventfds on MMIO don't
+ * need to look at the data written.
+ */
+#define VIRTIO_PCI_MODERN_BAR		3
+#define VIRTIO_PCI_MODERN_COMMON	0x000
+#define VIRTIO_PCI_MODERN_ISR		0x100
+#define VIRTIO_PCI_MODERN_NOTIFY	0x200
+#define VIRTIO_PCI_MODERN_DEVICE	0x300
+#define VIRTIO_PCI_MODERN_SIZE		0x400
+
+#define VIRTIO_PCI_MODERN_NOTIFY_MULT	4
+
 struct kvm;
 
 struct virtio_pci_ioevent_param {
@@ -17,6 +32,15 @@ struct virtio_pci_ioevent_param {
 };
 
 #define VIRTIO_PCI_F_SIGNAL_MSI (1 << 0)
+#define VIRTIO_PCI_F_IRQFD	(1 << 1)
+
+/* Vendor capabilities pointing the driver at the modern interface */
+struct virtio_pci_modern_caps {
+	struct virtio_pci_cap		common;
+	struct virtio_pci_notify_cap	notify;
+	struct virtio_pci_cap		isr;
+	struct virtio_pci_cap		device;
+};
 
 struct virtio_pci {
 	struct pci_device_header pci_hdr;
@@ -26,21 +50,34 @@ struct virtio_pci {
 
 	u16			port_addr;
 	u32			mmio_addr;
+	u32			modern_addr;
 	u8			status;
 	u8			isr;
 	u32			features;
 
+	/* Modern feature negotiation */
+	u32			device_features_sel;
+	u32			driver_features_sel;
+	u64			driver_features;
+
 	/* MSI-X */
 	u16			config_vector;
-	u32			config_gsi;
 	u32			vq_vector[VIRTIO_PCI_MAX_VQ];
-	u32			gsis[VIRTIO_PCI_MAX_VQ];
 	u32			msix_io_block;
+	struct mutex		msix_lock;	/* protects msix_pba updates */
 	u64			msix_pba;
 	struct msix_table	msix_table[VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG];
 
+	/*
+	 * Vectors get a GSI routed to their message once used, 0 until then,
+	 * and an irqfd to interrupt the guest with a single write.
+	 */
+	u32			msix_gsi[VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG];
+	int			msix_irqfd[VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG];
+
 	/* virtio queue */
 	u16			queue_selector;
+	u32			queues_enabled;	/* modern only */
 	struct virtio_pci_ioevent_param ioeventfds[VIRTIO_PCI_MAX_VQ];
 };
 
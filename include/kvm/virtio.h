@@ -6,10 +6,12 @@
 #include <linux/virtio_ring.h>
 #include <linux/virtio_pci.h>
 
+#include <linux/list.h>
 #include <linux/types.h>
 #include <sys/uio.h>
 
 #include "kvm/kvm.h"
+#include "kvm/virtio-coalesce.h"
 
 #define VIRTIO_IRQ_LOW		0
 #define VIRTIO_IRQ_HIGH		1
@@ -21,14 +23,79 @@
 #define VIRTIO_ENDIAN_LE	(1 << 0)
 #define VIRTIO_ENDIAN_BE	(1 << 1)
 
+/*
+ * VIRTIO_F_RING_PACKED: a single ring of descriptors, which the guest makes
+ * available in order and we write back once used. Heads handed to devices
+ * are buffer IDs, which the guest keeps below the ring size.
+ */
+struct virt_queue_packed {
+	struct vring_packed_desc	*desc;
+	struct vring_packed_desc_event	*driver;	/* when to interrupt */
+	struct vring_packed_desc_event	*device;	/* when to notify us */
+	u16				num;
+	bool				avail_wrap;
+	u16				used_idx;
+	bool				used_wrap;
+
+	/* Used descriptors filled in, but not handed to the guest yet */
+	u16				staged_idx;
+	bool				staged_wrap;
+	u16				staged_flags;
+
+	/* Where each buffer the guest gave us starts, and its length */
+	struct {
+		u16			pos;
+		u16			nr;
+	} bufs[];
+};
+
+/* Where the guest put a virtqueue, as told through the transport */
+struct vring_addr {
+	bool			legacy;
+	union {
+		/* Legacy: a single area, starting at page 'pfn' */
+		struct {
+			u32	pfn;
+			u32	align;
+			u32	pgsize;
+		};
+		/* Modern: separate descriptor, driver and device areas */
+		struct {
+			u64	desc;
+			u64	avail;
+			u64	used;
+			u16	num;	/* 0 for the device's default */
+			bool	packed;
+		};
+	};
+};
+
+struct virtio_device;
+
+/* Interrupt moderation state of a queue, see virtio/coalesce.c */
+struct virt_queue_coalesce {
+	struct list_head	list;		/* pending, by deadline */
+	struct virtio_device	*vdev;
+	u32			queueid;
+	u32			signalled;	/* nr_used at the last interrupt */
+	u64			deadline;	/* in ns, 0 when none is pending */
+	u64			rate_time;
+	u32			rate_used;
+	u32			rate;		/* completions per second */
+};
+
 struct virt_queue {
 	struct vring	vring;
-	u32		pfn;
+	struct vring_addr vring_addr;
 	/* The last_avail_idx field is an index to ->ring of struct vring_avail.
 	   It's where we assume the next request index is at.  */
 	u16		last_avail_idx;
 	u16		last_used_signalled;
+	u16		used_staged;	/* filled, not yet published */
 	u16		endian;
+	u32		nr_used;	/* published so far */
+	struct virt_queue_packed *packed;	/* NULL for split rings */
+	struct virt_queue_coalesce coalesce;
 };
 
 /*
@@ -90,10 +157,16 @@ static inline __u64 __virtio_h2g_u64(u16 endian, __u64 val)
 
 #endif
 
+u16 virt_queue__pop_packed(struct virt_queue *queue);
+bool virt_queue__available_packed(struct virt_queue *vq);
+
 static inline u16 virt_queue__pop(struct virt_queue *queue)
 {
 	__u16 guest_idx;
 
+	if (queue->packed)
+		return virt_queue__pop_packed(queue);
+
 	guest_idx = queue->vring.avail->ring[queue->last_avail_idx++ % queue->vring.num];
 	return virtio_guest_to_host_u16(queue, guest_idx);
 }
@@ -105,6 +178,9 @@ static inline struct vring_desc *virt_queue__get_desc(struct virt_queue *queue,
 
 static inline bool virt_queue__available(struct virt_queue *vq)
 {
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
+
 	if (!vq->vring.avail)
 		return 0;
 
@@ -112,7 +188,29 @@ static inline bool virt_queue__available(struct virt_queue *vq)
 	return virtio_guest_to_host_u16(vq, vq->vring.avail->idx) != vq->last_avail_idx;
 }
 
+/* Like virt_queue__available(), without asking the guest for a notification */
+static inline bool virt_queue__pending(struct virt_queue *vq)
+{
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
+
+	if (!vq->vring.avail)
+		return 0;
+
+	return virtio_guest_to_host_u16(vq, *(volatile u16 *)&vq->vring.avail->idx) !=
+		vq->last_avail_idx;
+}
+
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
+struct vring_used_elem *
+virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
+				    u32 len, u16 offset);
+void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump);
+void virt_queue__stage_used_elem(struct virt_queue *queue, u32 head, u32 len);
+void virt_queue__publish_used(struct virt_queue *queue);
+void virt_queue__set_notify(struct virt_queue *vq, bool enable);
+int virt_queue__init_packed(struct virt_queue *vq, u16 num, void *desc,
+			    void *driver, void *device);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[],
@@ -132,18 +230,25 @@ enum virtio_trans {
 struct virtio_device {
 	bool			use_vhost;
 	void			*virtio;
+	void			*dev;
 	struct virtio_ops	*ops;
+	enum virtio_trans	trans;
 	u16			endian;
+
+	/* Type and index, e.g. "net0", for users to refer to the device */
+	char			name[VIRTIO_COALESCE_NAME_LEN];
+	struct list_head	list;
+	struct virtio_coalesce	coalesce;
 };
 
 struct virtio_ops {
 	u8 *(*get_config)(struct kvm *kvm, void *dev);
-	u32 (*get_host_features)(struct kvm *kvm, void *dev);
-	void (*set_guest_features)(struct kvm *kvm, void *dev, u32 features);
-	int (*init_vq)(struct kvm *kvm, void *dev, u32 vq, u32 page_size,
-		       u32 align, u32 pfn);
+	size_t (*get_config_size)(struct kvm *kvm, void *dev);
+	u64 (*get_host_features)(struct kvm *kvm, void *dev);
+	void (*set_guest_features)(struct kvm *kvm, void *dev, u64 features);
+	int (*init_vq)(struct kvm *kvm, void *dev, u32 vq);
 	int (*notify_vq)(struct kvm *kvm, void *dev, u32 vq);
-	int (*get_pfn_vq)(struct kvm *kvm, void *dev, u32 vq);
+	struct virt_queue *(*get_vq)(struct kvm *kvm, void *dev, u32 vq);
 	int (*get_size_vq)(struct kvm *kvm, void *dev, u32 vq);
 	int (*set_size_vq)(struct kvm *kvm, void *dev, u32 vq, int size);
 	void (*notify_vq_gsi)(struct kvm *kvm, void *dev, u32 vq, u32 gsi);
@@ -161,16 +266,9 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		int device_id, int subsys_id, int class);
 int virtio_compat_add_message(const char *device, const char *config);
 const char* virtio_trans_name(enum virtio_trans trans);
+int virtio__signal_vq_now(struct kvm *kvm, struct virtio_device *vdev, u32 vq);
 
-static inline void *virtio_get_vq(struct kvm *kvm, u32 pfn, u32 page_size)
-{
-	return guest_flat_to_host(kvm, (u64)pfn * page_size);
-}
-
-static inline void virtio_init_device_vq(struct virtio_device *vdev,
-					 struct virt_queue *vq)
-{
-	vq->endian = vdev->endian;
-}
+void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
+			   struct virt_queue *vq, u16 nr_descs);
 
 #endif /* KVM__VIRTIO_H */
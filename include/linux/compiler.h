@@ -17,4 +17,6 @@
 #define __must_check
 #define unlikely
 
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
 #endif
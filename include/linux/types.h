@@ -4,6 +4,7 @@
 #include <kvm/compiler.h>
 #define __SANE_USERSPACE_TYPES__	/* For PPC64, to get LL64 types */
 #include <asm/types.h>
+#include <linux/posix_types.h>
 
 typedef __u64 u64;
 typedef __s64 s64;
@@ -29,6 +30,10 @@ typedef __s8  s8;
 #endif
 
 
+#ifndef __aligned_u64
+#define __aligned_u64 __u64 __attribute__((aligned(8)))
+#endif
+
 typedef __u16 __bitwise __le16;
 typedef __u16 __bitwise __be16;
 typedef __u32 __bitwise __le32;
@@ -7,6 +7,9 @@
 #include "kvm/builtin-pause.h"
 #include "kvm/builtin-resume.h"
 #include "kvm/builtin-balloon.h"
+#include "kvm/builtin-coalesce.h"
+#include "kvm/builtin-iolimit.h"
+#include "kvm/builtin-img.h"
 #include "kvm/builtin-list.h"
 #include "kvm/builtin-version.h"
 #include "kvm/builtin-setup.h"
@@ -23,6 +26,8 @@ struct cmd_struct kvm_commands[] = {
 	{ "resume",	kvm_cmd_resume,		kvm_resume_help,	0 },
 	{ "debug",	kvm_cmd_debug,		kvm_debug_help,		0 },
 	{ "balloon",	kvm_cmd_balloon,	kvm_balloon_help,	0 },
+	{ "iolimit",	kvm_cmd_iolimit,	kvm_iolimit_help,	0 },
+	{ "coalesce",	kvm_cmd_coalesce,	kvm_coalesce_help,	0 },
 	{ "list",	kvm_cmd_list,		kvm_list_help,		0 },
 	{ "version",	kvm_cmd_version,	NULL,			0 },
 	{ "--version",	kvm_cmd_version,	NULL,			0 },
@@ -30,6 +35,7 @@ struct cmd_struct kvm_commands[] = {
 	{ "stat",	kvm_cmd_stat,		kvm_stat_help,		0 },
 	{ "help",	kvm_cmd_help,		NULL,			0 },
 	{ "setup",	kvm_cmd_setup,		kvm_setup_help,		0 },
+	{ "img",	kvm_cmd_img,		kvm_img_help,		0 },
 	{ "run",	kvm_cmd_run,		kvm_run_help,		0 },
 	{ "sandbox",	kvm_cmd_sandbox,	kvm_run_help,		0 },
 	{ NULL,		NULL,			NULL,			0 },
@@ -143,6 +143,7 @@ int kvm__exit(struct kvm *kvm)
 		list_del(&bank->list);
 		free(bank);
 	}
+	free(kvm->mem_bank_index);
 
 	free(kvm);
 	return 0;
@@ -157,7 +158,8 @@ core_exit(kvm__exit);
 int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr)
 {
 	struct kvm_userspace_memory_region mem;
-	struct kvm_mem_bank *bank;
+	struct kvm_mem_bank *bank, **index;
+	u32 i;
 	int ret;
 
 	bank = malloc(sizeof(*bank));
@@ -176,41 +178,121 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace
 		.userspace_addr		= (unsigned long)userspace_addr,
 	};
 
+	index = realloc(kvm->mem_bank_index,
+			(kvm->nr_mem_banks + 1) * sizeof(*index));
+	if (!index) {
+		free(bank);
+		return -ENOMEM;
+	}
+	kvm->mem_bank_index = index;
+
 	ret = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
-	if (ret < 0)
+	if (ret < 0) {
+		free(bank);
 		return -errno;
+	}
+
+	for (i = kvm->nr_mem_banks; i > 0; i--) {
+		if (index[i - 1]->guest_phys_addr < guest_phys)
+			break;
+		index[i] = index[i - 1];
+	}
+	index[i] = bank;
+	kvm->nr_mem_banks++;
 
 	list_add(&bank->list, &kvm->mem_banks);
 	return 0;
 }
 
-void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+/*
+ * Every device thread keeps going back to the same bank, almost always the
+ * one holding most of RAM, so remember the last one each thread used.
+ */
+static __thread struct kvm_mem_bank *last_bank;
+
+static inline bool kvm_mem_bank__contains(struct kvm_mem_bank *bank, u64 addr)
+{
+	return addr - bank->guest_phys_addr < bank->size;
+}
+
+/* The bank holding all of [addr, addr + len), or NULL */
+static struct kvm_mem_bank *kvm__find_mem_bank(struct kvm *kvm, u64 addr, u64 len)
+{
+	struct kvm_mem_bank *bank = last_bank;
+	u32 lo = 0, hi = kvm->nr_mem_banks, mid;
+
+	if (!bank || !kvm_mem_bank__contains(bank, addr)) {
+		bank = NULL;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (addr < kvm->mem_bank_index[mid]->guest_phys_addr) {
+				hi = mid;
+			} else if (!kvm_mem_bank__contains(kvm->mem_bank_index[mid], addr)) {
+				lo = mid + 1;
+			} else {
+				bank = kvm->mem_bank_index[mid];
+				break;
+			}
+		}
+
+		if (!bank)
+			return NULL;
+		last_bank = bank;
+	}
+
+	if (len > bank->size - (addr - bank->guest_phys_addr))
+		return NULL;
+
+	return bank;
+}
+
+/*
+ * Translate a guest buffer, which has to be entirely inside one bank to be
+ * contiguous on the host.
+ */
+void *guest_flat_to_host_range(struct kvm *kvm, u64 offset, u64 len)
 {
 	struct kvm_mem_bank *bank;
 
-	list_for_each_entry(bank, &kvm->mem_banks, list) {
-		u64 bank_start = bank->guest_phys_addr;
-		u64 bank_end = bank_start + bank->size;
+	bank = kvm__find_mem_bank(kvm, offset, len);
+	if (!bank) {
+		pr_warning("unable to translate guest range 0x%llx-0x%llx to host",
+			   (unsigned long long)offset,
+			   (unsigned long long)(offset + len));
+		return NULL;
+	}
+
+	return bank->host_addr + (offset - bank->guest_phys_addr);
+}
 
-		if (offset >= bank_start && offset < bank_end)
-			return bank->host_addr + (offset - bank_start);
+void *guest_flat_to_host(struct kvm *kvm, u64 offset)
+{
+	struct kvm_mem_bank *bank;
+
+	bank = kvm__find_mem_bank(kvm, offset, 1);
+	if (!bank) {
+		pr_warning("unable to translate guest address 0x%llx to host",
+			   (unsigned long long)offset);
+		return NULL;
 	}
 
-	pr_warning("unable to translate guest address 0x%llx to host",
-			(unsigned long long)offset);
-	return NULL;
+	return bank->host_addr + (offset - bank->guest_phys_addr);
 }
 
 u64 host_to_guest_flat(struct kvm *kvm, void *ptr)
 {
-	struct kvm_mem_bank *bank;
+	struct kvm_mem_bank *bank = last_bank;
+	u32 i;
 
-	list_for_each_entry(bank, &kvm->mem_banks, list) {
-		void *bank_start = bank->host_addr;
-		void *bank_end = bank_start + bank->size;
+	if (bank && (u64)(ptr - bank->host_addr) < bank->size)
+		return bank->guest_phys_addr + (ptr - bank->host_addr);
 
-		if (ptr >= bank_start && ptr < bank_end)
-			return bank->guest_phys_addr + (ptr - bank_start);
+	for (i = 0; i < kvm->nr_mem_banks; i++) {
+		bank = kvm->mem_bank_index[i];
+		if ((u64)(ptr - bank->host_addr) < bank->size) {
+			last_bank = bank;
+			return bank->guest_phys_addr + (ptr - bank->host_addr);
+		}
 	}
 
 	pr_warning("unable to translate host address %p to guest", ptr);
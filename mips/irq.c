@@ -8,3 +8,9 @@ int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg)
 	pr_warning("irq__add_msix_route");
 	return 1;
 }
+
+int irq__update_msix_route(struct kvm *kvm, u32 gsi, struct msi_msg *msg)
+{
+	pr_warning("irq__update_msix_route");
+	return 0;
+}
@@ -139,7 +139,7 @@ void pci__config_wr(struct kvm *kvm, union pci_config_address addr, void *data,
 		unsigned long offset;
 
 		offset = addr.w & 0xff;
-		if (offset < sizeof(struct pci_device_header)) {
+		if (offset + size <= PCI_DEV_CFG_SIZE) {
 			void *p = device__find_dev(DEVICE_BUS_PCI, dev_num)->data;
 			struct pci_device_header *hdr = p;
 			u8 bar = (offset - PCI_BAR_OFFSET(0)) / (sizeof(u32));
@@ -163,6 +163,9 @@ void pci__config_wr(struct kvm *kvm, union pci_config_address addr, void *data,
 				    else
 					memcpy(p + offset, data, size);
 			}
+
+			if (hdr->cfg_ops.write)
+				hdr->cfg_ops.write(kvm, hdr, offset, data, size);
 		}
 	}
 }
@@ -177,7 +180,7 @@ void pci__config_rd(struct kvm *kvm, union pci_config_address addr, void *data,
 		unsigned long offset;
 
 		offset = addr.w & 0xff;
-		if (offset < sizeof(struct pci_device_header)) {
+		if (offset + size <= PCI_DEV_CFG_SIZE) {
 			void *p = device__find_dev(DEVICE_BUS_PCI, dev_num)->data;
 
 			memcpy(data, p + offset, size);
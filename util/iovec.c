@@ -124,3 +124,61 @@ int memcpy_fromiovecend(unsigned char *kdata, const struct iovec *iov,
 	return 0;
 }
 EXPORT_SYMBOL(memcpy_fromiovecend);
+
+/*
+ * Fill 'dst' with at most 'max' entries describing 'len' bytes of 'src',
+ * starting 'skip' bytes in. Returns the number of bytes described, which
+ * is short if 'dst' ran out of entries.
+ */
+size_t iov_slice(struct iovec *dst, int *dst_cnt, int max,
+		 const struct iovec *src, int src_cnt, size_t skip, size_t len)
+{
+	size_t done = 0, n;
+
+	*dst_cnt = 0;
+
+	for (; src_cnt && done < len; src++, src_cnt--) {
+		if (skip >= src->iov_len) {
+			skip -= src->iov_len;
+			continue;
+		}
+
+		if (*dst_cnt == max)
+			break;
+
+		n = min_t(size_t, src->iov_len - skip, len - done);
+		dst[*dst_cnt].iov_base	= src->iov_base + skip;
+		dst[*dst_cnt].iov_len	= n;
+		(*dst_cnt)++;
+
+		done	+= n;
+		skip	= 0;
+	}
+
+	return done;
+}
+
+/*
+ * Whether 'len' bytes at 'buf' are all zero. Once the first 16 are, the
+ * whole buffer is if it equals itself shifted by 16 bytes: that leaves the
+ * work to memcmp(), which is vectorized and stops at the first difference.
+ */
+static bool buffer_is_zero(const unsigned char *buf, size_t len)
+{
+	size_t i, head = min_t(size_t, len, 16);
+
+	for (i = 0; i < head; i++)
+		if (buf[i])
+			return false;
+
+	return len <= 16 || memcmp(buf, buf + 16, len - 16) == 0;
+}
+
+bool iov_is_zero(const struct iovec *iov, int iovcount)
+{
+	for (; iovcount; iov++, iovcount--)
+		if (!buffer_is_zero(iov->iov_base, iov->iov_len))
+			return false;
+
+	return true;
+}
@@ -11,13 +11,16 @@
 #include "kvm/guest_compat.h"
 #include "kvm/virtio-pci.h"
 #include "kvm/virtio.h"
+#include "kvm/iovec.h"
 
 #include <linux/virtio_ring.h>
 #include <linux/virtio_blk.h>
+#include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
 #include <pthread.h>
+#include <time.h>
 
 #define VIRTIO_BLK_MAX_DEV		4
 
@@ -26,7 +29,20 @@
  */
 #define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
 #define VIRTIO_BLK_QUEUE_SIZE		256
-#define NUM_VIRT_QUEUES			1
+#define VIRTIO_BLK_NUM_QUEUES		16
+
+/*
+ * Upper bound on the number of segments of a merged request, matches
+ * the host's UIO_MAXIOV so a merged request stays a single syscall.
+ */
+#define VIRTIO_BLK_MERGE_MAX_SEGS	1024
+
+/* Limits advertised for DISCARD and WRITE_ZEROES requests */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS	(1U << 21)
+#define VIRTIO_BLK_MAX_DISCARD_SEG	32
+
+/* Polling windows shorter than this aren't worth it, and start there */
+#define VIRTIO_BLK_POLL_START_NS	2000
 
 struct blk_dev_req {
 	struct virt_queue		*vq;
@@ -34,23 +50,65 @@ struct blk_dev_req {
 	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
 	u16				out, in, head;
 	struct kvm			*kvm;
+
+	u32				type;
+	u64				sector;
+	size_t				len;
+
+	/*
+	 * Sector-adjacent requests merged behind this one. They are
+	 * submitted as one I/O using merge_iov and completed together.
+	 */
+	struct blk_dev_req		*next;
+	u16				nr_segs;
+	struct iovec			*merge_iov;
+
+	/* Writes in flight and pending flushes, ordered by 'epoch' */
+	struct list_head		flush_list;
+	u64				epoch;
 };
 
-struct blk_dev {
+/*
+ * Each virtqueue gets its own request slots, used ring lock and I/O
+ * thread, so that guests with blk-mq can submit from every vCPU without
+ * funnelling through a single host thread.
+ */
+struct blk_dev_queue {
+	struct blk_dev			*bdev;
+	u32				id;
+
 	struct mutex			mutex;
+	pthread_t			io_thread;
+	int				io_efd;
+
+	/* Statistics and window of the thread when polling, or NULL */
+	struct disk_image_poll_stats	*poll;
 
+	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+};
+
+struct blk_dev {
 	struct list_head		list;
 
 	struct virtio_device		vdev;
 	struct virtio_blk_config	blk_config;
 	struct disk_image		*disk;
-	u32				features;
-
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
-
-	pthread_t			io_thread;
-	int				io_efd;
+	u64				features;
+
+	u32				nr_vqs;
+	struct virt_queue		vqs[VIRTIO_BLK_NUM_QUEUES];
+	struct blk_dev_queue		*queues;
+
+	/*
+	 * Flushes are done by their own thread, once the writes submitted
+	 * before them have completed. Each flush starts a new epoch.
+	 */
+	struct mutex			flush_lock;
+	pthread_cond_t			flush_cond;
+	struct list_head		writes;
+	struct list_head		flushes;
+	u64				epoch;
+	pthread_t			flush_thread;
 
 	struct kvm			*kvm;
 };
@@ -58,28 +116,254 @@ struct blk_dev {
 static LIST_HEAD(bdevs);
 static int compat_id = -1;
 
-void virtio_blk_complete(void *param, long len)
+static void virtio_blk_set_used(struct blk_dev_req *req, long len)
 {
-	struct blk_dev_req *req = param;
-	struct blk_dev *bdev = req->bdev;
-	int queueid = req->vq - bdev->vqs;
 	u8 *status;
 
 	/* status */
 	status	= req->iov[req->out + req->in - 1].iov_base;
 	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
 
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
+	virt_queue__stage_used_elem(req->vq, req->head, len);
+}
+
+/* Stage the used elements of 'req', without publishing them */
+static void virtio_blk_fill_used(struct blk_dev_req *req, long len)
+{
+	struct blk_dev_req *next;
+	long req_len;
+
+	if (!req->next) {
+		virtio_blk_set_used(req, len);
+		return;
+	}
+
+	/* Fan a merged completion out to every original request */
+	do {
+		next = req->next;
+		req->next = NULL;
+
+		req_len = len < 0 ? len : min_t(long, len, req->len);
+		if (len > 0)
+			len -= req_len;
+
+		virtio_blk_set_used(req, req_len);
+		req = next;
+	} while (req);
+}
+
+static void virtio_blk_write_start(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	mutex_lock(&bdev->flush_lock);
+	req->epoch = bdev->epoch;
+	list_add_tail(&req->flush_list, &bdev->writes);
+	mutex_unlock(&bdev->flush_lock);
+}
+
+static void virtio_blk_write_done(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	if (req->type != VIRTIO_BLK_T_OUT)
+		return;
+
+	mutex_lock(&bdev->flush_lock);
+	list_del(&req->flush_list);
+	if (!list_empty(&bdev->flushes))
+		pthread_cond_signal(&bdev->flush_cond);
+	mutex_unlock(&bdev->flush_lock);
+}
 
+static void virtio_blk_signal(struct blk_dev *bdev, int queueid)
+{
 	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-		bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queueid);
+		bdev->vdev.ops->signal_vq(bdev->kvm, &bdev->vdev, queueid);
+}
+
+void virtio_blk_complete(void *param, long len)
+{
+	struct blk_dev_req *req = param;
+	struct blk_dev *bdev = req->bdev;
+	int queueid = req->vq - bdev->vqs;
+	struct blk_dev_queue *queue = &bdev->queues[queueid];
+
+	virtio_blk_write_done(bdev, req);
+
+	/* Completions go back on the queue the request was submitted on */
+	mutex_lock(&queue->mutex);
+	virtio_blk_fill_used(req, len);
+	virt_queue__publish_used(req->vq);
+	mutex_unlock(&queue->mutex);
+
+	virtio_blk_signal(bdev, queueid);
+}
+
+/*
+ * Complete everything the I/O engine reaped in one go: each queue involved
+ * is locked once, gets its used index published once and the guest
+ * interrupted at most once.
+ */
+static void virtio_blk_complete_batch(struct disk_image_completion *c, int nr)
+{
+	struct blk_dev_req *req = c[0].param;
+	struct blk_dev *bdev = req->bdev;
+	struct blk_dev_queue *queue;
+	u32 queues = 0;
+	u32 queueid;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		req = c[i].param;
+		queues |= 1U << (req->vq - bdev->vqs);
+		virtio_blk_write_done(bdev, req);
+	}
+
+	for (queueid = 0; queueid < bdev->nr_vqs; queueid++) {
+		if (!(queues & (1U << queueid)))
+			continue;
+
+		queue = &bdev->queues[queueid];
+
+		mutex_lock(&queue->mutex);
+		for (i = 0; i < nr; i++) {
+			req = c[i].param;
+			if (req->vq == &bdev->vqs[queueid])
+				virtio_blk_fill_used(req, c[i].len);
+		}
+		virt_queue__publish_used(&bdev->vqs[queueid]);
+		mutex_unlock(&queue->mutex);
+
+		virtio_blk_signal(bdev, queueid);
+	}
+}
+
+static ssize_t virtio_blk_discard(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	struct virtio_blk_discard_write_zeroes range;
+	size_t offset;
+	u32 range_flags;
+	int flags;
+	int r;
+
+	if (req->len % sizeof(range) ||
+	    req->len / sizeof(range) > VIRTIO_BLK_MAX_DISCARD_SEG)
+		return -1;
+
+	for (offset = 0; offset < req->len; offset += sizeof(range)) {
+		memcpy_fromiovecend((void *)&range, req->iov + 1, offset,
+				    sizeof(range));
+		range_flags = le32_to_cpu(range.flags);
+
+		if (req->type == VIRTIO_BLK_T_DISCARD) {
+			flags = DISK_IMAGE_DISCARD_UNMAP;
+		} else {
+			flags = DISK_IMAGE_DISCARD_ZERO;
+			if (range_flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+				flags |= DISK_IMAGE_DISCARD_UNMAP;
+		}
+
+		r = disk_image__discard(bdev->disk, le64_to_cpu(range.sector),
+					le32_to_cpu(range.num_sectors), flags);
+		if (r < 0) {
+			pr_warning("discard failed: %d", r);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Hold a read or write back until the disk's I/O limits allow it. Only
+ * this queue's thread waits, and requests it has already batched up are
+ * handed to the host first so they don't wait along.
+ */
+static void virtio_blk_throttle(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	struct blk_dev_req *r;
+	u64 nr_ops = 0, bytes = 0;
+	u64 wait;
+
+	for (r = req; r; r = r->next) {
+		nr_ops++;
+		bytes += r->len;
+	}
+
+	wait = disk_image__qos_charge(bdev->disk, req->type == VIRTIO_BLK_T_OUT,
+				      nr_ops, bytes);
+	if (!wait)
+		return;
+
+	disk_image__submit(bdev->disk);
+	usleep(wait / 1000);
+}
+
+/* Called with flush_lock held */
+static bool virtio_blk_flush_ready(struct blk_dev *bdev, struct blk_dev_req *flush)
+{
+	struct blk_dev_req *write;
+
+	if (list_empty(&bdev->writes))
+		return true;
+
+	write = list_first_entry(&bdev->writes, struct blk_dev_req, flush_list);
+	return write->epoch > flush->epoch;
+}
+
+/*
+ * Queue a flush for the flush thread, so that the I/O thread can go on
+ * with the requests behind it. Writes submitted from now on belong to the
+ * next epoch and don't hold the flush back.
+ */
+static void virtio_blk_flush_start(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	mutex_lock(&bdev->flush_lock);
+	req->epoch = bdev->epoch++;
+	list_add_tail(&req->flush_list, &bdev->flushes);
+	pthread_cond_signal(&bdev->flush_cond);
+	mutex_unlock(&bdev->flush_lock);
+}
+
+/*
+ * Flushes that became ready together share a single disk flush, since it
+ * covers all the writes any of them waited for.
+ */
+static void *virtio_blk_flush_thread(void *p)
+{
+	struct blk_dev *bdev = p;
+	struct blk_dev_req *req, *next;
+	LIST_HEAD(ready);
+	int r;
+
+	kvm__set_thread_name("virtio-blk-flush");
+
+	mutex_lock(&bdev->flush_lock);
+	while (1) {
+		list_for_each_entry_safe(req, next, &bdev->flushes, flush_list) {
+			if (!virtio_blk_flush_ready(bdev, req))
+				break;
+			list_move_tail(&req->flush_list, &ready);
+		}
+
+		if (list_empty(&ready)) {
+			pthread_cond_wait(&bdev->flush_cond, &bdev->flush_lock.mutex);
+			continue;
+		}
+
+		mutex_unlock(&bdev->flush_lock);
+
+		r = disk_image__flush(bdev->disk);
+		list_for_each_entry_safe(req, next, &ready, flush_list) {
+			list_del(&req->flush_list);
+			virtio_blk_complete(req, r);
+		}
+
+		mutex_lock(&bdev->flush_lock);
+	}
+
+	return NULL;
 }
 
 static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
 {
-	struct virtio_blk_outhdr *req_hdr;
 	ssize_t block_cnt;
 	struct blk_dev *bdev;
 	struct iovec *iov;
@@ -92,22 +376,40 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	iov		= req->iov;
 	out		= req->out;
 	in		= req->in;
-	req_hdr		= iov[0].iov_base;
-
-	type = virtio_guest_to_host_u32(vq, req_hdr->type);
-	sector = virtio_guest_to_host_u64(vq, req_hdr->sector);
+	type		= req->type;
+	sector		= req->sector;
 
+	/* Reads and writes that fail to be submitted are not completed by the disk */
 	switch (type) {
 	case VIRTIO_BLK_T_IN:
-		block_cnt = disk_image__read(bdev->disk, sector,
-				iov + 1, in + out - 2, req);
+		virtio_blk_throttle(bdev, req);
+		if (req->next)
+			block_cnt = disk_image__read(bdev->disk, sector,
+					req->merge_iov, req->nr_segs, req);
+		else
+			block_cnt = disk_image__read(bdev->disk, sector,
+					iov + 1, in + out - 2, req);
+		if (block_cnt < 0)
+			virtio_blk_complete(req, block_cnt);
 		break;
 	case VIRTIO_BLK_T_OUT:
-		block_cnt = disk_image__write(bdev->disk, sector,
-				iov + 1, in + out - 2, req);
+		virtio_blk_throttle(bdev, req);
+		virtio_blk_write_start(bdev, req);
+		if (req->next)
+			block_cnt = disk_image__write(bdev->disk, sector,
+					req->merge_iov, req->nr_segs, req);
+		else
+			block_cnt = disk_image__write(bdev->disk, sector,
+					iov + 1, in + out - 2, req);
+		if (block_cnt < 0)
+			virtio_blk_complete(req, block_cnt);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
-		block_cnt = disk_image__flush(bdev->disk);
+		virtio_blk_flush_start(bdev, req);
+		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		block_cnt = virtio_blk_discard(bdev, req);
 		virtio_blk_complete(req, block_cnt);
 		break;
 	case VIRTIO_BLK_T_GET_ID:
@@ -123,20 +425,95 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	}
 }
 
-static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
+static bool virtio_blk_is_rw(struct blk_dev_req *req)
+{
+	return req->type == VIRTIO_BLK_T_IN || req->type == VIRTIO_BLK_T_OUT;
+}
+
+/*
+ * Try to append 'req' to the run of requests started by 'first' and
+ * currently ending with 'last'. Only requests of the same direction that
+ * continue exactly where the previous one stopped are merged, and the
+ * guest's submission order is kept so overlapping writes stay ordered.
+ */
+static bool virtio_blk_merge(struct blk_dev_req *first, struct blk_dev_req *last,
+			     struct blk_dev_req *req)
 {
-	struct blk_dev_req *req;
+	u16 nr_segs = req->out + req->in - 2;
+
+	if (req->type != first->type)
+		return false;
+	if (last->len & (SECTOR_SIZE - 1))
+		return false;
+	if (last->sector + (last->len >> SECTOR_SHIFT) != req->sector)
+		return false;
+	if (first->nr_segs + nr_segs > VIRTIO_BLK_MERGE_MAX_SEGS)
+		return false;
+
+	if (!first->merge_iov) {
+		first->merge_iov = malloc(VIRTIO_BLK_MERGE_MAX_SEGS *
+					  sizeof(*first->merge_iov));
+		if (!first->merge_iov)
+			return false;
+	}
+
+	if (!first->next)
+		memcpy(first->merge_iov, first->iov + 1,
+		       first->nr_segs * sizeof(struct iovec));
+
+	memcpy(first->merge_iov + first->nr_segs, req->iov + 1,
+	       nr_segs * sizeof(struct iovec));
+	first->nr_segs += nr_segs;
+	last->next = req;
+
+	return true;
+}
+
+static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq,
+			     struct blk_dev_queue *queue)
+{
+	struct blk_dev_req *req, *first = NULL, *last = NULL;
+	struct virtio_blk_outhdr *req_hdr;
 	u16 head;
 
 	while (virt_queue__available(vq)) {
 		head		= virt_queue__pop(vq);
-		req		= &bdev->reqs[head];
+		req		= &queue->reqs[head];
 		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out,
 					&req->in, head, kvm);
 		req->vq		= vq;
+		req->next	= NULL;
+
+		req_hdr		= req->iov[0].iov_base;
+		req->type	= virtio_guest_to_host_u32(vq, req_hdr->type);
+		req->sector	= virtio_guest_to_host_u64(vq, req_hdr->sector);
+		req->nr_segs	= req->out + req->in - 2;
+		req->len	= iov_size(req->iov + 1, req->nr_segs);
+
+		if (virtio_blk_is_rw(req)) {
+			if (first && virtio_blk_merge(first, last, req)) {
+				last = req;
+				continue;
+			}
+
+			if (first)
+				virtio_blk_do_io_request(kvm, vq, first);
+			first = last = req;
+			continue;
+		}
+
+		/* Anything else acts as a barrier for pending merges */
+		if (first)
+			virtio_blk_do_io_request(kvm, vq, first);
+		first = last = NULL;
 
 		virtio_blk_do_io_request(kvm, vq, req);
 	}
+
+	if (first)
+		virtio_blk_do_io_request(kvm, vq, first);
+
+	disk_image__submit(queue->bdev->disk);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -146,15 +523,27 @@ static u8 *get_config(struct kvm *kvm, void *dev)
 	return ((u8 *)(&bdev->blk_config));
 }
 
-static u32 get_host_features(struct kvm *kvm, void *dev)
+static size_t get_config_size(struct kvm *kvm, void *dev)
 {
+	struct blk_dev *bdev = dev;
+
+	return sizeof(bdev->blk_config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
+{
+	struct blk_dev *bdev = dev;
+
 	return	1UL << VIRTIO_BLK_F_SEG_MAX
 		| 1UL << VIRTIO_BLK_F_FLUSH
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
-		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
+		| (bdev->nr_vqs > 1 ? 1UL << VIRTIO_BLK_F_MQ : 0)
+		| (bdev->disk->ops->discard ? 1UL << VIRTIO_BLK_F_DISCARD
+					    | 1UL << VIRTIO_BLK_F_WRITE_ZEROES : 0);
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features)
 {
 	struct blk_dev *bdev = dev;
 	struct virtio_blk_config *conf = &bdev->blk_config;
@@ -172,40 +561,132 @@ static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
 	conf->blk_size = virtio_host_to_guest_u32(&bdev->vdev, conf->blk_size);
 	conf->min_io_size = virtio_host_to_guest_u16(&bdev->vdev, conf->min_io_size);
 	conf->opt_io_size = virtio_host_to_guest_u32(&bdev->vdev, conf->opt_io_size);
+	conf->num_queues = virtio_host_to_guest_u16(&bdev->vdev, conf->num_queues);
+
+	/* Discard and write zeroes */
+	conf->max_discard_sectors = virtio_host_to_guest_u32(&bdev->vdev, conf->max_discard_sectors);
+	conf->max_discard_seg = virtio_host_to_guest_u32(&bdev->vdev, conf->max_discard_seg);
+	conf->discard_sector_alignment = virtio_host_to_guest_u32(&bdev->vdev, conf->discard_sector_alignment);
+	conf->max_write_zeroes_sectors = virtio_host_to_guest_u32(&bdev->vdev, conf->max_write_zeroes_sectors);
+	conf->max_write_zeroes_seg = virtio_host_to_guest_u32(&bdev->vdev, conf->max_write_zeroes_seg);
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		   u32 pfn)
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
-	struct virt_queue *queue;
-	void *p;
 
-	compat__remove_message(compat_id);
+	if (vq >= bdev->nr_vqs)
+		return -EINVAL;
 
-	queue		= &bdev->vqs[vq];
-	queue->pfn	= pfn;
-	p		= virtio_get_vq(kvm, queue->pfn, page_size);
+	compat__remove_message(compat_id);
 
-	vring_init(&queue->vring, VIRTIO_BLK_QUEUE_SIZE, p, align);
-	virtio_init_device_vq(&bdev->vdev, queue);
+	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq],
+			      VIRTIO_BLK_QUEUE_SIZE);
 
 	return 0;
 }
 
-static void *virtio_blk_thread(void *dev)
+static u64 virtio_blk_now(void)
 {
-	struct blk_dev *bdev = dev;
-	u64 data;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Spin on the avail ring and the disk's completions for the current
+ * window. Returns true as soon as either has something.
+ */
+static bool virtio_blk_poll_once(struct blk_dev_queue *queue,
+				 struct virt_queue *vq)
+{
+	struct disk_image *disk = queue->bdev->disk;
+	u64 deadline = virtio_blk_now() + queue->poll->window_ns;
+
+	do {
+		if (virt_queue__pending(vq) || disk_image__poll(disk) > 0)
+			return true;
+	} while (virtio_blk_now() < deadline);
+
+	return false;
+}
+
+/*
+ * Keep serving the queue with guest notifications off for as long as
+ * polling finds work, then turn them back on before the thread blocks.
+ */
+static void virtio_blk_poll(struct kvm *kvm, struct virt_queue *vq,
+			    struct blk_dev_queue *queue)
+{
+	struct disk_image_poll_stats *stats = queue->poll;
+
+	while (stats->window_ns) {
+		virt_queue__set_notify(vq, false);
+		if (!virtio_blk_poll_once(queue, vq)) {
+			stats->misses++;
+			break;
+		}
+
+		stats->hits++;
+		virtio_blk_do_io(kvm, vq, queue);
+	}
+
+	virt_queue__set_notify(vq, true);
+}
+
+/*
+ * Adapt the window after the thread blocked for 'blocked_ns', the same way
+ * KVM does for halt polling: grow it if a longer poll would have avoided
+ * sleeping, shrink it when the guest stays idle for longer than we may poll.
+ */
+static void virtio_blk_poll_adjust(struct blk_dev_queue *queue, u64 blocked_ns)
+{
+	struct disk_image_poll_stats *stats = queue->poll;
+	u32 max_ns = queue->bdev->disk->poll_ns;
+
+	if (blocked_ns <= max_ns) {
+		stats->window_ns = min_t(u32, max_t(u32, stats->window_ns * 2,
+						    VIRTIO_BLK_POLL_START_NS),
+					 max_ns);
+	} else {
+		stats->window_ns /= 2;
+		if (stats->window_ns < VIRTIO_BLK_POLL_START_NS)
+			stats->window_ns = 0;
+	}
+}
+
+static void *virtio_blk_thread(void *p)
+{
+	struct blk_dev_queue *queue = p;
+	struct blk_dev *bdev = queue->bdev;
+	struct virt_queue *vq = &bdev->vqs[queue->id];
+	u64 data, start = 0;
 	int r;
 
 	kvm__set_thread_name("virtio-blk-io");
 
 	while (1) {
-		r = read(bdev->io_efd, &data, sizeof(u64));
+		if (queue->poll)
+			start = virtio_blk_now();
+
+		r = read(queue->io_efd, &data, sizeof(u64));
 		if (r < 0)
 			continue;
-		virtio_blk_do_io(bdev->kvm, &bdev->vqs[0], bdev);
+
+		if (!queue->poll) {
+			virtio_blk_do_io(bdev->kvm, vq, queue);
+			continue;
+		}
+
+		virtio_blk_poll_adjust(queue, virtio_blk_now() - start);
+
+		/* Requests may have come in just before notifications were back on */
+		do {
+			virtio_blk_do_io(bdev->kvm, vq, queue);
+			virtio_blk_poll(bdev->kvm, vq, queue);
+		} while (virt_queue__pending(vq));
 	}
 
 	pthread_exit(NULL);
@@ -218,22 +699,34 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 	u64 data = 1;
 	int r;
 
-	r = write(bdev->io_efd, &data, sizeof(data));
+	if (vq >= bdev->nr_vqs)
+		return -EINVAL;
+
+	r = write(bdev->queues[vq].io_efd, &data, sizeof(data));
 	if (r < 0)
 		return r;
 
 	return 0;
 }
 
-static int get_pfn_vq(struct kvm *kvm, void *dev, u32 vq)
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
 
-	return bdev->vqs[vq].pfn;
+	if (vq >= bdev->nr_vqs)
+		return NULL;
+
+	return &bdev->vqs[vq];
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct blk_dev *bdev = dev;
+
+	/* A size of zero tells the guest the queue does not exist */
+	if (vq >= bdev->nr_vqs)
+		return 0;
+
 	/* FIXME: dynamic */
 	return VIRTIO_BLK_QUEUE_SIZE;
 }
@@ -246,19 +739,54 @@ static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 
 static struct virtio_ops blk_dev_virtio_ops = (struct virtio_ops) {
 	.get_config		= get_config,
+	.get_config_size	= get_config_size,
 	.get_host_features	= get_host_features,
 	.set_guest_features	= set_guest_features,
 	.init_vq		= init_vq,
 	.notify_vq		= notify_vq,
-	.get_pfn_vq		= get_pfn_vq,
+	.get_vq			= get_vq,
 	.get_size_vq		= get_size_vq,
 	.set_size_vq		= set_size_vq,
 };
 
+static int virtio_blk__init_queue(struct kvm *kvm, struct blk_dev *bdev, u32 id)
+{
+	struct blk_dev_queue *queue = &bdev->queues[id];
+	unsigned int i;
+	int r;
+
+	queue->bdev	= bdev;
+	queue->id	= id;
+	queue->io_efd	= eventfd(0, 0);
+	if (queue->io_efd < 0)
+		return -errno;
+
+	mutex_init(&queue->mutex);
+
+	if (bdev->disk->poll_stats)
+		queue->poll = &bdev->disk->poll_stats[id];
+
+	for (i = 0; i < ARRAY_SIZE(queue->reqs); i++) {
+		queue->reqs[i].bdev = bdev;
+		queue->reqs[i].kvm = kvm;
+	}
+
+	r = pthread_create(&queue->io_thread, NULL, virtio_blk_thread, queue);
+	if (r) {
+		close(queue->io_efd);
+		return -r;
+	}
+
+	return 0;
+}
+
 static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 {
+	struct blk_dev_queue *queues;
 	struct blk_dev *bdev;
+	u32 nr_vqs;
 	unsigned int i;
+	int r;
 
 	if (!disk)
 		return -EINVAL;
@@ -267,40 +795,110 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 	if (bdev == NULL)
 		return -ENOMEM;
 
+	nr_vqs = max(1, min(VIRTIO_BLK_NUM_QUEUES, disk->queues));
+
+	queues = calloc(nr_vqs, sizeof(*queues));
+	if (queues == NULL) {
+		free(bdev);
+		return -ENOMEM;
+	}
+
 	*bdev = (struct blk_dev) {
-		.mutex			= MUTEX_INITIALIZER,
 		.disk			= disk,
 		.blk_config		= (struct virtio_blk_config) {
 			.capacity	= disk->size / SECTOR_SIZE,
 			.seg_max	= DISK_SEG_MAX,
+			.num_queues	= nr_vqs,
+			.max_discard_sectors		= VIRTIO_BLK_MAX_DISCARD_SECTORS,
+			.max_discard_seg		= VIRTIO_BLK_MAX_DISCARD_SEG,
+			.discard_sector_alignment	= 1,
+			.max_write_zeroes_sectors	= VIRTIO_BLK_MAX_DISCARD_SECTORS,
+			.max_write_zeroes_seg		= VIRTIO_BLK_MAX_DISCARD_SEG,
+			.write_zeroes_may_unmap		= 1,
 		},
-		.io_efd			= eventfd(0, 0),
+		.nr_vqs			= nr_vqs,
+		.queues			= queues,
 		.kvm			= kvm,
 	};
 
-	virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
-		    VIRTIO_DEFAULT_TRANS(kvm), PCI_DEVICE_ID_VIRTIO_BLK,
-		    VIRTIO_ID_BLOCK, PCI_CLASS_BLK);
+	mutex_init(&bdev->flush_lock);
+	pthread_cond_init(&bdev->flush_cond, NULL);
+	INIT_LIST_HEAD(&bdev->writes);
+	INIT_LIST_HEAD(&bdev->flushes);
+
+	if (disk->poll_ns) {
+		disk->poll_stats = calloc(nr_vqs, sizeof(*disk->poll_stats));
+		if (!disk->poll_stats) {
+			r = -ENOMEM;
+			goto free_bdev;
+		}
+
+		disk->nr_poll_stats = nr_vqs;
+		for (i = 0; i < nr_vqs; i++)
+			disk->poll_stats[i].window_ns = disk->poll_ns;
+	}
 
-	list_add_tail(&bdev->list, &bdevs);
+	r = pthread_create(&bdev->flush_thread, NULL, virtio_blk_flush_thread, bdev);
+	if (r) {
+		r = -r;
+		goto free_poll_stats;
+	}
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
-		bdev->reqs[i].bdev = bdev;
-		bdev->reqs[i].kvm = kvm;
+	for (i = 0; i < nr_vqs; i++) {
+		r = virtio_blk__init_queue(kvm, bdev, i);
+		if (r < 0)
+			goto stop_threads;
 	}
 
 	disk_image__set_callback(bdev->disk, virtio_blk_complete);
+	disk_image__set_batch_callback(bdev->disk, virtio_blk_complete_batch);
+
+	/* The guest only sees the device once everything it needs is there */
+	r = virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
+			VIRTIO_DEFAULT_TRANS(kvm), PCI_DEVICE_ID_VIRTIO_BLK,
+			VIRTIO_ID_BLOCK, PCI_CLASS_BLK);
+	if (r < 0)
+		goto stop_threads;
+
+	list_add_tail(&bdev->list, &bdevs);
 
-	pthread_create(&bdev->io_thread, NULL, virtio_blk_thread, bdev);
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-blk", "CONFIG_VIRTIO_BLK");
 
 	return 0;
+
+stop_threads:
+	while (i--) {
+		pthread_cancel(queues[i].io_thread);
+		pthread_join(queues[i].io_thread, NULL);
+		close(queues[i].io_efd);
+	}
+	pthread_cancel(bdev->flush_thread);
+	pthread_join(bdev->flush_thread, NULL);
+free_poll_stats:
+	disk->nr_poll_stats = 0;
+	free(disk->poll_stats);
+	disk->poll_stats = NULL;
+free_bdev:
+	free(queues);
+	free(bdev);
+	return r;
 }
 
 static int virtio_blk__exit_one(struct kvm *kvm, struct blk_dev *bdev)
 {
+	unsigned int i, j;
+
+	for (i = 0; i < bdev->nr_vqs; i++)
+		for (j = 0; j < VIRTIO_BLK_QUEUE_SIZE; j++)
+			free(bdev->queues[i].reqs[j].merge_iov);
+
+	bdev->disk->nr_poll_stats = 0;
+	free(bdev->disk->poll_stats);
+	bdev->disk->poll_stats = NULL;
+
 	list_del(&bdev->list);
+	free(bdev->queues);
 	free(bdev);
 
 	return 0;
@@ -311,7 +909,7 @@ int virtio_blk__init(struct kvm *kvm)
 	int i, r = 0;
 
 	for (i = 0; i < kvm->nr_disks; i++) {
-		if (kvm->disks[i]->wwpn)
+		if (kvm->disks[i]->wwpn || kvm->disks[i]->scsi)
 			continue;
 		r = virtio_blk__init_one(kvm, kvm->disks[i]);
 		if (r < 0)
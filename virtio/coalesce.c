@@ -0,0 +1,362 @@
+#include "kvm/virtio-coalesce.h"
+#include "kvm/virtio.h"
+#include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
+#include "kvm/mutex.h"
+#include "kvm/parse-options.h"
+#include "kvm/util.h"
+#include "kvm/util-init.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/virtio_ids.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Interrupt moderation. Rather than interrupting the guest for every batch
+ * of completions, a queue waits until it has 'max_frames' of them or until
+ * the oldest is 'max_usecs' old, whichever comes first.
+ *
+ * Adaptive moderation estimates how many completions the queue gets in
+ * 'max_usecs', and waits for that many at most. When it's fewer than two,
+ * waiting couldn't save an interrupt and the guest is signalled right away,
+ * so latency at low load is unaffected.
+ *
+ * Pending interrupts are sent by a single thread once due. Queues handled
+ * by vhost signal the guest on their own, and aren't moderated.
+ */
+
+/* Rate estimates are updated at most this often, restarted after idling */
+#define COALESCE_RATE_PERIOD_NS		(1000 * 1000ULL)
+#define COALESCE_RATE_IDLE_NS		(100 * 1000 * 1000ULL)
+
+static const char * const virtio_coalesce_types[] = {
+	[VIRTIO_ID_NET]		= "net",
+	[VIRTIO_ID_BLOCK]	= "blk",
+	[VIRTIO_ID_CONSOLE]	= "console",
+	[VIRTIO_ID_RNG]		= "rng",
+	[VIRTIO_ID_BALLOON]	= "balloon",
+	[VIRTIO_ID_SCSI]	= "scsi",
+	[VIRTIO_ID_9P]		= "9p",
+};
+
+/* Protects the settings and moderation state of all devices */
+static DEFINE_MUTEX(coalesce_lock);
+static pthread_cond_t coalesce_cond;
+static LIST_HEAD(devices);
+static LIST_HEAD(pending);
+static bool thread_started;
+static struct kvm *coalesce_kvm;
+
+/* Parse "off", or a comma separated list of settings */
+int virtio_coalesce__parse(struct virtio_coalesce *coalesce, const char *arg)
+{
+	char *list, *cur;
+	int r = 0;
+
+	*coalesce = (struct virtio_coalesce) { 0 };
+	if (strcmp(arg, "off") == 0)
+		return 0;
+
+	list = strdup(arg);
+	if (!list)
+		return -ENOMEM;
+
+	for (cur = strtok(list, ","); cur; cur = strtok(NULL, ",")) {
+		if (strncmp(cur, "frames=", 7) == 0) {
+			coalesce->max_frames = strtoul(cur + 7, NULL, 10);
+		} else if (strncmp(cur, "usecs=", 6) == 0) {
+			coalesce->max_usecs = strtoul(cur + 6, NULL, 10);
+		} else if (strcmp(cur, "adaptive") == 0) {
+			coalesce->adaptive = true;
+		} else {
+			r = -EINVAL;
+			break;
+		}
+	}
+
+	free(list);
+	return r;
+}
+
+/* --irq-coalesce <dev>:<settings> */
+int irq_coalesce_parser(const struct option *opt, const char *arg, int unset)
+{
+	struct kvm *kvm = opt->ptr;
+	struct virtio_coalesce_msg *msg;
+	const char *sep;
+
+	if (kvm->cfg.nr_irq_coalesce >= VIRTIO_COALESCE_MAX_DEVS)
+		die("Currently only %d --irq-coalesce options are supported",
+		    VIRTIO_COALESCE_MAX_DEVS);
+
+	msg = &kvm->cfg.irq_coalesce[kvm->cfg.nr_irq_coalesce++];
+	sep = strchr(arg, ':');
+	if (!sep || sep == arg || sep - arg >= VIRTIO_COALESCE_NAME_LEN)
+		die("Invalid interrupt coalescing option '%s'", arg);
+
+	memcpy(msg->dev, arg, sep - arg);
+	if (virtio_coalesce__parse(&msg->params, sep + 1) < 0)
+		die("Invalid interrupt coalescing settings '%s'", sep + 1);
+
+	return 0;
+}
+
+/* Name the device after its type, and apply the settings given for it */
+void virtio_coalesce__register(struct kvm *kvm, struct virtio_device *vdev,
+			       int subsys_id)
+{
+	static u32 nr_devs[ARRAY_SIZE(virtio_coalesce_types)];
+	int i;
+
+	if (subsys_id < 0 || subsys_id >= (int)ARRAY_SIZE(virtio_coalesce_types) ||
+	    !virtio_coalesce_types[subsys_id])
+		return;
+
+	mutex_lock(&coalesce_lock);
+	snprintf(vdev->name, sizeof(vdev->name), "%s%u",
+		 virtio_coalesce_types[subsys_id], nr_devs[subsys_id]++);
+
+	for (i = 0; i < kvm->cfg.nr_irq_coalesce; i++)
+		if (strcmp(kvm->cfg.irq_coalesce[i].dev, vdev->name) == 0)
+			vdev->coalesce = kvm->cfg.irq_coalesce[i].params;
+
+	list_add_tail(&vdev->list, &devices);
+	mutex_unlock(&coalesce_lock);
+}
+
+static u64 virtio_coalesce__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *virtio_coalesce__thread(void *param)
+{
+	struct virt_queue_coalesce *c, *due;
+	struct virtio_device *vdev;
+	struct timespec ts;
+	u64 now, next;
+	u32 queueid;
+
+	kvm__set_thread_name("virtio-coalesce");
+
+	mutex_lock(&coalesce_lock);
+	while (1) {
+		if (list_empty(&pending)) {
+			pthread_cond_wait(&coalesce_cond, &coalesce_lock.mutex);
+			continue;
+		}
+
+		now	= virtio_coalesce__now();
+		next	= ULLONG_MAX;
+		due	= NULL;
+		list_for_each_entry(c, &pending, list) {
+			if (c->deadline <= now) {
+				due = c;
+				break;
+			}
+			next = min(next, c->deadline);
+		}
+
+		if (!due) {
+			ts.tv_sec	= next / 1000000000ULL;
+			ts.tv_nsec	= next % 1000000000ULL;
+			pthread_cond_timedwait(&coalesce_cond,
+					       &coalesce_lock.mutex, &ts);
+			continue;
+		}
+
+		list_del(&due->list);
+		due->deadline	= 0;
+		due->signalled	= container_of(due, struct virt_queue,
+					       coalesce)->nr_used;
+		vdev		= due->vdev;
+		queueid		= due->queueid;
+
+		mutex_unlock(&coalesce_lock);
+		virtio__signal_vq_now(coalesce_kvm, vdev, queueid);
+		mutex_lock(&coalesce_lock);
+	}
+
+	mutex_unlock(&coalesce_lock);
+	return NULL;
+}
+
+/* Called with coalesce_lock held */
+static bool virtio_coalesce__start_thread(void)
+{
+	pthread_t thread;
+
+	if (thread_started)
+		return true;
+
+	if (pthread_create(&thread, NULL, virtio_coalesce__thread, NULL)) {
+		pr_warning("Failed starting the interrupt coalescing thread");
+		return false;
+	}
+
+	thread_started = true;
+	return true;
+}
+
+static void virtio_coalesce__update_rate(struct virt_queue_coalesce *c,
+					 u32 used, u64 now)
+{
+	u64 elapsed = now - c->rate_time;
+	u32 rate;
+
+	if (elapsed < COALESCE_RATE_PERIOD_NS)
+		return;
+
+	rate = (u64)(used - c->rate_used) * 1000000000ULL / elapsed;
+	if (elapsed > COALESCE_RATE_IDLE_NS)
+		c->rate = rate;
+	else
+		c->rate = ((u64)c->rate * 3 + rate) / 4;
+
+	c->rate_used	= used;
+	c->rate_time	= now;
+}
+
+/* How many completions to wait for, 0 for as many as come in time */
+static u32 virtio_coalesce__frames(struct virtio_coalesce *params,
+				   struct virt_queue_coalesce *c)
+{
+	u64 expected;
+
+	if (!params->adaptive)
+		return params->max_frames;
+
+	expected = (u64)c->rate * params->max_usecs / 1000000;
+	if (params->max_frames)
+		expected = min_t(u64, expected, params->max_frames);
+
+	return max_t(u64, expected, 1);
+}
+
+/*
+ * Whether to hold back the interrupt of queue 'queueid' for now, in which
+ * case it will be sent once due.
+ */
+bool virtio_coalesce__defer(struct kvm *kvm, struct virtio_device *vdev,
+			    u32 queueid)
+{
+	struct virt_queue_coalesce *c;
+	struct virt_queue *vq;
+	u32 used, frames, max_frames;
+	bool defer = false;
+	u64 now;
+
+	/* Read without locking: a change of settings applies eventually */
+	if (!vdev->coalesce.max_usecs)
+		return false;
+
+	vq = vdev->ops->get_vq(kvm, vdev->dev, queueid);
+	if (!vq)
+		return false;
+
+	c	= &vq->coalesce;
+	now	= virtio_coalesce__now();
+
+	mutex_lock(&coalesce_lock);
+	used = vq->nr_used;
+	virtio_coalesce__update_rate(c, used, now);
+
+	frames		= used - c->signalled;
+	max_frames	= virtio_coalesce__frames(&vdev->coalesce, c);
+
+	/* Interrupt right away unless waiting can save one, and isn't over */
+	if (vdev->coalesce.max_usecs && frames && max_frames != 1 &&
+	    (!max_frames || frames < max_frames) &&
+	    (!c->deadline || now < c->deadline))
+		defer = virtio_coalesce__start_thread();
+
+	if (!defer) {
+		if (c->deadline) {
+			list_del(&c->list);
+			c->deadline = 0;
+		}
+		c->signalled = used;
+	} else if (!c->deadline) {
+		c->vdev		= vdev;
+		c->queueid	= queueid;
+		c->deadline	= now + vdev->coalesce.max_usecs * 1000ULL;
+		list_add_tail(&c->list, &pending);
+		pthread_cond_signal(&coalesce_cond);
+	}
+	mutex_unlock(&coalesce_lock);
+
+	return defer;
+}
+
+static void virtio_coalesce__ipc(struct kvm *kvm, int fd, u32 type, u32 len,
+				 u8 *msg)
+{
+	struct virtio_coalesce_msg *req = (void *)msg;
+	struct virtio_device *vdev;
+	int r = -EINVAL;
+
+	if (WARN_ON(type != KVM_IPC_VIRTIO_COALESCE))
+		return;
+
+	if (len == sizeof(*req)) {
+		req->dev[sizeof(req->dev) - 1] = 0;
+		r = -ENODEV;
+
+		mutex_lock(&coalesce_lock);
+		list_for_each_entry(vdev, &devices, list) {
+			if (strcmp(vdev->name, req->dev))
+				continue;
+			vdev->coalesce = req->params;
+			r = 0;
+		}
+		mutex_unlock(&coalesce_lock);
+	}
+
+	if (write(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed answering interrupt coalescing request");
+}
+
+static int virtio_coalesce__init(struct kvm *kvm)
+{
+	pthread_condattr_t attr;
+
+	coalesce_kvm = kvm;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&coalesce_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return kvm_ipc__register_handler(KVM_IPC_VIRTIO_COALESCE,
+					 virtio_coalesce__ipc);
+}
+base_init(virtio_coalesce__init);
+
+/* Devices are all created by now, catch settings for ones that aren't */
+static int virtio_coalesce__check(struct kvm *kvm)
+{
+	struct virtio_device *vdev;
+	bool found;
+	int i;
+
+	for (i = 0; i < kvm->cfg.nr_irq_coalesce; i++) {
+		found = false;
+		list_for_each_entry(vdev, &devices, list)
+			found |= !strcmp(vdev->name, kvm->cfg.irq_coalesce[i].dev);
+
+		if (!found)
+			pr_warning("--irq-coalesce: no device '%s'",
+				   kvm->cfg.irq_coalesce[i].dev);
+	}
+
+	return 0;
+}
+late_init(virtio_coalesce__check);
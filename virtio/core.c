@@ -21,22 +21,222 @@ const char* virtio_trans_name(enum virtio_trans trans)
 	return "unknown";
 }
 
-struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len)
+/*
+ * Packed rings. The guest makes descriptors available by setting their
+ * AVAIL flag to its wrap counter and USED to the opposite, and we give them
+ * back by setting both to ours. Like the rest of virtio 1.0, they are
+ * little endian.
+ */
+#define VRING_PACKED_F_AVAIL	(1 << VRING_PACKED_DESC_F_AVAIL)
+#define VRING_PACKED_F_USED	(1 << VRING_PACKED_DESC_F_USED)
+
+int virt_queue__init_packed(struct virt_queue *vq, u16 num, void *desc,
+			    void *driver, void *device)
+{
+	struct virt_queue_packed *p;
+
+	p = realloc(vq->packed, sizeof(*p) + num * sizeof(p->bufs[0]));
+	if (!p)
+		return -ENOMEM;
+
+	*p = (struct virt_queue_packed) {
+		.desc		= desc,
+		.driver		= driver,
+		.device		= device,
+		.num		= num,
+		.avail_wrap	= true,
+		.used_wrap	= true,
+	};
+
+	vq->packed		= p;
+	vq->last_avail_idx	= 0;
+	vq->last_used_signalled	= 0;
+	vq->used_staged		= 0;
+
+	return 0;
+}
+
+bool virt_queue__available_packed(struct virt_queue *vq)
+{
+	struct virt_queue_packed *p = vq->packed;
+	u16 flags = le16toh(*(volatile u16 *)&p->desc[vq->last_avail_idx].flags);
+
+	if (!!(flags & VRING_PACKED_F_AVAIL) != p->avail_wrap ||
+	    !!(flags & VRING_PACKED_F_USED) == p->avail_wrap)
+		return false;
+
+	/* Don't read the descriptor before seeing that it's available */
+	rmb();
+
+	return true;
+}
+
+u16 virt_queue__pop_packed(struct virt_queue *vq)
+{
+	struct virt_queue_packed *p = vq->packed;
+	u16 pos = vq->last_avail_idx, nr = 1, id;
+	struct vring_packed_desc *desc = &p->desc[pos];
+
+	/* Chained descriptors are consecutive, the last one has the ID */
+	while ((le16toh(desc->flags) & VRING_DESC_F_NEXT) && nr < p->num) {
+		desc = &p->desc[(pos + nr) % p->num];
+		nr++;
+	}
+
+	id = le16toh(desc->id);
+	if (id >= p->num) {
+		pr_warning("virtio: buffer ID %u out of range", id);
+		id %= p->num;
+	}
+
+	p->bufs[id].pos	= pos;
+	p->bufs[id].nr	= nr;
+
+	vq->last_avail_idx += nr;
+	if (vq->last_avail_idx >= p->num) {
+		vq->last_avail_idx -= p->num;
+		p->avail_wrap = !p->avail_wrap;
+	}
+
+	return id;
+}
+
+/* The i-th descriptor of buffer 'head', or NULL past its last one */
+static struct vring_packed_desc *
+virt_queue__packed_desc(struct virt_queue *vq, u16 head, u16 i, struct kvm *kvm)
+{
+	struct virt_queue_packed *p = vq->packed;
+	struct vring_packed_desc *desc = &p->desc[p->bufs[head].pos];
+
+	if (le16toh(desc->flags) & VRING_DESC_F_INDIRECT) {
+		if (i >= le32toh(desc->len) / sizeof(*desc))
+			return NULL;
+		desc = guest_flat_to_host_range(kvm, le64toh(desc->addr),
+						le32toh(desc->len));
+		return desc ? desc + i : NULL;
+	}
+
+	if (i >= p->bufs[head].nr)
+		return NULL;
+
+	return &p->desc[(p->bufs[head].pos + i) % p->num];
+}
+
+static void virt_queue__set_used_packed(struct virt_queue *vq, u32 head,
+					u32 len, u16 offset)
+{
+	struct virt_queue_packed *p = vq->packed;
+	struct vring_packed_desc *desc;
+	u16 flags;
+
+	/* Batches are filled in order, starting from the used index */
+	if (offset == 0) {
+		p->staged_idx	= p->used_idx;
+		p->staged_wrap	= p->used_wrap;
+	}
+
+	flags		= p->staged_wrap ? VRING_PACKED_F_AVAIL | VRING_PACKED_F_USED : 0;
+	desc		= &p->desc[p->staged_idx];
+	desc->id	= htole16(head);
+	desc->len	= htole32(len);
+
+	/* The guest stops at the first one, which makes them all visible */
+	if (offset == 0)
+		p->staged_flags = flags;
+	else
+		desc->flags = htole16(flags);
+
+	p->staged_idx += p->bufs[head % p->num].nr;
+	if (p->staged_idx >= p->num) {
+		p->staged_idx -= p->num;
+		p->staged_wrap = !p->staged_wrap;
+	}
+}
+
+static void virt_queue__used_advance_packed(struct virt_queue *vq)
+{
+	struct virt_queue_packed *p = vq->packed;
+
+	wmb();
+	p->desc[p->used_idx].flags = htole16(p->staged_flags);
+	p->used_idx	= p->staged_idx;
+	p->used_wrap	= p->staged_wrap;
+	wmb();
+}
+
+static bool virt_queue__should_signal_packed(struct virt_queue *vq)
+{
+	struct virt_queue_packed *p = vq->packed;
+	u16 old_idx, new_idx, event_idx, off_wrap, flags;
+
+	/* Our used descriptors have to be visible before reading the event */
+	mb();
+
+	old_idx			= vq->last_used_signalled;
+	new_idx			= p->used_idx;
+	vq->last_used_signalled	= new_idx;
+
+	flags = le16toh(p->driver->flags);
+	if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return false;
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return true;
+
+	off_wrap	= le16toh(p->driver->off_wrap);
+	event_idx	= off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR != p->used_wrap)
+		event_idx -= p->num;
+
+	return vring_need_event(event_idx, new_idx, old_idx);
+}
+
+/*
+ * Fill the used element 'offset' entries past the current used index,
+ * without handing it to the guest yet. With packed rings, elements of a
+ * batch have to be filled in order.
+ */
+struct vring_used_elem *
+virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
+				    u32 len, u16 offset)
 {
 	struct vring_used_elem *used_elem;
-	u16 idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
+	u16 idx;
+
+	if (queue->packed) {
+		virt_queue__set_used_packed(queue, head, len, offset);
+		return NULL;
+	}
 
+	idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
+
+	idx += offset;
 	used_elem	= &queue->vring.used->ring[idx % queue->vring.num];
 	used_elem->id	= virtio_host_to_guest_u32(queue, head);
 	used_elem->len	= virtio_host_to_guest_u32(queue, len);
 
+	return used_elem;
+}
+
+/* Hand the next 'jump' used elements over to the guest */
+void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
+{
+	u16 idx;
+
+	if (queue->packed) {
+		if (jump)
+			virt_queue__used_advance_packed(queue);
+		return;
+	}
+
+	idx = virtio_guest_to_host_u16(queue, queue->vring.used->idx);
+
 	/*
 	 * Use wmb to assure that used elem was updated with head and len.
 	 * We need a wmb here since we can't advance idx unless we're ready
 	 * to pass the used element to the guest.
 	 */
 	wmb();
-	idx++;
+	idx += jump;
 	queue->vring.used->idx = virtio_host_to_guest_u16(queue, idx);
 
 	/*
@@ -45,10 +245,49 @@ struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32
 	 * an updated idx.
 	 */
 	wmb();
+}
+
+/*
+ * Batched completion: stage any number of used elements, then publish them
+ * all with a single index update. The caller serializes access to the queue
+ * between the two, and checks virtio_queue__should_signal() once after
+ * publishing.
+ */
+void virt_queue__stage_used_elem(struct virt_queue *queue, u32 head, u32 len)
+{
+	virt_queue__set_used_elem_no_update(queue, head, len, queue->used_staged++);
+}
+
+void virt_queue__publish_used(struct virt_queue *queue)
+{
+	if (!queue->used_staged)
+		return;
+
+	virt_queue__used_idx_advance(queue, queue->used_staged);
+	queue->nr_used += queue->used_staged;
+	queue->used_staged = 0;
+}
+
+struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len)
+{
+	struct vring_used_elem *used_elem;
+
+	/* Goes out along with anything staged before it */
+	used_elem = virt_queue__set_used_elem_no_update(queue, head, len,
+							queue->used_staged++);
+	virt_queue__publish_used(queue);
 
 	return used_elem;
 }
 
+/* A descriptor's buffer, or an empty one if it isn't all in guest RAM */
+static void virt_queue__map_desc(struct kvm *kvm, struct iovec *iov,
+				 u64 addr, u32 len)
+{
+	iov->iov_base	= guest_flat_to_host_range(kvm, addr, len);
+	iov->iov_len	= iov->iov_base ? len : 0;
+}
+
 static inline bool virt_desc__test_flag(struct virt_queue *vq,
 					struct vring_desc *desc, u16 flag)
 {
@@ -83,22 +322,42 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 	u16 idx;
 	u16 max;
 
-	idx = head;
 	*out = *in = 0;
+
+	if (vq->packed) {
+		struct vring_packed_desc *pdesc;
+
+		for (idx = 0; (pdesc = virt_queue__packed_desc(vq, head, idx, kvm)); idx++) {
+			virt_queue__map_desc(kvm, &iov[*out + *in],
+					     le64toh(pdesc->addr), le32toh(pdesc->len));
+			if (le16toh(pdesc->flags) & VRING_DESC_F_WRITE)
+				(*in)++;
+			else
+				(*out)++;
+		}
+
+		return head;
+	}
+
+	idx = head;
 	max = vq->vring.num;
 	desc = vq->vring.desc;
 
 	if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_INDIRECT)) {
 		max = virtio_guest_to_host_u32(vq, desc[idx].len) / sizeof(struct vring_desc);
-		desc = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq, desc[idx].addr));
+		desc = guest_flat_to_host_range(kvm,
+				virtio_guest_to_host_u64(vq, desc[idx].addr),
+				max * sizeof(struct vring_desc));
+		if (!desc)
+			return head;
 		idx = 0;
 	}
 
 	do {
 		/* Grab the first descriptor, and check it's OK. */
-		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq, desc[idx].len);
-		iov[*out + *in].iov_base = guest_flat_to_host(kvm,
-							      virtio_guest_to_host_u64(vq, desc[idx].addr));
+		virt_queue__map_desc(kvm, &iov[*out + *in],
+				     virtio_guest_to_host_u64(vq, desc[idx].addr),
+				     virtio_guest_to_host_u32(vq, desc[idx].len));
 		/* If this is an input descriptor, increment that count. */
 		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE))
 			(*in)++;
@@ -123,24 +382,38 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 			      struct iovec in_iov[], struct iovec out_iov[],
 			      u16 *in, u16 *out)
 {
+	struct vring_packed_desc *pdesc;
 	struct vring_desc *desc;
 	u16 head, idx;
 
 	idx = head = virt_queue__pop(queue);
 	*out = *in = 0;
+
+	if (queue->packed) {
+		for (idx = 0; (pdesc = virt_queue__packed_desc(queue, head, idx, kvm)); idx++) {
+			if (le16toh(pdesc->flags) & VRING_DESC_F_WRITE)
+				virt_queue__map_desc(kvm, &in_iov[(*in)++],
+						     le64toh(pdesc->addr),
+						     le32toh(pdesc->len));
+			else
+				virt_queue__map_desc(kvm, &out_iov[(*out)++],
+						     le64toh(pdesc->addr),
+						     le32toh(pdesc->len));
+		}
+
+		return head;
+	}
+
 	do {
 		u64 addr;
+		u32 len;
 		desc = virt_queue__get_desc(queue, idx);
 		addr = virtio_guest_to_host_u64(queue, desc->addr);
-		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_WRITE)) {
-			in_iov[*in].iov_base = guest_flat_to_host(kvm, addr);
-			in_iov[*in].iov_len = virtio_guest_to_host_u32(queue, desc->len);
-			(*in)++;
-		} else {
-			out_iov[*out].iov_base = guest_flat_to_host(kvm, addr);
-			out_iov[*out].iov_len = virtio_guest_to_host_u32(queue, desc->len);
-			(*out)++;
-		}
+		len = virtio_guest_to_host_u32(queue, desc->len);
+		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_WRITE))
+			virt_queue__map_desc(kvm, &in_iov[(*in)++], addr, len);
+		else
+			virt_queue__map_desc(kvm, &out_iov[(*out)++], addr, len);
 		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_NEXT))
 			idx = virtio_guest_to_host_u16(queue, desc->next);
 		else
@@ -164,10 +437,58 @@ int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
 	return VIRTIO_PCI_O_CONFIG;
 }
 
+/*
+ * Tell the guest whether it has to notify us of new buffers. Depending on
+ * VIRTIO_RING_F_EVENT_IDX it reads either the used ring flags or the avail
+ * event, which disabling leaves behind the buffers we have already seen.
+ */
+void virt_queue__set_notify(struct virt_queue *vq, bool enable)
+{
+	u16 flags, event;
+
+	if (vq->packed) {
+		vq->packed->device->flags = htole16(enable ?
+						    VRING_PACKED_EVENT_FLAG_ENABLE :
+						    VRING_PACKED_EVENT_FLAG_DISABLE);
+		mb();
+		return;
+	}
+
+	if (!vq->vring.used)
+		return;
+
+	flags = virtio_guest_to_host_u16(vq, vq->vring.used->flags);
+	event = vq->last_avail_idx;
+
+	if (enable) {
+		flags &= ~VRING_USED_F_NO_NOTIFY;
+	} else {
+		flags |= VRING_USED_F_NO_NOTIFY;
+		event--;
+	}
+
+	vq->vring.used->flags = virtio_host_to_guest_u16(vq, flags);
+	vring_avail_event(&vq->vring) = virtio_host_to_guest_u16(vq, event);
+
+	/* Make the change visible before checking the avail ring again */
+	mb();
+}
+
+/*
+ * Whether the guest wants an interrupt for what was published since the last
+ * one. With EVENT_IDX, that's when its event index falls anywhere in the
+ * range, so a whole batch is covered by a single check.
+ */
 bool virtio_queue__should_signal(struct virt_queue *vq)
 {
 	u16 old_idx, new_idx, event_idx;
 
+	if (vq->packed)
+		return virt_queue__should_signal_packed(vq);
+
+	/* The used index has to be visible before reading the event */
+	mb();
+
 	old_idx		= vq->last_used_signalled;
 	new_idx		= virtio_guest_to_host_u16(vq, vq->vring.used->idx);
 	event_idx	= virtio_guest_to_host_u16(vq, vring_used_event(&vq->vring));
@@ -180,12 +501,80 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	return false;
 }
 
+/*
+ * Lay out queue 'vq' where the transport says the guest put it. Legacy
+ * rings always have the device's size, modern ones may be made smaller.
+ */
+void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
+			   struct virt_queue *vq, u16 nr_descs)
+{
+	struct vring_addr *addr = &vq->vring_addr;
+
+	vq->endian = vdev->endian;
+
+	if (!addr->legacy && addr->num && addr->num < nr_descs)
+		nr_descs = addr->num;
+
+	if (!addr->legacy && addr->packed) {
+		if (virt_queue__init_packed(vq, nr_descs,
+					    guest_flat_to_host(kvm, addr->desc),
+					    guest_flat_to_host(kvm, addr->avail),
+					    guest_flat_to_host(kvm, addr->used)))
+			die("Out of memory for packed virtqueue");
+		return;
+	}
+
+	free(vq->packed);
+	vq->packed		= NULL;
+	vq->last_avail_idx	= 0;
+	vq->last_used_signalled	= 0;
+	vq->used_staged		= 0;
+
+	if (addr->legacy) {
+		vring_init(&vq->vring, nr_descs,
+			   guest_flat_to_host(kvm, (u64)addr->pfn * addr->pgsize),
+			   addr->align);
+		return;
+	}
+
+	vq->vring = (struct vring) {
+		.num	= nr_descs,
+		.desc	= guest_flat_to_host(kvm, addr->desc),
+		.avail	= guest_flat_to_host(kvm, addr->avail),
+		.used	= guest_flat_to_host(kvm, addr->used),
+	};
+}
+
+int virtio__signal_vq_now(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	switch (vdev->trans) {
+	case VIRTIO_PCI:
+		return virtio_pci__signal_vq(kvm, vdev, vq);
+	case VIRTIO_MMIO:
+		return virtio_mmio_signal_vq(kvm, vdev, vq);
+	default:
+		return -1;
+	}
+}
+
+/* What devices call to signal a queue: subject to interrupt moderation */
+static int virtio__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+{
+	if (virtio_coalesce__defer(kvm, vdev, vq))
+		return 0;
+
+	return virtio__signal_vq_now(kvm, vdev, vq);
+}
+
 int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		struct virtio_ops *ops, enum virtio_trans trans,
 		int device_id, int subsys_id, int class)
 {
 	void *virtio;
 
+	vdev->dev	= dev;
+	vdev->trans	= trans;
+
 	switch (trans) {
 	case VIRTIO_PCI:
 		virtio = calloc(sizeof(struct virtio_pci), 1);
@@ -193,7 +582,7 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 			return -ENOMEM;
 		vdev->virtio			= virtio;
 		vdev->ops			= ops;
-		vdev->ops->signal_vq		= virtio_pci__signal_vq;
+		vdev->ops->signal_vq		= virtio__signal_vq;
 		vdev->ops->signal_config	= virtio_pci__signal_config;
 		vdev->ops->init			= virtio_pci__init;
 		vdev->ops->exit			= virtio_pci__exit;
@@ -205,7 +594,7 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 			return -ENOMEM;
 		vdev->virtio			= virtio;
 		vdev->ops			= ops;
-		vdev->ops->signal_vq		= virtio_mmio_signal_vq;
+		vdev->ops->signal_vq		= virtio__signal_vq;
 		vdev->ops->signal_config	= virtio_mmio_signal_config;
 		vdev->ops->init			= virtio_mmio_init;
 		vdev->ops->exit			= virtio_mmio_exit;
@@ -215,6 +604,8 @@ int virtio_init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		return -1;
 	};
 
+	virtio_coalesce__register(kvm, vdev, subsys_id);
+
 	return 0;
 }
 
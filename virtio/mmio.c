@@ -111,6 +111,7 @@ static void virtio_mmio_config_in(struct kvm_cpu *vcpu,
 				  struct virtio_device *vdev)
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
+	struct virt_queue *vq;
 	u32 val = 0;
 
 	switch (addr) {
@@ -129,8 +130,10 @@ static void virtio_mmio_config_in(struct kvm_cpu *vcpu,
 		ioport__write32(data, val);
 		break;
 	case VIRTIO_MMIO_QUEUE_PFN:
-		val = vdev->ops->get_pfn_vq(vmmio->kvm, vmmio->dev,
-					    vmmio->hdr.queue_sel);
+		vq = vdev->ops->get_vq(vmmio->kvm, vmmio->dev,
+				       vmmio->hdr.queue_sel);
+		if (vq)
+			val = vq->vring_addr.pfn;
 		ioport__write32(data, val);
 		break;
 	case VIRTIO_MMIO_QUEUE_NUM_MAX:
@@ -149,6 +152,7 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 {
 	struct virtio_mmio *vmmio = vdev->virtio;
 	struct kvm *kvm = vmmio->kvm;
+	struct virt_queue *vq;
 	u32 val = 0;
 
 	switch (addr) {
@@ -188,12 +192,19 @@ static void virtio_mmio_config_out(struct kvm_cpu *vcpu,
 		break;
 	case VIRTIO_MMIO_QUEUE_PFN:
 		val = ioport__read32(data);
+		vq = vdev->ops->get_vq(kvm, vmmio->dev, vmmio->hdr.queue_sel);
+		if (!vq)
+			break;
+
+		vq->vring_addr = (struct vring_addr) {
+			.legacy	= true,
+			.pfn	= val,
+			.align	= vmmio->hdr.queue_align,
+			.pgsize	= vmmio->hdr.guest_page_size,
+		};
+
 		virtio_mmio_init_ioeventfd(vmmio->kvm, vdev, vmmio->hdr.queue_sel);
-		vdev->ops->init_vq(vmmio->kvm, vmmio->dev,
-				   vmmio->hdr.queue_sel,
-				   vmmio->hdr.guest_page_size,
-				   vmmio->hdr.queue_align,
-				   val);
+		vdev->ops->init_vq(vmmio->kvm, vmmio->dev, vmmio->hdr.queue_sel);
 		break;
 	case VIRTIO_MMIO_QUEUE_NOTIFY:
 		val = ioport__read32(data);
@@ -8,7 +8,9 @@
 #include "kvm/virtio.h"
 #include "kvm/ioeventfd.h"
 
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <linux/virtio_config.h>
 #include <linux/virtio_pci.h>
 #include <linux/byteorder.h>
 #include <string.h>
@@ -21,7 +23,12 @@ static void virtio_pci__ioevent_callback(struct kvm *kvm, void *param)
 	ioeventfd->vdev->ops->notify_vq(kvm, vpci->dev, ioeventfd->vq);
 }
 
-static int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
+/*
+ * Modern drivers notify each queue at its own address in the modern BAR,
+ * legacy ones write the queue index to the I/O port or its MMIO mirror.
+ */
+static int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vdev,
+				      u32 vq, bool modern)
 {
 	struct ioevent ioevent;
 	struct virtio_pci *vpci = vdev->virtio;
@@ -47,6 +54,21 @@ static int virtio_pci__init_ioeventfd(struct kvm *kvm, struct virtio_device *vde
 	if (!vdev->use_vhost)
 		flags |= IOEVENTFD_FLAG_USER_POLL;
 
+	if (modern) {
+		ioevent.io_addr	= vpci->modern_addr + VIRTIO_PCI_MODERN_NOTIFY +
+				  vq * VIRTIO_PCI_MODERN_NOTIFY_MULT;
+		ioevent.io_len	= sizeof(u16);
+		ioevent.fd	= eventfd(0, 0);
+		r = ioeventfd__add_event(&ioevent, flags & ~IOEVENTFD_FLAG_PIO);
+		if (r)
+			return r;
+
+		if (vdev->ops->notify_vq_eventfd)
+			vdev->ops->notify_vq_eventfd(kvm, vpci->dev, vq,
+						     ioevent.fd);
+		return 0;
+	}
+
 	/* ioport */
 	ioevent.io_addr	= vpci->port_addr + VIRTIO_PCI_QUEUE_NOTIFY;
 	ioevent.io_len	= sizeof(u16);
@@ -79,6 +101,105 @@ static inline bool virtio_pci__msix_enabled(struct virtio_pci *vpci)
 	return vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_ENABLE);
 }
 
+/* The queue 'vq' of the device, or NULL if there is no such queue */
+static struct virt_queue *virtio_pci__get_vq(struct kvm *kvm,
+					     struct virtio_device *vdev, u32 vq)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+
+	if (vq >= VIRTIO_PCI_MAX_VQ)
+		return NULL;
+
+	return vdev->ops->get_vq(kvm, vpci->dev, vq);
+}
+
+/*
+ * Route vector 'vec' through a GSI of its own, and give it an irqfd if KVM
+ * has them. Returns the GSI, or a negative error.
+ */
+static int virtio_pci__route_vector(struct kvm *kvm, struct virtio_pci *vpci,
+				    u16 vec)
+{
+	struct kvm_irqfd irqfd;
+	int gsi, fd;
+
+	if (vpci->msix_gsi[vec])
+		return vpci->msix_gsi[vec];
+
+	gsi = irq__add_msix_route(kvm, &vpci->msix_table[vec].msg);
+	if (gsi <= 0)
+		return gsi < 0 ? gsi : -EINVAL;
+	vpci->msix_gsi[vec] = gsi;
+
+	if (!(vpci->features & VIRTIO_PCI_F_IRQFD))
+		return gsi;
+
+	fd = eventfd(0, 0);
+	if (fd < 0)
+		return gsi;
+
+	irqfd = (struct kvm_irqfd) {
+		.fd	= fd,
+		.gsi	= gsi,
+	};
+	if (ioctl(kvm->vm_fd, KVM_IRQFD, &irqfd) < 0) {
+		pr_warning("KVM_IRQFD failed for MSI-X vector %u", vec);
+		close(fd);
+		return gsi;
+	}
+
+	vpci->msix_irqfd[vec] = fd;
+	return gsi;
+}
+
+static void virtio_pci__set_config_vector(struct kvm *kvm,
+					  struct virtio_device *vdev, u16 vec)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+
+	if (vec >= VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG)
+		vec = VIRTIO_MSI_NO_VECTOR;
+
+	vpci->config_vector = vec;
+	if (vec == VIRTIO_MSI_NO_VECTOR)
+		return;
+
+	virtio_pci__route_vector(kvm, vpci, vec);
+}
+
+static void virtio_pci__set_queue_vector(struct kvm *kvm,
+					 struct virtio_device *vdev, u32 vq,
+					 u16 vec)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+	int gsi;
+
+	if (vq >= VIRTIO_PCI_MAX_VQ)
+		return;
+
+	if (vec >= VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG)
+		vec = VIRTIO_MSI_NO_VECTOR;
+
+	vpci->vq_vector[vq] = vec;
+	if (vec == VIRTIO_MSI_NO_VECTOR)
+		return;
+
+	gsi = virtio_pci__route_vector(kvm, vpci, vec);
+	if (gsi > 0 && vdev->ops->notify_vq_gsi)
+		vdev->ops->notify_vq_gsi(kvm, vpci->dev, vq, gsi);
+}
+
+/* Reading the ISR acknowledges the interrupt */
+static u8 virtio_pci__read_isr(struct kvm *kvm, struct virtio_pci *vpci)
+{
+	u8 isr = vpci->isr;
+
+	kvm__irq_line(kvm, vpci->pci_hdr.irq_line, VIRTIO_IRQ_LOW);
+	vpci->isr = VIRTIO_IRQ_LOW;
+
+	return isr;
+}
+
 static bool virtio_pci__specific_io_in(struct kvm *kvm, struct virtio_device *vdev, u16 port,
 					void *data, int size, int offset)
 {
@@ -93,7 +214,10 @@ static bool virtio_pci__specific_io_in(struct kvm *kvm, struct virtio_device *vd
 			ioport__write16(data, vpci->config_vector);
 			break;
 		case VIRTIO_MSI_QUEUE_VECTOR:
-			ioport__write16(data, vpci->vq_vector[vpci->queue_selector]);
+			if (vpci->queue_selector < VIRTIO_PCI_MAX_VQ)
+				ioport__write16(data, vpci->vq_vector[vpci->queue_selector]);
+			else
+				ioport__write16(data, VIRTIO_MSI_NO_VECTOR);
 			break;
 		};
 
@@ -115,6 +239,7 @@ static bool virtio_pci__io_in(struct ioport *ioport, struct kvm_cpu *vcpu, u16 p
 	bool ret = true;
 	struct virtio_device *vdev;
 	struct virtio_pci *vpci;
+	struct virt_queue *vq;
 	struct kvm *kvm;
 	u32 val;
 
@@ -125,12 +250,13 @@ static bool virtio_pci__io_in(struct ioport *ioport, struct kvm_cpu *vcpu, u16 p
 
 	switch (offset) {
 	case VIRTIO_PCI_HOST_FEATURES:
+		/* Legacy drivers only see the first 32 feature bits */
 		val = vdev->ops->get_host_features(kvm, vpci->dev);
 		ioport__write32(data, val);
 		break;
 	case VIRTIO_PCI_QUEUE_PFN:
-		val = vdev->ops->get_pfn_vq(kvm, vpci->dev, vpci->queue_selector);
-		ioport__write32(data, val);
+		vq = virtio_pci__get_vq(kvm, vdev, vpci->queue_selector);
+		ioport__write32(data, vq ? vq->vring_addr.pfn : 0);
 		break;
 	case VIRTIO_PCI_QUEUE_NUM:
 		val = vdev->ops->get_size_vq(kvm, vpci->dev, vpci->queue_selector);
@@ -140,9 +266,7 @@ static bool virtio_pci__io_in(struct ioport *ioport, struct kvm_cpu *vcpu, u16 p
 		ioport__write8(data, vpci->status);
 		break;
 	case VIRTIO_PCI_ISR:
-		ioport__write8(data, vpci->isr);
-		kvm__irq_line(kvm, vpci->pci_hdr.irq_line, VIRTIO_IRQ_LOW);
-		vpci->isr = VIRTIO_IRQ_LOW;
+		ioport__write8(data, virtio_pci__read_isr(kvm, vpci));
 		break;
 	default:
 		ret = virtio_pci__specific_io_in(kvm, vdev, port, data, size, offset);
@@ -156,31 +280,17 @@ static bool virtio_pci__specific_io_out(struct kvm *kvm, struct virtio_device *v
 					void *data, int size, int offset)
 {
 	struct virtio_pci *vpci = vdev->virtio;
-	u32 config_offset, gsi, vec;
+	u32 config_offset;
 	int type = virtio__get_dev_specific_field(offset - 20, virtio_pci__msix_enabled(vpci),
 							&config_offset);
 	if (type == VIRTIO_PCI_O_MSIX) {
 		switch (offset) {
 		case VIRTIO_MSI_CONFIG_VECTOR:
-			vec = vpci->config_vector = ioport__read16(data);
-			if (vec == VIRTIO_MSI_NO_VECTOR)
-				break;
-
-			gsi = irq__add_msix_route(kvm, &vpci->msix_table[vec].msg);
-
-			vpci->config_gsi = gsi;
+			virtio_pci__set_config_vector(kvm, vdev, ioport__read16(data));
 			break;
 		case VIRTIO_MSI_QUEUE_VECTOR:
-			vec = vpci->vq_vector[vpci->queue_selector] = ioport__read16(data);
-
-			if (vec == VIRTIO_MSI_NO_VECTOR)
-				break;
-
-			gsi = irq__add_msix_route(kvm, &vpci->msix_table[vec].msg);
-			vpci->gsis[vpci->queue_selector] = gsi;
-			if (vdev->ops->notify_vq_gsi)
-				vdev->ops->notify_vq_gsi(kvm, vpci->dev,
-							vpci->queue_selector, gsi);
+			virtio_pci__set_queue_vector(kvm, vdev, vpci->queue_selector,
+						     ioport__read16(data));
 			break;
 		};
 
@@ -200,6 +310,7 @@ static bool virtio_pci__io_out(struct ioport *ioport, struct kvm_cpu *vcpu, u16
 	bool ret = true;
 	struct virtio_device *vdev;
 	struct virtio_pci *vpci;
+	struct virt_queue *vq;
 	struct kvm *kvm;
 	u32 val;
 
@@ -215,10 +326,19 @@ static bool virtio_pci__io_out(struct ioport *ioport, struct kvm_cpu *vcpu, u16
 		break;
 	case VIRTIO_PCI_QUEUE_PFN:
 		val = ioport__read32(data);
-		virtio_pci__init_ioeventfd(kvm, vdev, vpci->queue_selector);
-		vdev->ops->init_vq(kvm, vpci->dev, vpci->queue_selector,
-				   1 << VIRTIO_PCI_QUEUE_ADDR_SHIFT,
-				   VIRTIO_PCI_VRING_ALIGN, val);
+		vq = virtio_pci__get_vq(kvm, vdev, vpci->queue_selector);
+		if (!vq)
+			break;
+
+		vq->vring_addr = (struct vring_addr) {
+			.legacy	= true,
+			.pfn	= val,
+			.align	= VIRTIO_PCI_VRING_ALIGN,
+			.pgsize	= 1 << VIRTIO_PCI_QUEUE_ADDR_SHIFT,
+		};
+
+		virtio_pci__init_ioeventfd(kvm, vdev, vpci->queue_selector, false);
+		vdev->ops->init_vq(kvm, vpci->dev, vpci->queue_selector);
 		break;
 	case VIRTIO_PCI_QUEUE_SEL:
 		vpci->queue_selector = ioport__read16(data);
@@ -247,13 +367,110 @@ static struct ioport_operations virtio_pci__io_ops = {
 	.io_out	= virtio_pci__io_out,
 };
 
+static void virtio_pci__signal_msi(struct kvm *kvm, struct virtio_pci *vpci, int vec)
+{
+	struct kvm_msi msi = {
+		.address_lo = vpci->msix_table[vec].msg.address_lo,
+		.address_hi = vpci->msix_table[vec].msg.address_hi,
+		.data = vpci->msix_table[vec].msg.data,
+	};
+
+	ioctl(kvm->vm_fd, KVM_SIGNAL_MSI, &msi);
+}
+
+static bool virtio_pci__vector_masked(struct virtio_pci *vpci, u16 vec)
+{
+	return vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
+	       vpci->msix_table[vec].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT);
+}
+
+static void virtio_pci__deliver_vector(struct kvm *kvm, struct virtio_pci *vpci,
+				       u16 vec)
+{
+	u64 one = 1;
+
+	if (vpci->msix_irqfd[vec] &&
+	    write(vpci->msix_irqfd[vec], &one, sizeof(one)) == sizeof(one))
+		return;
+
+	if (vpci->features & VIRTIO_PCI_F_SIGNAL_MSI)
+		virtio_pci__signal_msi(kvm, vpci, vec);
+	else if (vpci->msix_gsi[vec])
+		kvm__irq_trigger(kvm, vpci->msix_gsi[vec]);
+}
+
+/* Deliver vector 'vec' if it is pending and no longer masked */
+static void virtio_pci__replay_vector(struct kvm *kvm, struct virtio_pci *vpci,
+				      u16 vec)
+{
+	bool pending;
+
+	mutex_lock(&vpci->msix_lock);
+	pending = (vpci->msix_pba & (1ULL << vec)) &&
+		  !virtio_pci__vector_masked(vpci, vec);
+	if (pending)
+		vpci->msix_pba &= ~(1ULL << vec);
+	mutex_unlock(&vpci->msix_lock);
+
+	if (pending)
+		virtio_pci__deliver_vector(kvm, vpci, vec);
+}
+
+/*
+ * Masked vectors are left pending, and delivered once unmasked. The guest
+ * may unmask it before the pending bit is set, so look again after.
+ */
+static void virtio_pci__signal_vector(struct kvm *kvm, struct virtio_pci *vpci,
+				      u16 vec)
+{
+	if (!virtio_pci__vector_masked(vpci, vec)) {
+		virtio_pci__deliver_vector(kvm, vpci, vec);
+		return;
+	}
+
+	mutex_lock(&vpci->msix_lock);
+	vpci->msix_pba |= 1ULL << vec;
+	mutex_unlock(&vpci->msix_lock);
+
+	virtio_pci__replay_vector(kvm, vpci, vec);
+}
+
+/* Clearing the function mask delivers what it held back */
+static void virtio_pci__config_write(struct kvm *kvm,
+				     struct pci_device_header *pci_hdr,
+				     u8 offset, void *data, int size)
+{
+	struct virtio_pci *vpci = container_of(pci_hdr, struct virtio_pci, pci_hdr);
+	u8 ctrl = offsetof(struct pci_device_header, msix.ctrl);
+	u16 vec;
+
+	if (offset + size <= ctrl || offset >= ctrl + sizeof(pci_hdr->msix.ctrl))
+		return;
+
+	for (vec = 0; vec < ARRAY_SIZE(vpci->msix_table); vec++)
+		virtio_pci__replay_vector(kvm, vpci, vec);
+}
+
+/* The guest wrote to entry 'vec' of the MSI-X table, which was 'old' */
+static void virtio_pci__msix_table_write(struct kvm *kvm, struct virtio_pci *vpci,
+					 u32 vec, struct msix_table *old)
+{
+	struct msix_table *entry = &vpci->msix_table[vec];
+
+	if (vpci->msix_gsi[vec] && memcmp(&old->msg, &entry->msg, sizeof(old->msg)))
+		irq__update_msix_route(kvm, vpci->msix_gsi[vec], &entry->msg);
+
+	virtio_pci__replay_vector(kvm, vpci, vec);
+}
+
 static void virtio_pci__msix_mmio_callback(struct kvm_cpu *vcpu,
 					   u64 addr, u8 *data, u32 len,
 					   u8 is_write, void *ptr)
 {
 	struct virtio_pci *vpci = ptr;
+	struct msix_table old;
 	void *table;
-	u32 offset;
+	u32 offset, vec;
 
 	if (addr > vpci->msix_io_block + PCI_IO_SIZE) {
 		table	= &vpci->msix_pba;
@@ -263,21 +480,24 @@ static void virtio_pci__msix_mmio_callback(struct kvm_cpu *vcpu,
 		offset	= vpci->msix_io_block;
 	}
 
-	if (is_write)
-		memcpy(table + addr - offset, data, len);
-	else
+	if (!is_write) {
 		memcpy(data, table + addr - offset, len);
-}
+		return;
+	}
 
-static void virtio_pci__signal_msi(struct kvm *kvm, struct virtio_pci *vpci, int vec)
-{
-	struct kvm_msi msi = {
-		.address_lo = vpci->msix_table[vec].msg.address_lo,
-		.address_hi = vpci->msix_table[vec].msg.address_hi,
-		.data = vpci->msix_table[vec].msg.data,
-	};
+	/* The PBA is read-only */
+	if (table != &vpci->msix_table)
+		return;
 
-	ioctl(kvm->vm_fd, KVM_SIGNAL_MSI, &msi);
+	vec = (addr - offset) / sizeof(struct msix_table);
+	if (vec >= ARRAY_SIZE(vpci->msix_table)) {
+		memcpy(table + addr - offset, data, len);
+		return;
+	}
+
+	old = vpci->msix_table[vec];
+	memcpy(table + addr - offset, data, len);
+	virtio_pci__msix_table_write(vpci->kvm, vpci, vec, &old);
 }
 
 int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
@@ -286,17 +506,7 @@ int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 	int tbl = vpci->vq_vector[vq];
 
 	if (virtio_pci__msix_enabled(vpci) && tbl != VIRTIO_MSI_NO_VECTOR) {
-		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
-		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
-
-			vpci->msix_pba |= 1 << tbl;
-			return 0;
-		}
-
-		if (vpci->features & VIRTIO_PCI_F_SIGNAL_MSI)
-			virtio_pci__signal_msi(kvm, vpci, vpci->vq_vector[vq]);
-		else
-			kvm__irq_trigger(kvm, vpci->gsis[vq]);
+		virtio_pci__signal_vector(kvm, vpci, tbl);
 	} else {
 		vpci->isr = VIRTIO_IRQ_HIGH;
 		kvm__irq_trigger(kvm, vpci->pci_hdr.irq_line);
@@ -310,17 +520,7 @@ int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
 	int tbl = vpci->config_vector;
 
 	if (virtio_pci__msix_enabled(vpci) && tbl != VIRTIO_MSI_NO_VECTOR) {
-		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
-		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
-
-			vpci->msix_pba |= 1 << tbl;
-			return 0;
-		}
-
-		if (vpci->features & VIRTIO_PCI_F_SIGNAL_MSI)
-			virtio_pci__signal_msi(kvm, vpci, tbl);
-		else
-			kvm__irq_trigger(kvm, vpci->config_gsi);
+		virtio_pci__signal_vector(kvm, vpci, tbl);
 	} else {
 		vpci->isr = VIRTIO_PCI_ISR_CONFIG;
 		kvm__irq_trigger(kvm, vpci->pci_hdr.irq_line);
@@ -340,6 +540,376 @@ static void virtio_pci__io_mmio_callback(struct kvm_cpu *vcpu,
 	kvm__emulate_io(vcpu, port, data, direction, len, 1);
 }
 
+/*
+ * Modern interface. Everything is little endian, features are negotiated
+ * 32 bits at a time and take effect once the driver sets FEATURES_OK, and
+ * queues are placed by the driver in three separate areas.
+ */
+static u64 virtio_pci__host_features(struct kvm *kvm, struct virtio_device *vdev)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+	u64 features;
+
+	features = vdev->ops->get_host_features(kvm, vpci->dev);
+	features |= 1ULL << VIRTIO_F_VERSION_1;
+
+	/* vhost only knows about split rings */
+	if (!vdev->use_vhost)
+		features |= 1ULL << VIRTIO_F_RING_PACKED;
+
+	return features;
+}
+
+static u16 virtio_pci__num_queues(struct kvm *kvm, struct virtio_device *vdev)
+{
+	u16 nr = 0;
+
+	while (virtio_pci__get_vq(kvm, vdev, nr))
+		nr++;
+
+	return nr;
+}
+
+static void virtio_pci__modern_reset(struct kvm *kvm, struct virtio_device *vdev)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+	struct virt_queue *vq;
+	u32 i;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	vdev->endian = VIRTIO_ENDIAN_LE;
+#else
+	vdev->endian = VIRTIO_ENDIAN_HOST;
+#endif
+
+	vpci->device_features_sel	= 0;
+	vpci->driver_features_sel	= 0;
+	vpci->driver_features		= 0;
+	vpci->queues_enabled		= 0;
+
+	for (i = 0; (vq = virtio_pci__get_vq(kvm, vdev, i)); i++)
+		vq->vring_addr = (struct vring_addr) { .legacy = false };
+}
+
+static void virtio_pci__modern_enable_vq(struct kvm *kvm,
+					 struct virtio_device *vdev,
+					 struct virt_queue *vq, u32 idx)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+
+	if (vpci->queues_enabled & (1U << idx))
+		return;
+
+	vq->vring_addr.packed = !!(vpci->driver_features &
+				   (1ULL << VIRTIO_F_RING_PACKED));
+
+	virtio_pci__init_ioeventfd(kvm, vdev, idx, true);
+	vdev->ops->init_vq(kvm, vpci->dev, idx);
+	vpci->queues_enabled |= 1U << idx;
+}
+
+static void virtio_pci__set_u64_half(u64 *val, bool hi, u32 half)
+{
+	if (hi)
+		*val = (*val & 0xffffffffULL) | (u64)half << 32;
+	else
+		*val = (*val & ~0xffffffffULL) | half;
+}
+
+static u32 virtio_pci__common_read(struct kvm *kvm, struct virtio_device *vdev,
+				   u32 offset)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+	struct virt_queue *vq;
+	u64 features;
+
+	switch (offset) {
+	case VIRTIO_PCI_COMMON_DFSELECT:
+		return vpci->device_features_sel;
+	case VIRTIO_PCI_COMMON_DF:
+		if (vpci->device_features_sel > 1)
+			return 0;
+		features = virtio_pci__host_features(kvm, vdev);
+		return features >> (32 * vpci->device_features_sel);
+	case VIRTIO_PCI_COMMON_GFSELECT:
+		return vpci->driver_features_sel;
+	case VIRTIO_PCI_COMMON_GF:
+		if (vpci->driver_features_sel > 1)
+			return 0;
+		return vpci->driver_features >> (32 * vpci->driver_features_sel);
+	case VIRTIO_PCI_COMMON_MSIX:
+		return vpci->config_vector;
+	case VIRTIO_PCI_COMMON_NUMQ:
+		return virtio_pci__num_queues(kvm, vdev);
+	case VIRTIO_PCI_COMMON_STATUS:
+		return vpci->status;
+	case VIRTIO_PCI_COMMON_CFGGENERATION:
+		return 0;
+	case VIRTIO_PCI_COMMON_Q_SELECT:
+		return vpci->queue_selector;
+	}
+
+	/* A queue size of zero tells the driver the queue does not exist */
+	vq = virtio_pci__get_vq(kvm, vdev, vpci->queue_selector);
+	if (!vq)
+		return 0;
+
+	switch (offset) {
+	case VIRTIO_PCI_COMMON_Q_SIZE:
+		if (vq->vring_addr.num)
+			return vq->vring_addr.num;
+		return vdev->ops->get_size_vq(kvm, vpci->dev, vpci->queue_selector);
+	case VIRTIO_PCI_COMMON_Q_MSIX:
+		return vpci->vq_vector[vpci->queue_selector];
+	case VIRTIO_PCI_COMMON_Q_ENABLE:
+		return !!(vpci->queues_enabled & (1U << vpci->queue_selector));
+	case VIRTIO_PCI_COMMON_Q_NOFF:
+		return vpci->queue_selector;
+	case VIRTIO_PCI_COMMON_Q_DESCLO:
+		return vq->vring_addr.desc;
+	case VIRTIO_PCI_COMMON_Q_DESCHI:
+		return vq->vring_addr.desc >> 32;
+	case VIRTIO_PCI_COMMON_Q_AVAILLO:
+		return vq->vring_addr.avail;
+	case VIRTIO_PCI_COMMON_Q_AVAILHI:
+		return vq->vring_addr.avail >> 32;
+	case VIRTIO_PCI_COMMON_Q_USEDLO:
+		return vq->vring_addr.used;
+	case VIRTIO_PCI_COMMON_Q_USEDHI:
+		return vq->vring_addr.used >> 32;
+	}
+
+	return 0;
+}
+
+static void virtio_pci__common_write(struct kvm *kvm, struct virtio_device *vdev,
+				     u32 offset, u32 val)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+	struct virt_queue *vq;
+	u64 features;
+	u8 status;
+
+	switch (offset) {
+	case VIRTIO_PCI_COMMON_DFSELECT:
+		vpci->device_features_sel = val;
+		return;
+	case VIRTIO_PCI_COMMON_GFSELECT:
+		vpci->driver_features_sel = val;
+		return;
+	case VIRTIO_PCI_COMMON_GF:
+		if (vpci->driver_features_sel > 1)
+			return;
+		virtio_pci__set_u64_half(&vpci->driver_features,
+					 vpci->driver_features_sel, val);
+		return;
+	case VIRTIO_PCI_COMMON_MSIX:
+		virtio_pci__set_config_vector(kvm, vdev, val);
+		return;
+	case VIRTIO_PCI_COMMON_STATUS:
+		status = vpci->status;
+		vpci->status = val;
+		if (!vpci->status)
+			virtio_pci__modern_reset(kvm, vdev);
+
+		if ((vpci->status & VIRTIO_CONFIG_S_FEATURES_OK) &&
+		    !(status & VIRTIO_CONFIG_S_FEATURES_OK)) {
+			features = virtio_pci__host_features(kvm, vdev);
+			vpci->driver_features &= features;
+			vdev->ops->set_guest_features(kvm, vpci->dev,
+						      vpci->driver_features);
+		}
+
+		if (vdev->ops->notify_status)
+			vdev->ops->notify_status(kvm, vpci->dev, vpci->status);
+		return;
+	case VIRTIO_PCI_COMMON_Q_SELECT:
+		vpci->queue_selector = val;
+		return;
+	}
+
+	vq = virtio_pci__get_vq(kvm, vdev, vpci->queue_selector);
+	if (!vq)
+		return;
+
+	switch (offset) {
+	case VIRTIO_PCI_COMMON_Q_SIZE:
+		if (val && (int)val <= vdev->ops->get_size_vq(kvm, vpci->dev,
+							      vpci->queue_selector))
+			vq->vring_addr.num = val;
+		break;
+	case VIRTIO_PCI_COMMON_Q_MSIX:
+		virtio_pci__set_queue_vector(kvm, vdev, vpci->queue_selector, val);
+		break;
+	case VIRTIO_PCI_COMMON_Q_ENABLE:
+		if (val == 1)
+			virtio_pci__modern_enable_vq(kvm, vdev, vq,
+						     vpci->queue_selector);
+		break;
+	case VIRTIO_PCI_COMMON_Q_DESCLO:
+	case VIRTIO_PCI_COMMON_Q_DESCHI:
+		virtio_pci__set_u64_half(&vq->vring_addr.desc,
+					 offset == VIRTIO_PCI_COMMON_Q_DESCHI, val);
+		break;
+	case VIRTIO_PCI_COMMON_Q_AVAILLO:
+	case VIRTIO_PCI_COMMON_Q_AVAILHI:
+		virtio_pci__set_u64_half(&vq->vring_addr.avail,
+					 offset == VIRTIO_PCI_COMMON_Q_AVAILHI, val);
+		break;
+	case VIRTIO_PCI_COMMON_Q_USEDLO:
+	case VIRTIO_PCI_COMMON_Q_USEDHI:
+		virtio_pci__set_u64_half(&vq->vring_addr.used,
+					 offset == VIRTIO_PCI_COMMON_Q_USEDHI, val);
+		break;
+	}
+}
+
+static void virtio_pci__device_access(struct kvm *kvm, struct virtio_device *vdev,
+				      u32 offset, u8 *data, u32 len, u8 is_write)
+{
+	struct virtio_pci *vpci = vdev->virtio;
+	size_t size = 0;
+	u8 *config;
+
+	if (vdev->ops->get_config_size)
+		size = vdev->ops->get_config_size(kvm, vpci->dev);
+
+	if (offset + len > size) {
+		if (!is_write)
+			memset(data, 0, len);
+		return;
+	}
+
+	config = vdev->ops->get_config(kvm, vpci->dev);
+	if (is_write)
+		memcpy(config + offset, data, len);
+	else
+		memcpy(data, config + offset, len);
+}
+
+static void virtio_pci__modern_mmio_callback(struct kvm_cpu *vcpu,
+					     u64 addr, u8 *data, u32 len,
+					     u8 is_write, void *ptr)
+{
+	struct virtio_device *vdev = ptr;
+	struct virtio_pci *vpci = vdev->virtio;
+	struct kvm *kvm = vcpu->kvm;
+	u32 offset = addr - vpci->modern_addr;
+	u32 val = 0;
+
+	if (offset >= VIRTIO_PCI_MODERN_DEVICE) {
+		virtio_pci__device_access(kvm, vdev, offset - VIRTIO_PCI_MODERN_DEVICE,
+					  data, len, is_write);
+		return;
+	}
+
+	if (offset >= VIRTIO_PCI_MODERN_NOTIFY) {
+		/* Without an ioeventfd, or before the queue is enabled */
+		val = (offset - VIRTIO_PCI_MODERN_NOTIFY) / VIRTIO_PCI_MODERN_NOTIFY_MULT;
+		if (is_write && virtio_pci__get_vq(kvm, vdev, val))
+			vdev->ops->notify_vq(kvm, vpci->dev, val);
+		else if (!is_write)
+			memset(data, 0, len);
+		return;
+	}
+
+	if (offset >= VIRTIO_PCI_MODERN_ISR) {
+		if (!is_write) {
+			memset(data, 0, len);
+			ioport__write8(data, virtio_pci__read_isr(kvm, vpci));
+		}
+		return;
+	}
+
+	offset -= VIRTIO_PCI_MODERN_COMMON;
+	if (is_write) {
+		switch (len) {
+		case 1:
+			val = ioport__read8(data);
+			break;
+		case 2:
+			val = ioport__read16((u16 *)data);
+			break;
+		case 4:
+			val = ioport__read32((u32 *)data);
+			break;
+		}
+		virtio_pci__common_write(kvm, vdev, offset, val);
+		return;
+	}
+
+	val = virtio_pci__common_read(kvm, vdev, offset);
+	switch (len) {
+	case 1:
+		ioport__write8(data, val);
+		break;
+	case 2:
+		ioport__write16((u16 *)data, val);
+		break;
+	case 4:
+		ioport__write32((u32 *)data, val);
+		break;
+	default:
+		memset(data, 0, len);
+		break;
+	}
+}
+
+static void virtio_pci__init_modern_caps(struct virtio_pci *vpci)
+{
+	struct virtio_pci_modern_caps *caps = (void *)vpci->pci_hdr.empty;
+	u8 base = (void *)caps - (void *)&vpci->pci_hdr;
+
+	BUILD_BUG_ON(sizeof(*caps) > sizeof(vpci->pci_hdr.empty));
+
+	caps->common = (struct virtio_pci_cap) {
+		.cap_vndr	= PCI_CAP_ID_VNDR,
+		.cap_next	= base + offsetof(struct virtio_pci_modern_caps, notify),
+		.cap_len	= sizeof(caps->common),
+		.cfg_type	= VIRTIO_PCI_CAP_COMMON_CFG,
+		.bar		= VIRTIO_PCI_MODERN_BAR,
+		.offset		= cpu_to_le32(VIRTIO_PCI_MODERN_COMMON),
+		.length		= cpu_to_le32(sizeof(struct virtio_pci_common_cfg)),
+	};
+
+	caps->notify = (struct virtio_pci_notify_cap) {
+		.cap = {
+			.cap_vndr	= PCI_CAP_ID_VNDR,
+			.cap_next	= base + offsetof(struct virtio_pci_modern_caps, isr),
+			.cap_len	= sizeof(caps->notify),
+			.cfg_type	= VIRTIO_PCI_CAP_NOTIFY_CFG,
+			.bar		= VIRTIO_PCI_MODERN_BAR,
+			.offset		= cpu_to_le32(VIRTIO_PCI_MODERN_NOTIFY),
+			.length		= cpu_to_le32(VIRTIO_PCI_MAX_VQ *
+						      VIRTIO_PCI_MODERN_NOTIFY_MULT),
+		},
+		.notify_off_multiplier	= cpu_to_le32(VIRTIO_PCI_MODERN_NOTIFY_MULT),
+	};
+
+	caps->isr = (struct virtio_pci_cap) {
+		.cap_vndr	= PCI_CAP_ID_VNDR,
+		.cap_next	= base + offsetof(struct virtio_pci_modern_caps, device),
+		.cap_len	= sizeof(caps->isr),
+		.cfg_type	= VIRTIO_PCI_CAP_ISR_CFG,
+		.bar		= VIRTIO_PCI_MODERN_BAR,
+		.offset		= cpu_to_le32(VIRTIO_PCI_MODERN_ISR),
+		.length		= cpu_to_le32(1),
+	};
+
+	caps->device = (struct virtio_pci_cap) {
+		.cap_vndr	= PCI_CAP_ID_VNDR,
+		.cap_next	= 0,
+		.cap_len	= sizeof(caps->device),
+		.cfg_type	= VIRTIO_PCI_CAP_DEVICE_CFG,
+		.bar		= VIRTIO_PCI_MODERN_BAR,
+		.offset		= cpu_to_le32(VIRTIO_PCI_MODERN_DEVICE),
+		.length		= cpu_to_le32(VIRTIO_PCI_MODERN_SIZE -
+					      VIRTIO_PCI_MODERN_DEVICE),
+	};
+
+	vpci->pci_hdr.msix.next = base;
+}
+
 int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 		     int device_id, int subsys_id, int class)
 {
@@ -366,6 +936,12 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	if (r < 0)
 		goto free_mmio;
 
+	vpci->modern_addr = pci_get_io_space_block(VIRTIO_PCI_MODERN_SIZE);
+	r = kvm__register_mmio(kvm, vpci->modern_addr, VIRTIO_PCI_MODERN_SIZE, false,
+			       virtio_pci__modern_mmio_callback, vdev);
+	if (r < 0)
+		goto free_msix_mmio;
+
 	vpci->pci_hdr = (struct pci_device_header) {
 		.vendor_id		= cpu_to_le16(PCI_VENDOR_ID_REDHAT_QUMRANET),
 		.device_id		= cpu_to_le16(device_id),
@@ -383,11 +959,17 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 							| PCI_BASE_ADDRESS_SPACE_IO),
 		.bar[2]			= cpu_to_le32(vpci->msix_io_block
 							| PCI_BASE_ADDRESS_SPACE_MEMORY),
+		.bar[VIRTIO_PCI_MODERN_BAR] = cpu_to_le32(vpci->modern_addr
+							| PCI_BASE_ADDRESS_SPACE_MEMORY),
 		.status			= cpu_to_le16(PCI_STATUS_CAP_LIST),
 		.capabilities		= (void *)&vpci->pci_hdr.msix - (void *)&vpci->pci_hdr,
 		.bar_size[0]		= cpu_to_le32(IOPORT_SIZE),
 		.bar_size[1]		= cpu_to_le32(IOPORT_SIZE),
 		.bar_size[2]		= cpu_to_le32(PCI_IO_SIZE*2),
+		.bar_size[VIRTIO_PCI_MODERN_BAR] = cpu_to_le32(VIRTIO_PCI_MODERN_SIZE),
+		.cfg_ops		= (struct pci_config_operations) {
+			.write		= virtio_pci__config_write,
+		},
 	};
 
 	vpci->dev_hdr = (struct device_header) {
@@ -396,7 +978,7 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	};
 
 	vpci->pci_hdr.msix.cap = PCI_CAP_ID_MSIX;
-	vpci->pci_hdr.msix.next = 0;
+	virtio_pci__init_modern_caps(vpci);
 	/*
 	 * We at most have VIRTIO_PCI_MAX_VQ entries for virt queue,
 	 * VIRTIO_PCI_MAX_CONFIG entries for config.
@@ -414,16 +996,21 @@ int virtio_pci__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
 	vpci->pci_hdr.msix.table_offset = cpu_to_le32(2);
 	vpci->pci_hdr.msix.pba_offset = cpu_to_le32(2 | PCI_IO_SIZE);
 	vpci->config_vector = 0;
+	mutex_init(&vpci->msix_lock);
 
 	if (kvm__supports_extension(kvm, KVM_CAP_SIGNAL_MSI))
 		vpci->features |= VIRTIO_PCI_F_SIGNAL_MSI;
+	if (kvm__supports_extension(kvm, KVM_CAP_IRQFD))
+		vpci->features |= VIRTIO_PCI_F_IRQFD;
 
 	r = device__register(&vpci->dev_hdr);
 	if (r < 0)
-		goto free_msix_mmio;
+		goto free_modern_mmio;
 
 	return 0;
 
+free_modern_mmio:
+	kvm__deregister_mmio(kvm, vpci->modern_addr);
 free_msix_mmio:
 	kvm__deregister_mmio(kvm, vpci->msix_io_block);
 free_mmio:
@@ -440,12 +1027,20 @@ int virtio_pci__exit(struct kvm *kvm, struct virtio_device *vdev)
 
 	kvm__deregister_mmio(kvm, vpci->mmio_addr);
 	kvm__deregister_mmio(kvm, vpci->msix_io_block);
+	kvm__deregister_mmio(kvm, vpci->modern_addr);
 	ioport__unregister(kvm, vpci->port_addr);
 
 	for (i = 0; i < VIRTIO_PCI_MAX_VQ; i++) {
 		ioeventfd__del_event(vpci->port_addr + VIRTIO_PCI_QUEUE_NOTIFY, i);
 		ioeventfd__del_event(vpci->mmio_addr + VIRTIO_PCI_QUEUE_NOTIFY, i);
+		ioeventfd__del_event(vpci->modern_addr + VIRTIO_PCI_MODERN_NOTIFY +
+				     i * VIRTIO_PCI_MODERN_NOTIFY_MULT, i);
 	}
 
+	/* Closing an irqfd detaches it from the guest */
+	for (i = 0; i < VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG; i++)
+		if (vpci->msix_irqfd[i])
+			close(vpci->msix_irqfd[i]);
+
 	return 0;
 }
@@ -7,26 +7,123 @@
 #include "kvm/guest_compat.h"
 #include "kvm/virtio-pci.h"
 #include "kvm/virtio.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+#include "kvm/threadpool.h"
 
 #include <linux/kernel.h>
 #include <linux/virtio_scsi.h>
 #include <linux/vhost.h>
+#include <pthread.h>
 
 #define VIRTIO_SCSI_QUEUE_SIZE		128
 #define NUM_VIRT_QUEUES			3
 
+/*
+ * Without vhost, LUNs are disk images and commands are emulated. The
+ * controlq and eventq come first, followed by up to VIRTIO_SCSI_MAX_QUEUES
+ * request queues, each served by its own I/O thread.
+ */
+#define VIRTIO_SCSI_CTRL_VQ		0
+#define VIRTIO_SCSI_EVENT_VQ		1
+#define VIRTIO_SCSI_REQ_VQ		2
+#define VIRTIO_SCSI_MAX_QUEUES		16
+#define VIRTIO_SCSI_MAX_VQS		(VIRTIO_SCSI_REQ_VQ + VIRTIO_SCSI_MAX_QUEUES)
+
+#define VIRTIO_SCSI_MAX_SECTORS		0xffff
+#define VIRTIO_SCSI_MAX_UNMAP_SECTORS	(1U << 21)
+#define VIRTIO_SCSI_MAX_UNMAP_DESC	32
+
+/* SCSI commands emulated for disk images */
+#define SCSI_TEST_UNIT_READY		0x00
+#define SCSI_REQUEST_SENSE		0x03
+#define SCSI_INQUIRY			0x12
+#define SCSI_MODE_SENSE_6		0x1a
+#define SCSI_START_STOP_UNIT		0x1b
+#define SCSI_READ_CAPACITY_10		0x25
+#define SCSI_READ_10			0x28
+#define SCSI_WRITE_10			0x2a
+#define SCSI_SYNCHRONIZE_CACHE_10	0x35
+#define SCSI_UNMAP			0x42
+#define SCSI_MODE_SENSE_10		0x5a
+#define SCSI_READ_16			0x88
+#define SCSI_WRITE_16			0x8a
+#define SCSI_SYNCHRONIZE_CACHE_16	0x91
+#define SCSI_SERVICE_ACTION_IN_16	0x9e
+#define SCSI_REPORT_LUNS		0xa0
+
+#define SCSI_SAI_READ_CAPACITY_16	0x10
+
+#define SCSI_STATUS_GOOD		0x00
+#define SCSI_STATUS_CHECK_CONDITION	0x02
+
+/* Sense keys and additional sense codes */
+#define SCSI_SENSE_MEDIUM_ERROR		0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST	0x05
+#define SCSI_SENSE_DATA_PROTECT		0x07
+
+#define SCSI_ASC_WRITE_ERROR		0x0c
+#define SCSI_ASC_READ_ERROR		0x11
+#define SCSI_ASC_INVALID_OPCODE		0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE	0x21
+#define SCSI_ASC_INVALID_FIELD		0x24
+#define SCSI_ASC_LUN_NOT_SUPPORTED	0x25
+#define SCSI_ASC_WRITE_PROTECTED	0x27
+
+#define SCSI_SENSE_LEN			18
+
 static LIST_HEAD(sdevs);
 static int compat_id = -1;
 
+struct scsi_dev;
+
+struct scsi_dev_req {
+	struct virt_queue		*vq;
+	struct scsi_dev			*sdev;
+	struct iovec			iov[VIRTIO_SCSI_QUEUE_SIZE];
+	u16				out, in, head;
+
+	/* The data-out or data-in buffer, after the headers */
+	struct iovec			data[VIRTIO_SCSI_QUEUE_SIZE];
+	int				nr_data;
+	u32				data_len;
+	bool				data_in;
+
+	struct virtio_scsi_cmd_req	cmd;
+	struct virtio_scsi_cmd_resp	resp;
+};
+
+struct scsi_dev_queue {
+	struct scsi_dev			*sdev;
+	u32				vq;
+
+	/* Serializes used ring updates and 'inflight' */
+	struct mutex			mutex;
+	u32				inflight;
+	pthread_t			io_thread;
+	int				io_efd;
+
+	struct scsi_dev_req		reqs[VIRTIO_SCSI_QUEUE_SIZE];
+};
+
 struct scsi_dev {
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
+	struct virt_queue		vqs[VIRTIO_SCSI_MAX_VQS];
+	u32				nr_vqs;
 	struct virtio_scsi_config	config;
 	struct vhost_scsi_target	target;
-	u32				features;
+	u64				features;
 	int				vhost_fd;
 	struct virtio_device		vdev;
 	struct list_head		list;
 	struct kvm			*kvm;
+
+	/* Emulation: LUN n is luns[n] */
+	struct disk_image		**luns;
+	u32				nr_luns;
+	struct scsi_dev_queue		*queues;
+	u32				nr_started;	/* queues with an I/O thread */
+	struct mutex			ctrl_lock;
+	struct thread_pool__job		ctrl_job;
 };
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -36,36 +133,669 @@ static u8 *get_config(struct kvm *kvm, void *dev)
 	return ((u8 *)(&sdev->config));
 }
 
-static u32 get_host_features(struct kvm *kvm, void *dev)
+static size_t get_config_size(struct kvm *kvm, void *dev)
+{
+	struct scsi_dev *sdev = dev;
+
+	return sizeof(sdev->config);
+}
+
+static u64 get_host_features(struct kvm *kvm, void *dev)
 {
 	return	1UL << VIRTIO_RING_F_EVENT_IDX |
 		1UL << VIRTIO_RING_F_INDIRECT_DESC;
 }
 
-static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
+static void set_guest_features(struct kvm *kvm, void *dev, u64 features)
 {
 	struct scsi_dev *sdev = dev;
 
 	sdev->features = features;
 }
 
-static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 page_size, u32 align,
-		   u32 pfn)
+static u16 scsi_get_be16(const u8 *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static u32 scsi_get_be32(const u8 *p)
+{
+	return (u32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static u64 scsi_get_be64(const u8 *p)
+{
+	return (u64)scsi_get_be32(p) << 32 | scsi_get_be32(p + 4);
+}
+
+static void scsi_put_be16(u8 *p, u16 val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static void scsi_put_be32(u8 *p, u32 val)
+{
+	scsi_put_be16(p, val >> 16);
+	scsi_put_be16(p + 2, val);
+}
+
+static void scsi_put_be64(u8 *p, u64 val)
+{
+	scsi_put_be32(p, val >> 32);
+	scsi_put_be32(p + 4, val);
+}
+
+/* Only target 0 exists, with LUNs in the flat or peripheral format */
+static struct disk_image *virtio_scsi_lun(struct scsi_dev *sdev, u8 *lun)
+{
+	u32 id = (lun[2] << 8 | lun[3]) & 0x3fff;
+
+	return id < sdev->nr_luns ? sdev->luns[id] : NULL;
+}
+
+static void virtio_scsi_sense(struct scsi_dev_req *req, u8 key, u8 asc)
+{
+	struct virtio_scsi_cmd_resp *resp = &req->resp;
+
+	resp->status	= SCSI_STATUS_CHECK_CONDITION;
+	resp->sense_len	= virtio_host_to_guest_u32(req->vq, SCSI_SENSE_LEN);
+
+	/* Fixed format, current error */
+	resp->sense[0]	= 0x70;
+	resp->sense[2]	= key;
+	resp->sense[7]	= SCSI_SENSE_LEN - 8;
+	resp->sense[12]	= asc;
+}
+
+/* Hand the response and 'done' bytes of data back to the guest */
+static void virtio_scsi_finish(struct scsi_dev_req *req, u32 done, bool inflight)
+{
+	struct scsi_dev *sdev = req->sdev;
+	u32 queueid = req->vq - sdev->vqs;
+	struct scsi_dev_queue *queue = &sdev->queues[queueid - VIRTIO_SCSI_REQ_VQ];
+	u32 len = sizeof(req->resp);
+
+	req->resp.resid = virtio_host_to_guest_u32(req->vq, req->data_len - done);
+	if (req->data_in)
+		len += done;
+
+	memcpy_toiovecend(req->iov + req->out, (void *)&req->resp, 0,
+			  sizeof(req->resp));
+
+	mutex_lock(&queue->mutex);
+	virt_queue__set_used_elem(req->vq, req->head, len);
+	if (inflight)
+		queue->inflight--;
+	mutex_unlock(&queue->mutex);
+
+	if (virtio_queue__should_signal(req->vq))
+		sdev->vdev.ops->signal_vq(sdev->kvm, &sdev->vdev, queueid);
+}
+
+static void virtio_scsi_fail(struct scsi_dev_req *req, u8 key, u8 asc)
+{
+	virtio_scsi_sense(req, key, asc);
+	virtio_scsi_finish(req, 0, false);
+}
+
+/* Completion of reads and writes, called by the disk */
+static void virtio_scsi_complete(void *param, long len)
+{
+	struct scsi_dev_req *req = param;
+
+	if (len < 0) {
+		virtio_scsi_sense(req, SCSI_SENSE_MEDIUM_ERROR, req->data_in ?
+				  SCSI_ASC_READ_ERROR : SCSI_ASC_WRITE_ERROR);
+		len = 0;
+	}
+
+	virtio_scsi_finish(req, len, true);
+}
+
+/* Return emulated data-in, as much as the guest asked for and has room for */
+static void virtio_scsi_data_in(struct scsi_dev_req *req, void *buf, u32 len,
+				u32 alloc_len)
+{
+	len = min(len, alloc_len);
+	len = min(len, req->data_len);
+
+	memcpy_toiovecend(req->data, buf, 0, len);
+	virtio_scsi_finish(req, len, false);
+}
+
+static void virtio_scsi_inquiry(struct scsi_dev_req *req, struct disk_image *disk)
+{
+	u8 *cdb = req->cmd.cdb;
+	u8 buf[64] = { 0 };
+	ssize_t serial_len;
+	u32 len;
+
+	if (!(cdb[1] & 1)) {
+		if (cdb[2])
+			goto invalid;
+
+		/* Without a disk on the LUN, the guest only learns that */
+		buf[0] = disk ? 0x00 : 0x7f;
+		buf[2] = 5;		/* SPC-3 */
+		buf[3] = 2;		/* response data format */
+		buf[4] = 36 - 5;
+		buf[7] = 0x02;		/* command queuing */
+		memcpy(buf + 8, "LKVM    ", 8);
+		memcpy(buf + 16, "VIRTUAL DISK    ", 16);
+		memcpy(buf + 32, "1.0 ", 4);
+		len = 36;
+		goto out;
+	}
+
+	if (!disk)
+		goto invalid;
+
+	buf[1] = cdb[2];
+	switch (cdb[2]) {
+	case 0x00:	/* supported pages */
+		buf[3] = 4;
+		buf[5] = 0x80;
+		buf[6] = 0xb0;
+		buf[7] = 0xb2;
+		len = 8;
+		break;
+	case 0x80:	/* unit serial number */
+		serial_len = 21;
+		disk_image__get_serial(disk, buf + 4, &serial_len);
+		buf[3] = strlen((char *)buf + 4);
+		len = 4 + buf[3];
+		break;
+	case 0xb0:	/* block limits */
+		buf[3] = 0x3c;
+		scsi_put_be32(buf + 8, VIRTIO_SCSI_MAX_SECTORS);
+		if (disk->ops->discard) {
+			scsi_put_be32(buf + 20, VIRTIO_SCSI_MAX_UNMAP_SECTORS);
+			scsi_put_be32(buf + 24, VIRTIO_SCSI_MAX_UNMAP_DESC);
+		}
+		len = 64;
+		break;
+	case 0xb2:	/* logical block provisioning */
+		buf[3] = 4;
+		if (disk->ops->discard) {
+			buf[5] = 0x80;	/* UNMAP supported */
+			buf[6] = 0x02;	/* thin provisioned */
+		}
+		len = 8;
+		break;
+	default:
+		goto invalid;
+	}
+
+out:
+	virtio_scsi_data_in(req, buf, len, scsi_get_be16(cdb + 3));
+	return;
+invalid:
+	virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD);
+}
+
+static void virtio_scsi_report_luns(struct scsi_dev *sdev, struct scsi_dev_req *req)
+{
+	u8 buf[8 + 8 * MAX_DISK_IMAGES] = { 0 };
+	u8 *lun;
+	u32 i;
+
+	scsi_put_be32(buf, sdev->nr_luns * 8);
+	for (i = 0; i < sdev->nr_luns; i++) {
+		lun = buf + 8 + i * 8;
+		if (i < 256) {
+			lun[1] = i;
+		} else {
+			lun[0] = 0x40 | i >> 8;
+			lun[1] = i;
+		}
+	}
+
+	virtio_scsi_data_in(req, buf, 8 + sdev->nr_luns * 8,
+			    scsi_get_be32(req->cmd.cdb + 6));
+}
+
+/*
+ * Only the caching page is there, for the guest to see that the disk has
+ * a write cache and send SYNCHRONIZE CACHE.
+ */
+static void virtio_scsi_mode_sense(struct scsi_dev_req *req,
+				   struct disk_image *disk, bool ten)
+{
+	u8 *cdb = req->cmd.cdb;
+	u8 page = cdb[2] & 0x3f;
+	u32 hdr = ten ? 8 : 4;
+	u8 wp = !disk->ops->write ? 0x80 : 0;
+	u8 buf[28] = { 0 };
+	u32 len = hdr + 20;
+
+	if (page != 0x08 && page != 0x3f) {
+		virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				 SCSI_ASC_INVALID_FIELD);
+		return;
+	}
+
+	if (ten) {
+		scsi_put_be16(buf, len - 2);
+		buf[3] = wp;
+	} else {
+		buf[0] = len - 1;
+		buf[2] = wp;
+	}
+
+	buf[hdr]	= 0x08;
+	buf[hdr + 1]	= 0x12;
+	buf[hdr + 2]	= 0x04;	/* write cache enabled */
+
+	virtio_scsi_data_in(req, buf, len,
+			    ten ? scsi_get_be16(cdb + 7) : cdb[4]);
+}
+
+static void virtio_scsi_read_capacity(struct scsi_dev_req *req,
+				      struct disk_image *disk, bool sixteen)
+{
+	u64 last = (disk->size >> SECTOR_SHIFT) - 1;
+	u8 *cdb = req->cmd.cdb;
+	u8 buf[32] = { 0 };
+
+	if (!sixteen) {
+		scsi_put_be32(buf, min_t(u64, last, 0xffffffff));
+		scsi_put_be32(buf + 4, SECTOR_SIZE);
+		virtio_scsi_data_in(req, buf, 8, 8);
+		return;
+	}
+
+	scsi_put_be64(buf, last);
+	scsi_put_be32(buf + 8, SECTOR_SIZE);
+	if (disk->ops->discard)
+		buf[14] = 0x80;	/* thin provisioning enabled */
+
+	virtio_scsi_data_in(req, buf, sizeof(buf), scsi_get_be32(cdb + 10));
+}
+
+static void virtio_scsi_rw(struct scsi_dev_req *req, struct disk_image *disk,
+			   u64 lba, u32 nr_blocks, bool write)
+{
+	struct scsi_dev *sdev = req->sdev;
+	struct scsi_dev_queue *queue;
+	u64 nr_sectors = disk->size >> SECTOR_SHIFT;
+	u64 wait;
+	u32 len;
+	ssize_t r;
+
+	if (lba > nr_sectors || nr_blocks > nr_sectors - lba) {
+		virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				 SCSI_ASC_LBA_OUT_OF_RANGE);
+		return;
+	}
+
+	/* Nothing to transfer, so no buffer either way: not an error */
+	if (!nr_blocks) {
+		virtio_scsi_finish(req, 0, false);
+		return;
+	}
+
+	len = nr_blocks << SECTOR_SHIFT;
+	if (nr_blocks > VIRTIO_SCSI_MAX_SECTORS || len > req->data_len ||
+	    write == req->data_in) {
+		virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				 SCSI_ASC_INVALID_FIELD);
+		return;
+	}
+
+	if (write && !disk->ops->write) {
+		virtio_scsi_fail(req, SCSI_SENSE_DATA_PROTECT,
+				 SCSI_ASC_WRITE_PROTECTED);
+		return;
+	}
+
+	/* Trim the buffer to the transfer, in place */
+	iov_slice(req->data, &req->nr_data, req->nr_data, req->data,
+		  req->nr_data, 0, len);
+
+	queue = &sdev->queues[req->vq - sdev->vqs - VIRTIO_SCSI_REQ_VQ];
+	mutex_lock(&queue->mutex);
+	queue->inflight++;
+	mutex_unlock(&queue->mutex);
+
+	/* Honour the LUN's I/O limits, like virtio-blk, on this queue's thread */
+	wait = disk_image__qos_charge(disk, write, 1, len);
+	if (wait) {
+		disk_image__submit(disk);
+		usleep(wait / 1000);
+	}
+
+	if (write)
+		r = disk_image__write(disk, lba, req->data, req->nr_data, req);
+	else
+		r = disk_image__read(disk, lba, req->data, req->nr_data, req);
+
+	/* Failed submissions are not completed by the disk */
+	if (r < 0)
+		virtio_scsi_complete(req, r);
+}
+
+static void virtio_scsi_unmap(struct scsi_dev_req *req, struct disk_image *disk)
+{
+	u8 buf[8 + 16 * VIRTIO_SCSI_MAX_UNMAP_DESC];
+	u32 len = scsi_get_be16(req->cmd.cdb + 7);
+	u32 i, nr;
+	u8 *desc;
+	int r;
+
+	if (!disk->ops->discard) {
+		virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				 SCSI_ASC_INVALID_OPCODE);
+		return;
+	}
+
+	if (!disk->ops->write) {
+		virtio_scsi_fail(req, SCSI_SENSE_DATA_PROTECT,
+				 SCSI_ASC_WRITE_PROTECTED);
+		return;
+	}
+
+	if (len > sizeof(buf) || len > req->data_len || req->data_in) {
+		virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				 SCSI_ASC_INVALID_FIELD);
+		return;
+	}
+
+	if (len < 8) {
+		virtio_scsi_finish(req, len, false);
+		return;
+	}
+
+	memcpy_fromiovecend(buf, req->data, 0, len);
+	nr = min_t(u32, scsi_get_be16(buf + 2), len - 8) / 16;
+
+	for (i = 0; i < nr; i++) {
+		desc = buf + 8 + i * 16;
+		r = disk_image__discard(disk, scsi_get_be64(desc),
+					scsi_get_be32(desc + 8),
+					DISK_IMAGE_DISCARD_UNMAP);
+		if (r == -EINVAL) {
+			virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST,
+					 SCSI_ASC_LBA_OUT_OF_RANGE);
+			return;
+		}
+		if (r < 0) {
+			virtio_scsi_fail(req, SCSI_SENSE_MEDIUM_ERROR,
+					 SCSI_ASC_WRITE_ERROR);
+			return;
+		}
+	}
+
+	virtio_scsi_finish(req, len, false);
+}
+
+static void virtio_scsi_do_cmd(struct scsi_dev *sdev, struct scsi_dev_req *req)
+{
+	struct disk_image *disk = virtio_scsi_lun(sdev, req->cmd.lun);
+	u8 *cdb = req->cmd.cdb;
+	u8 sense[SCSI_SENSE_LEN] = { 0x70, [7] = SCSI_SENSE_LEN - 8 };
+
+	switch (cdb[0]) {
+	case SCSI_INQUIRY:
+		virtio_scsi_inquiry(req, disk);
+		return;
+	case SCSI_REPORT_LUNS:
+		virtio_scsi_report_luns(sdev, req);
+		return;
+	}
+
+	if (!disk) {
+		virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST,
+				 SCSI_ASC_LUN_NOT_SUPPORTED);
+		return;
+	}
+
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_START_STOP_UNIT:
+		virtio_scsi_finish(req, 0, false);
+		break;
+	case SCSI_REQUEST_SENSE:
+		/* Errors are reported with the response, there's never any left */
+		virtio_scsi_data_in(req, sense, sizeof(sense), cdb[4]);
+		break;
+	case SCSI_MODE_SENSE_6:
+		virtio_scsi_mode_sense(req, disk, false);
+		break;
+	case SCSI_MODE_SENSE_10:
+		virtio_scsi_mode_sense(req, disk, true);
+		break;
+	case SCSI_READ_CAPACITY_10:
+		virtio_scsi_read_capacity(req, disk, false);
+		break;
+	case SCSI_SERVICE_ACTION_IN_16:
+		if ((cdb[1] & 0x1f) != SCSI_SAI_READ_CAPACITY_16)
+			goto invalid;
+		virtio_scsi_read_capacity(req, disk, true);
+		break;
+	case SCSI_READ_10:
+		virtio_scsi_rw(req, disk, scsi_get_be32(cdb + 2),
+			       scsi_get_be16(cdb + 7), false);
+		break;
+	case SCSI_READ_16:
+		virtio_scsi_rw(req, disk, scsi_get_be64(cdb + 2),
+			       scsi_get_be32(cdb + 10), false);
+		break;
+	case SCSI_WRITE_10:
+		virtio_scsi_rw(req, disk, scsi_get_be32(cdb + 2),
+			       scsi_get_be16(cdb + 7), true);
+		break;
+	case SCSI_WRITE_16:
+		virtio_scsi_rw(req, disk, scsi_get_be64(cdb + 2),
+			       scsi_get_be32(cdb + 10), true);
+		break;
+	case SCSI_SYNCHRONIZE_CACHE_10:
+	case SCSI_SYNCHRONIZE_CACHE_16:
+		if (disk_image__flush(disk) < 0)
+			virtio_scsi_fail(req, SCSI_SENSE_MEDIUM_ERROR,
+					 SCSI_ASC_WRITE_ERROR);
+		else
+			virtio_scsi_finish(req, 0, false);
+		break;
+	case SCSI_UNMAP:
+		virtio_scsi_unmap(req, disk);
+		break;
+	default:
+		goto invalid;
+	}
+
+	return;
+invalid:
+	virtio_scsi_fail(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_OPCODE);
+}
+
+static void virtio_scsi_do_req(struct scsi_dev *sdev, struct scsi_dev_req *req)
+{
+	size_t out_len = iov_size(req->iov, req->out);
+	size_t in_len = iov_size(req->iov + req->out, req->in);
+	struct scsi_dev_queue *queue;
+
+	if (out_len < sizeof(req->cmd) || in_len < sizeof(req->resp)) {
+		pr_warning("virtio-scsi: malformed request");
+		queue = &sdev->queues[req->vq - sdev->vqs - VIRTIO_SCSI_REQ_VQ];
+		mutex_lock(&queue->mutex);
+		virt_queue__set_used_elem(req->vq, req->head, 0);
+		mutex_unlock(&queue->mutex);
+
+		if (virtio_queue__should_signal(req->vq))
+			sdev->vdev.ops->signal_vq(sdev->kvm, &sdev->vdev,
+						  req->vq - sdev->vqs);
+		return;
+	}
+
+	memcpy_fromiovecend((void *)&req->cmd, req->iov, 0, sizeof(req->cmd));
+	memset(&req->resp, 0, sizeof(req->resp));
+
+	/* Bidirectional commands aren't offered, data goes one way */
+	req->data_in = out_len == sizeof(req->cmd);
+	if (req->data_in)
+		req->data_len = iov_slice(req->data, &req->nr_data,
+					  ARRAY_SIZE(req->data),
+					  req->iov + req->out, req->in,
+					  sizeof(req->resp),
+					  in_len - sizeof(req->resp));
+	else
+		req->data_len = iov_slice(req->data, &req->nr_data,
+					  ARRAY_SIZE(req->data),
+					  req->iov, req->out, sizeof(req->cmd),
+					  out_len - sizeof(req->cmd));
+
+	if (req->cmd.lun[0] != 1 || req->cmd.lun[1] != 0) {
+		req->resp.response = VIRTIO_SCSI_S_BAD_TARGET;
+		virtio_scsi_finish(req, 0, false);
+		return;
+	}
+
+	virtio_scsi_do_cmd(sdev, req);
+}
+
+static void virtio_scsi_do_io(struct kvm *kvm, struct virt_queue *vq,
+			      struct scsi_dev_queue *queue)
+{
+	struct scsi_dev *sdev = queue->sdev;
+	struct scsi_dev_req *req;
+	u16 head;
+	u32 i;
+
+	while (virt_queue__available(vq)) {
+		head		= virt_queue__pop(vq);
+		req		= &queue->reqs[head];
+		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out,
+					&req->in, head, kvm);
+		req->vq		= vq;
+
+		virtio_scsi_do_req(sdev, req);
+	}
+
+	for (i = 0; i < sdev->nr_luns; i++)
+		disk_image__submit(sdev->luns[i]);
+}
+
+/*
+ * Requests can't be cancelled, but they all complete on their own: task
+ * management functions wait for that and report success.
+ */
+static void virtio_scsi_drain(struct scsi_dev *sdev)
+{
+	struct scsi_dev_queue *queue;
+	u32 i, inflight;
+
+	for (i = 0; i < sdev->nr_vqs - VIRTIO_SCSI_REQ_VQ; i++) {
+		queue = &sdev->queues[i];
+		do {
+			mutex_lock(&queue->mutex);
+			inflight = queue->inflight;
+			mutex_unlock(&queue->mutex);
+			if (inflight)
+				msleep(1);
+		} while (inflight);
+	}
+}
+
+/*
+ * Task management functions wait for the disks, so the controlq is served
+ * by the thread pool rather than by whoever notified it.
+ */
+static void virtio_scsi_do_ctrl(struct kvm *kvm, void *param)
+{
+	struct scsi_dev *sdev = param;
+	struct virt_queue *vq = &sdev->vqs[VIRTIO_SCSI_CTRL_VQ];
+	struct iovec iov[VIRTIO_SCSI_QUEUE_SIZE];
+	struct virtio_scsi_ctrl_an_resp an;
+	struct virtio_scsi_ctrl_tmf_resp tmf;
+	u16 out, in, head;
+	void *resp;
+	u32 type, len;
+
+	mutex_lock(&sdev->ctrl_lock);
+	while (virt_queue__available(vq)) {
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+		len = 0;
+
+		if (iov_size(iov, out) >= sizeof(type)) {
+			memcpy_fromiovecend((void *)&type, iov, 0, sizeof(type));
+			type = virtio_guest_to_host_u32(vq, type);
+		} else {
+			type = -1;
+		}
+
+		switch (type) {
+		case VIRTIO_SCSI_T_TMF:
+			virtio_scsi_drain(sdev);
+			tmf = (struct virtio_scsi_ctrl_tmf_resp) {
+				.response	= VIRTIO_SCSI_S_OK,
+			};
+			resp = &tmf;
+			len = sizeof(tmf);
+			break;
+		case VIRTIO_SCSI_T_AN_QUERY:
+		case VIRTIO_SCSI_T_AN_SUBSCRIBE:
+			/* No asynchronous events are ever sent */
+			an = (struct virtio_scsi_ctrl_an_resp) {
+				.response	= VIRTIO_SCSI_S_OK,
+			};
+			resp = &an;
+			len = sizeof(an);
+			break;
+		default:
+			pr_warning("virtio-scsi: unknown control request %u", type);
+			break;
+		}
+
+		if (len && iov_size(iov + out, in) >= len)
+			memcpy_toiovecend(iov + out, resp, 0, len);
+		else
+			len = 0;
+
+		virt_queue__stage_used_elem(vq, head, len);
+	}
+	virt_queue__publish_used(vq);
+	mutex_unlock(&sdev->ctrl_lock);
+
+	if (virtio_queue__should_signal(vq))
+		sdev->vdev.ops->signal_vq(kvm, &sdev->vdev, VIRTIO_SCSI_CTRL_VQ);
+}
+
+static void *virtio_scsi_thread(void *p)
+{
+	struct scsi_dev_queue *queue = p;
+	struct scsi_dev *sdev = queue->sdev;
+	u64 data;
+	int r;
+
+	kvm__set_thread_name("virtio-scsi-io");
+
+	while (1) {
+		r = read(queue->io_efd, &data, sizeof(u64));
+		if (r < 0)
+			continue;
+		virtio_scsi_do_io(sdev->kvm, &sdev->vqs[queue->vq], queue);
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct vhost_vring_state state = { .index = vq };
 	struct vhost_vring_addr addr;
 	struct scsi_dev *sdev = dev;
 	struct virt_queue *queue;
-	void *p;
 	int r;
 
+	if (vq >= sdev->nr_vqs)
+		return -EINVAL;
+
 	compat__remove_message(compat_id);
 
 	queue		= &sdev->vqs[vq];
-	queue->pfn	= pfn;
-	p		= virtio_get_vq(kvm, queue->pfn, page_size);
-
-	vring_init(&queue->vring, VIRTIO_SCSI_QUEUE_SIZE, p, align);
+	virtio_init_device_vq(kvm, &sdev->vdev, queue, VIRTIO_SCSI_QUEUE_SIZE);
 
 	if (sdev->vhost_fd == 0)
 		return 0;
@@ -147,14 +877,38 @@ static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct scsi_dev *sdev = dev;
+	u64 data = 1;
+	int r;
+
+	if (sdev->vhost_fd || vq >= sdev->nr_vqs)
+		return 0;
+
+	switch (vq) {
+	case VIRTIO_SCSI_CTRL_VQ:
+		thread_pool__do_job(&sdev->ctrl_job);
+		break;
+	case VIRTIO_SCSI_EVENT_VQ:
+		/* Buffers for events that never come */
+		break;
+	default:
+		r = write(sdev->queues[vq - VIRTIO_SCSI_REQ_VQ].io_efd, &data,
+			  sizeof(data));
+		if (r < 0)
+			return r;
+	}
+
 	return 0;
 }
 
-static int get_pfn_vq(struct kvm *kvm, void *dev, u32 vq)
+static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct scsi_dev *sdev = dev;
 
-	return sdev->vqs[vq].pfn;
+	if (vq >= sdev->nr_vqs)
+		return NULL;
+
+	return &sdev->vqs[vq];
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -169,10 +923,11 @@ static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 
 static struct virtio_ops scsi_dev_virtio_ops = (struct virtio_ops) {
 	.get_config		= get_config,
+	.get_config_size	= get_config_size,
 	.get_host_features	= get_host_features,
 	.set_guest_features	= set_guest_features,
 	.init_vq		= init_vq,
-	.get_pfn_vq		= get_pfn_vq,
+	.get_vq			= get_vq,
 	.get_size_vq		= get_size_vq,
 	.set_size_vq		= set_size_vq,
 	.notify_vq		= notify_vq,
@@ -246,6 +1001,7 @@ static int virtio_scsi_init_one(struct kvm *kvm, struct disk_image *disk)
 			.max_lun	= 16383,
 			.event_info_size = sizeof(struct virtio_scsi_event),
 		},
+		.nr_vqs			= NUM_VIRT_QUEUES,
 		.kvm			= kvm,
 	};
 	strncpy((char *)&sdev->target.vhost_wwpn, disk->wwpn, sizeof(sdev->target.vhost_wwpn));
@@ -265,15 +1021,134 @@ static int virtio_scsi_init_one(struct kvm *kvm, struct disk_image *disk)
 	return 0;
 }
 
+static int virtio_scsi_init_queue(struct kvm *kvm, struct scsi_dev *sdev, u32 id)
+{
+	struct scsi_dev_queue *queue = &sdev->queues[id];
+	unsigned int i;
+	int r;
+
+	queue->sdev	= sdev;
+	queue->vq	= VIRTIO_SCSI_REQ_VQ + id;
+	queue->io_efd	= eventfd(0, 0);
+	if (queue->io_efd < 0)
+		return -errno;
+
+	mutex_init(&queue->mutex);
+
+	for (i = 0; i < ARRAY_SIZE(queue->reqs); i++)
+		queue->reqs[i].sdev = sdev;
+
+	r = pthread_create(&queue->io_thread, NULL, virtio_scsi_thread, queue);
+	if (r) {
+		close(queue->io_efd);
+		return -r;
+	}
+
+	return 0;
+}
+
+/* One controller, with a LUN for each disk image that asked for it */
+static int virtio_scsi_init_emul(struct kvm *kvm)
+{
+	struct scsi_dev *sdev;
+	u32 nr_luns = 0, nr_queues = 1;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < (unsigned int)kvm->nr_disks; i++) {
+		if (kvm->disks[i]->wwpn || !kvm->disks[i]->scsi)
+			continue;
+		nr_luns++;
+		nr_queues = max_t(u32, nr_queues, kvm->disks[i]->queues);
+	}
+
+	if (!nr_luns)
+		return 0;
+
+	nr_queues = min_t(u32, nr_queues, VIRTIO_SCSI_MAX_QUEUES);
+
+	sdev = calloc(1, sizeof(struct scsi_dev));
+	if (sdev == NULL)
+		return -ENOMEM;
+
+	*sdev = (struct scsi_dev) {
+		.config	= (struct virtio_scsi_config) {
+			.num_queues	= nr_queues,
+			.seg_max	= VIRTIO_SCSI_QUEUE_SIZE - 2,
+			.max_sectors	= VIRTIO_SCSI_MAX_SECTORS,
+			.cmd_per_lun	= VIRTIO_SCSI_QUEUE_SIZE,
+			.sense_size	= VIRTIO_SCSI_SENSE_SIZE,
+			.cdb_size	= VIRTIO_SCSI_CDB_SIZE,
+			.max_channel	= 0,
+			.max_target	= 0,
+			.max_lun	= nr_luns - 1,
+			.event_info_size = sizeof(struct virtio_scsi_event),
+		},
+		.nr_vqs			= VIRTIO_SCSI_REQ_VQ + nr_queues,
+		.kvm			= kvm,
+	};
+
+	sdev->luns = calloc(nr_luns, sizeof(*sdev->luns));
+	sdev->queues = calloc(nr_queues, sizeof(*sdev->queues));
+	if (!sdev->luns || !sdev->queues) {
+		free(sdev->luns);
+		free(sdev->queues);
+		free(sdev);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (unsigned int)kvm->nr_disks; i++) {
+		if (kvm->disks[i]->wwpn || !kvm->disks[i]->scsi)
+			continue;
+		disk_image__set_callback(kvm->disks[i], virtio_scsi_complete);
+		sdev->luns[sdev->nr_luns++] = kvm->disks[i];
+	}
+
+	mutex_init(&sdev->ctrl_lock);
+	thread_pool__init_job(&sdev->ctrl_job, kvm, virtio_scsi_do_ctrl, sdev);
+
+	virtio_init(kvm, sdev, &sdev->vdev, &scsi_dev_virtio_ops,
+		    VIRTIO_DEFAULT_TRANS(kvm), PCI_DEVICE_ID_VIRTIO_SCSI,
+		    VIRTIO_ID_SCSI, PCI_CLASS_BLK);
+
+	list_add_tail(&sdev->list, &sdevs);
+
+	for (i = 0; i < nr_queues; i++) {
+		r = virtio_scsi_init_queue(kvm, sdev, i);
+		if (r < 0)
+			return r;
+		sdev->nr_started++;
+	}
+
+	if (compat_id == -1)
+		compat_id = virtio_compat_add_message("virtio-scsi", "CONFIG_VIRTIO_SCSI");
+
+	return 0;
+}
+
 static int virtio_scsi_exit_one(struct kvm *kvm, struct scsi_dev *sdev)
 {
+	struct scsi_dev_queue *queue;
+	u32 i;
 	int r;
 
-	r = ioctl(sdev->vhost_fd, VHOST_SCSI_CLEAR_ENDPOINT, &sdev->target);
-	if (r != 0)
-		die("VHOST_SCSI_CLEAR_ENDPOINT failed %d", errno);
+	if (sdev->vhost_fd) {
+		r = ioctl(sdev->vhost_fd, VHOST_SCSI_CLEAR_ENDPOINT, &sdev->target);
+		if (r != 0)
+			die("VHOST_SCSI_CLEAR_ENDPOINT failed %d", errno);
+	}
+
+	/* The I/O threads use the queues until they are gone */
+	for (i = 0; i < sdev->nr_started; i++) {
+		queue = &sdev->queues[i];
+		pthread_cancel(queue->io_thread);
+		pthread_join(queue->io_thread, NULL);
+		close(queue->io_efd);
+	}
 
 	list_del(&sdev->list);
+	free(sdev->luns);
+	free(sdev->queues);
 	free(sdev);
 
 	return 0;
@@ -291,6 +1166,10 @@ int virtio_scsi_init(struct kvm *kvm)
 			goto cleanup;
 	}
 
+	r = virtio_scsi_init_emul(kvm);
+	if (r < 0)
+		goto cleanup;
+
 	return 0;
 cleanup:
 	return virtio_scsi_exit(kvm);
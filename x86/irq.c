@@ -1,5 +1,6 @@
 #include "kvm/irq.h"
 #include "kvm/kvm.h"
+#include "kvm/mutex.h"
 #include "kvm/util.h"
 
 #include <linux/types.h>
@@ -11,7 +12,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 
-#define IRQ_MAX_GSI			64
+#define IRQ_MAX_GSI			1024
 #define IRQCHIP_MASTER			0
 #define IRQCHIP_SLAVE			1
 #define IRQCHIP_IOAPIC			2
@@ -21,9 +22,12 @@ static u32 gsi = 24;
 
 struct kvm_irq_routing *irq_routing;
 
+/* Serializes changes to MSI routes, which vCPUs make */
+static DEFINE_MUTEX(irq_routing_lock);
+
 static int irq__add_routing(u32 gsi, u32 type, u32 irqchip, u32 pin)
 {
-	if (gsi >= IRQ_MAX_GSI)
+	if (irq_routing->nr >= IRQ_MAX_GSI)
 		return -ENOSPC;
 
 	irq_routing->entries[irq_routing->nr++] =
@@ -84,6 +88,13 @@ int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg)
 {
 	int r;
 
+	/* GSIs 0-23 take more entries than that, 'nr' runs ahead of 'gsi' */
+	mutex_lock(&irq_routing_lock);
+	if (irq_routing->nr >= IRQ_MAX_GSI) {
+		mutex_unlock(&irq_routing_lock);
+		return -ENOSPC;
+	}
+
 	irq_routing->entries[irq_routing->nr++] =
 		(struct kvm_irq_routing_entry) {
 			.gsi = gsi,
@@ -94,8 +105,41 @@ int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg)
 		};
 
 	r = ioctl(kvm->vm_fd, KVM_SET_GSI_ROUTING, irq_routing);
-	if (r)
-		return r;
+	if (r) {
+		irq_routing->nr--;
+		mutex_unlock(&irq_routing_lock);
+		return -errno;
+	}
+
+	r = gsi++;
+	mutex_unlock(&irq_routing_lock);
+
+	return r;
+}
+
+/* Point the MSI route 'gsi' at a new message */
+int irq__update_msix_route(struct kvm *kvm, u32 gsi, struct msi_msg *msg)
+{
+	struct kvm_irq_routing_entry *entry;
+	unsigned int i;
+	int r = -ENOENT;
+
+	mutex_lock(&irq_routing_lock);
+	for (i = 0; i < irq_routing->nr; i++) {
+		entry = &irq_routing->entries[i];
+		if (entry->gsi != gsi || entry->type != KVM_IRQ_ROUTING_MSI)
+			continue;
+
+		entry->u.msi.address_hi	= msg->address_hi;
+		entry->u.msi.address_lo	= msg->address_lo;
+		entry->u.msi.data	= msg->data;
+
+		r = ioctl(kvm->vm_fd, KVM_SET_GSI_ROUTING, irq_routing);
+		if (r)
+			r = -errno;
+		break;
+	}
+	mutex_unlock(&irq_routing_lock);
 
-	return gsi++;
+	return r;
 }